@@ -1,146 +1,7021 @@
+#define _GNU_SOURCE
+
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/pidfd.h>
+#include <sys/timerfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <dirent.h>
+#include <poll.h>
+#include <stdint.h>
 
-#define READ_BUFFER_SIZE 256
-#define MAX_PROMPT_SIZE 128
-#define MAX_ARGS (READ_BUFFER_SIZE / 2)
+#define PROMPT_DIRECTIVE_SIZE 32 // longest expansion of one % directive, the prompt buffer is sized from the format
+#define JOB_TABLE_INITIAL_SIZE 16 // doubled when every slot is taken
+#define HASH_TABLE_SIZE 256 // power of two, linear probing
+#define HASH_NAME_SIZE 256
+#define HASH_PATH_SIZE 1024
+#define HASH_PATH_VAR_SIZE 4096
+#define MESSAGE_BUFFER_SIZE 256
+#define LINE_READER_CHUNK 65536 // initial buffer of the line reader, doubled whenever a line does not fit
+#define ARENA_BLOCK_SIZE 65536 // per-line allocations, larger requests get a block of their own
+#define ARENA_RETAIN_SIZE (1024 * 1024) // blocks kept across lines, above this a reset gives the extra ones back
+#define ARENA_ALIGNMENT 8
+#define COPY_CHUNK_SIZE (1L << 30) // per copy_file_range / sendfile / splice call
+#define EVENT_BATCH 64 // ready descriptors taken per epoll_wait()
+#define COPY_BUFFER_SIZE 65536 // read/write fallback when the kernel cannot copy between the two descriptors
+#define FD_RELOCATION_BASE 10 // descriptors the shell opens for a command are moved at or above this number
+#define MAX_IO_NUMBER_DIGITS 4
+#define DIR_CACHE_SLOTS 64 // directory listings kept for globbing, the least recently used one is read again
+#define DIR_CACHE_READ_SIZE 32768 // getdents64 buffer
+#define WORD_BUFFER_INITIAL_SIZE 256
+#define EXPANSION_INITIAL_FIELDS 16
+#define EXPAND_NUMBER_SIZE 16
+#define PASSWD_PATH "/etc/passwd"
+#define PASSWD_READ_SIZE 4096
+#define PASSWD_HOME_FIELD 5 // fields before the home directory: name, password, uid, gid, gecos
+#define DIR_CACHE_RACY_NS 20000000L // a listing read this close to the directory's mtime is read again: a later change may have the same mtime
+#define DIR_CACHE_COARSE_RACY_NS 2000000000L // same for whole-second mtimes, FAT keeps 2s timestamps
 
 #define WELCOME_MESSAGE "Welcome to ENSEA Tiny Shell.\nType 'exit' to quit.\n"
 #define GOODBYE_MESSAGE "Bye bye...\n"
 
 #define PROMPT_DEFAULT "enseash % "
-#define PROMPT_EXIT_PREFIX "enseash [exit:"
-#define PROMPT_SIGN_PREFIX "enseash [sign:"
-#define PROMPT_SUFFIX "] % "
+#define PROMPT_FORMAT_ENV "ENSEASH_PROMPT" // prompt template used once a command has run
+#define PROMPT_FORMAT_DEFAULT "enseash [%e|%tms] %% "
+#define STATS_LOG_ENV "ENSEASH_STATS_LOG" // file receiving one JSON object per command
+#define STATS_LOG_LINE_SIZE 1024
+#define HISTORY_ENV "ENSEASH_HISTORY" // history ring file, ~/.enseash_history by default in interactive sessions, empty to disable
+#define HISTORY_SIZE_ENV "ENSEASH_HISTORY_SIZE" // capacity of a new ring file, in MB
+#define HISTORY_FILE_NAME ".enseash_history"
+#define HISTORY_DEFAULT_SIZE (16L * 1024 * 1024) // a few hundred thousand commands
+#define HISTORY_MAGIC "ENSHIST1"
+#define HISTORY_ALIGNMENT 8
+#define HISTORY_PADDING 0xffffffffu // length of the filler record at the end of the ring
+#define HISTORY_SORTED_BLOCK 64 // the newest entry of each block of the sorted index is kept, for range queries
+#define HISTORY_UNSORTED_MAX 4096 // recent entries scanned by a prefix search before they are merged into the sorted index
+#define HISTORY_INDEX_INITIAL_SIZE 1024
+#define HISTORY_DEFAULT_SHOW 20
+#define HISTORY_USAGE_MSG "usage: history [count | -p prefix | -s text | -c]\n"
+#define HISTORY_USAGE_MSG_LENGTH 50
+#define HISTORY_EVENT_MSG "enseash: event not found\n"
+#define HISTORY_EVENT_MSG_LENGTH 25
+#define EDITOR_INITIAL_SIZE 256 // edited line, doubled when full
+#define EDITOR_READ_SIZE 256 // bytes taken from the terminal per read(), a paste is redrawn once per chunk
+#define EDITOR_DEFAULT_COLUMNS 80 // when the terminal does not report its width
+#define EDITOR_LIST_MAX 100 // candidates shown by a second Tab
+#define EDITOR_SEARCH_PROMPT "(reverse-i-search)`"
+#define EDITOR_FAILED_SEARCH_PROMPT "(failed reverse-i-search)`"
+#define PATH_TRIE_INITIAL_SIZE 4096 // nodes, doubled when full
+#define PATH_TRIE_MAX_DIRS 63 // PATH directories tracked, one bit each in a node
+#define PATH_TRIE_BUILTINS 63 // bit of the builtins
+#define INOTIFY_BUFFER_SIZE 4096
+#define CGROUP_ENV "ENSEASH_CGROUP" // cgroup v2 directory under which every command gets a leaf of its own
+#define CGROUP_PROMPT_FORMAT_DEFAULT "enseash [%e|%tms|cpu %Cms|peak %PK] %% " // used instead when ENSEASH_CGROUP is set
+#define CGROUP_NAME_SIZE 64
+#define CGROUP_FILE_SIZE 1024
+#define CGROUP_SETTING_COUNT 3
+#define CGROUP_USAGE_MSG "usage: cgroup [dir | off | cpu.max value | memory.max value | io.max value]\n"
+#define CGROUP_USAGE_MSG_LENGTH 76
+#define TRACE_ENV "ENSEASH_TRACE" // trace file written at exit, Chrome JSON unless the name ends in .bin; tracing then starts with the shell
+#define TRACE_BINARY_SUFFIX ".bin"
+#define TRACE_RING_SIZE 65536 // events, a power of two: the oldest ones are overwritten
+#define TRACE_NAME_SIZE 28
+#define TRACE_CHILDREN 256 // children whose run is timed at once
+#define TRACE_MAGIC "ENSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_USAGE_MSG "usage: trace [on | off | clear | json file | binary file]\n"
+#define TRACE_USAGE_MSG_LENGTH 58
+#define MEMO_DIR_ENV "ENSEASH_MEMO_DIR" // result cache of the memo prefix, ~/.cache/enseash/memo by default
+#define MEMO_SIZE_ENV "ENSEASH_MEMO_SIZE" // bound of the result cache, in MB
+#define MEMO_DIR_DEFAULT ".cache/enseash/memo" // under HOME
+#define MEMO_DEFAULT_SIZE (64L * 1024 * 1024)
+#define MEMO_MAGIC "ENSMEMO1"
+#define MEMO_NAME_SIZE 17 // 16 hex digits of the key hash
+#define MEMO_TEMP_NAME_SIZE 64
+#define MEMO_INITIAL_FILES 256
+#define MEMO_USAGE_MSG "usage: memo [-c] | memo command [args...]\n"
+#define MEMO_USAGE_MSG_LENGTH 42
+#define SNAPSHOT_ENV "ENSEASH_SNAPSHOT" // startup snapshot written by the snapshot builtin, mapped before the first prompt
+#define SNAPSHOT_MAGIC "ENSSNAP1"
+#define SNAPSHOT_TEMP_SUFFIX_SIZE 16 // ".pid" of the file renamed into place
+#define SNAPSHOT_USAGE_MSG "usage: snapshot file [command...]\n"
+#define SNAPSHOT_USAGE_MSG_LENGTH 34
+#define SNAPSHOT_MSG "snapshot: unreadable or not a snapshot file\n"
+#define SNAPSHOT_MSG_LENGTH 44
+
+#define QUIET_FLAG "-q" // no welcome, goodbye or batch summary
+#define COMMAND_FLAG "-c" // enseash -c "line": runs the line and exits with its status, quiet
+
+
+#define BUILTIN_NAME_SIZE 16
+#define BUILTIN_OUTPUT_SIZE 4096 // echo and printf flush their output in blocks of this size
+
+#define DEFAULT_PATH "/bin:/usr/bin" // used by glibc's execvp when PATH is unset
+
+#define LIMIT_KILL_GRACE_DEFAULT_MS 2000 // between SIGTERM and SIGKILL once the deadline has passed
+#define LIMIT_TIMEOUT_EXIT_STATUS 124 // status of a command that hit its deadline, foreground or background, as timeout(1)
+#define LIMIT_USAGE_MSG "usage: limit [-t time] [-c cpu_seconds] [-m size] [-k grace] command line\n"
+#define LIMIT_USAGE_MSG_LENGTH 74
+#define LIMITS_USAGE_MSG "usage: limits [-t time] [-c cpu_seconds] [-m size] [-k grace]\n"
+#define LIMITS_USAGE_MSG_LENGTH 62
+#define LIMIT_FAILED_MSG "Cannot set the limits.\n"
+#define LIMIT_FAILED_MSG_LENGTH 23
+
+#define PARALLEL_SEPARATOR ":::"
+#define PARALLEL_FILE_SEPARATOR "::::"
+#define PARALLEL_INITIAL_ITEMS 1024
+#define PARALLEL_COPY_SIZE 65536 // grouped output is copied to stdout in blocks of this size
+#define PARALLEL_MAX_PENDING 256 // -k: items started but not written yet, each holds its memfd open
+#define PARALLEL_MAX_FAILURE_STATUS 101 // exit status is the number of failed jobs, capped like GNU parallel
+#define PARALLEL_USAGE_MSG "usage: parallel [-j N] [-k] [-v] [-b] command ::: words | [command] :::: files\n"
+#define PARALLEL_USAGE_MSG_LENGTH 79
+
+#define COPROC_TIMEOUT_MS 5000 // longest wait for the response line of a coprocess
+#define COPROC_USAGE_MSG "usage: coproc [start name command... | stop name | name request...]\n"
+#define COPROC_USAGE_MSG_LENGTH 68
 
-#define EXIT_CMD "exit"
-#define EXIT_CMD_LENGTH 4
+#define DAEMON_FLAG "-d"
+#define DAEMON_BACKLOG 64
+#define DAEMON_RETRY_MS 100 // pause after a failed accept(), e.g. EMFILE, instead of spinning on the readable listener
+#define DAEMON_MSG "Daemon socket error\n"
+#define DAEMON_MSG_LENGTH 20
+#define DAEMON_IN_USE_MSG "Daemon socket path in use\n"
+#define DAEMON_IN_USE_MSG_LENGTH 26
+
+#define SPAWN_ENGINE_ENV "ENSEASH_SPAWN" // set to "fork" to fall back to the fork+execvp engine
+#define SPAWN_ENGINE_FORK_NAME "fork"
+#define SPAWN_ENGINE_FORK_NAME_LENGTH 4
 
 #define CMDNOTFOUND_MSG "Command not found.\n"
 #define CMDNOTFOUND_MSG_LENGTH 19
 
 #define INPUTFILENOTFOUND_MSG "Input file error\n"
-#define INPUTFILENOTFOUND_MSG_LENGTH 18
+#define INPUTFILENOTFOUND_MSG_LENGTH 17
 
 #define OUTPUTFILENOTFOUND_MSG "Output file error\n"
-#define OUTPUTFILENOTFOUND_MSG_LENGTH 19
+#define OUTPUTFILENOTFOUND_MSG_LENGTH 18
 
-int main(void) {
-    char input_buffer[READ_BUFFER_SIZE];
-    char prompt_buffer[MAX_PROMPT_SIZE];
+#define REDIRECT_MSG "Redirection error\n"
+#define REDIRECT_MSG_LENGTH 18
 
-    ssize_t read_size;
-    pid_t child_pid;
-    int child_status;
+#define UNTERMINATEDQUOTE_MSG "Syntax error: unterminated quote.\n"
+#define HEREDOC_MSG "Syntax error: here-documents are not supported.\n"
 
-    int last_exit_code = 0;
-    int last_signal = 0;
-    long last_time_ms = 0;
-    int first_prompt = 1;
+#define BADSUBSTITUTION_MSG "Bad substitution\n"
+#define BADSUBSTITUTION_MSG_LENGTH 17
+
+#define AMBIGUOUSREDIRECT_MSG "Ambiguous redirect\n"
+#define AMBIGUOUSREDIRECT_MSG_LENGTH 19
+
+#define PIPE_MSG "Pipe error\n"
+#define PIPE_MSG_LENGTH 11
+
+#define SCRIPTFILE_MSG "Script file error\n"
+#define SCRIPTFILE_MSG_LENGTH 18
+
+#define OUTOFMEMORY_MSG "Out of memory\n"
+#define OUTOFMEMORY_MSG_LENGTH 14
+
+#define NOJOBSLOT_MSG "Out of memory, running in foreground.\n"
+#define NOJOBSLOT_MSG_LENGTH 38
+
+extern char **environ;
+
+enum spawn_engine {
+    SPAWN_ENGINE_POSIX, // posix_spawnp, which glibc implements with clone(CLONE_VM | CLONE_VFORK): no page table copy
+    SPAWN_ENGINE_FORK   // historical fork() + dup2() + execvp() path
+};
+
+struct arena_block {
+    struct arena_block *next; // newer block, reused after a reset before anything is malloc'ed
+    size_t capacity;
+    size_t used;
+    char data[];
+};
+
+struct arena { // bump allocator: everything built for one command line is released at once
+    struct arena_block *first;
+    struct arena_block *current; // allocations come from here, the blocks after it are free
+    size_t used;                 // bytes handed out since the last reset
+    size_t peak;                 // largest used over the session
+    size_t reserved;             // bytes malloc'ed for the blocks
+    int blocks;
+    long resets;
+};
+
+struct arena_mark { // position to come back to with arena_release()
+    struct arena_block *block;
+    size_t block_used;
+    size_t used;
+};
+
+enum redirect_type {
+    REDIRECT_INPUT,      // [n]<file
+    REDIRECT_OUTPUT,     // [n]>file, [n]>|file
+    REDIRECT_APPEND,     // [n]>>file
+    REDIRECT_READ_WRITE, // [n]<>file
+    REDIRECT_DUP_INPUT,  // [n]<&m, [n]<&-
+    REDIRECT_DUP_OUTPUT, // [n]>&m, [n]>&-
+    REDIRECT_HERE_STRING // [n]<<<word, the word and a newline
+};
+
+struct redirection {
+    enum redirect_type type;
+    int fd;     // descriptor of the command being redirected
+    char *target;
+    char *source; // target as written, when it has to be expanded before the file is opened
+    struct redirection *next;
+};
+
+struct command {
+    char **argv; // NULL-terminated argument list handed to exec
+    int argc;
+    char **sources; // NULL, or per argument the word as written when it has to be expanded before the command runs
+    struct redirection *redirections; // in source order, applied after the pipe ends
+    struct command *next;             // next stage of the pipeline
+};
+
+enum connector {
+    CONNECT_ALWAYS, // first pipeline of an and-or list
+    CONNECT_AND,    // &&
+    CONNECT_OR      // ||
+};
+
+struct pipeline {
+    struct command *stages; // cmd1 | cmd2 | ... | cmdN, a plain command is a one-stage pipeline
+    int count;
+    enum connector connector; // how this pipeline depends on the status of the previous one
+    struct pipeline *next;
+};
+
+struct and_or { // one element of the ; and & separated list making a line
+    struct pipeline *pipelines;
+    int background; // terminated by "&"
+    char *text;     // source text, shown by the job table
+    struct and_or *next;
+};
+
+enum token_type {
+    TOKEN_WORD,
+    TOKEN_REDIRECT,   // < > >> <> <& >& >| with an optional io number
+    TOKEN_PIPE,       // |
+    TOKEN_AND,        // &&
+    TOKEN_OR,         // ||
+    TOKEN_BACKGROUND, // &
+    TOKEN_SEMICOLON,  // ;
+    TOKEN_END,
+    TOKEN_ERROR
+};
+
+struct lexer { // single pass over the line, one token of lookahead
+    struct arena *arena;
+    const char *line_end;
+    enum token_type type;        // current token
+    const char *start;           // current token in the source line
+    const char *end;
+    char *word;                  // TOKEN_WORD: text with quotes removed, in the arena
+    char *source;                // TOKEN_WORD: the word as written when it has $, ~ or glob characters, NULL otherwise
+    enum redirect_type redirect; // TOKEN_REDIRECT
+    int io_number;               // TOKEN_REDIRECT: explicit descriptor, -1 for the default one
+    const char *error;           // TOKEN_ERROR
+};
+
+struct parser {
+    struct lexer lexer;
+    struct arena *arena;
+    char *error; // MESSAGE_BUFFER_SIZE bytes, filled on a syntax error
+};
+
+struct word_node {
+    char *word;
+    char *source;
+    struct word_node *next;
+};
+
+enum trace_phase { // spans of the shell, then what happens to a child
+    TRACE_READ,
+    TRACE_PARSE,
+    TRACE_EXPAND,
+    TRACE_SPAWN,
+    TRACE_BUILTIN,
+    TRACE_WAIT,
+    TRACE_LINE,
+    TRACE_RUN,  // from the child's exec to its exit
+    TRACE_EXIT, // SIGCHLD received
+    TRACE_REAP  // wait4() returned
+};
 
+struct trace_event { // 64 bytes, also the record of the binary log
+    uint64_t sequence;  // position + 1 once complete: a slot being written is skipped by the dump
+    int64_t start_ns;   // CLOCK_MONOTONIC, the same clock in the children
+    int64_t end_ns;     // start_ns for an instant
+    int32_t pid;        // child the event is about, 0 for the shell's own phases
+    int32_t value;      // wait status, or the number of fields of an expansion
+    uint32_t phase;
+    char name[TRACE_NAME_SIZE]; // command word or line, truncated
+};
+
+struct trace_child { // a running child whose exec time is known or waiting in its pipe
+    pid_t pid;          // 0 for a free slot
+    int exec_fd;        // read end of the pipe the forked child writes its exec time into, -1 after posix_spawn
+    int64_t exec_ns;
+    int64_t exit_ns;    // set when the event loop reads SIGCHLD
+};
+
+struct trace_header { // start of the binary log, followed by count events
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    uint64_t count;
+    int64_t origin_ns;
+    int32_t shell_pid;
+    int32_t reserved;
+};
+
+struct trace_ring {
+    struct trace_event *events;  // allocated by the first trace on, kept for the dump after trace off
+    uint64_t head;               // next position, claimed with an atomic add; every record is made on the shell's thread, from the epoll loop for exits
+    volatile int enabled;
+    int64_t origin_ns;           // time zero of the dump
+    struct trace_child children[TRACE_CHILDREN];
+};
+
+struct dir_entry {
+    uint32_t name;       // offset in the listing's names
+    unsigned char type;  // d_type, DT_UNKNOWN on file systems that do not fill it
+};
+
+struct dir_listing { // one directory read with getdents64, names in strcmp order
+    dev_t device;
+    ino_t inode;         // 0 for a free slot
+    struct timespec mtime;   // of the directory when it was read
+    struct timespec read_at; // CLOCK_REALTIME before the read
+    char *names;
+    struct dir_entry *entries;
+    uint32_t count;
+    int pinned;          // globs iterating over it, it is neither evicted nor read again meanwhile
+    long last_use;
+};
+
+struct dir_cache {
+    struct dir_listing slots[DIR_CACHE_SLOTS];
+    long clock;
+    long hits;
+    long reads;
+};
+
+struct word_buffer { // grows with realloc, kept from one word to the next
+    char *text;
+    size_t length;
+    size_t size;
+};
+
+struct expansion { // fields produced by the words of one command, in the line arena
+    char **words;
+    int count;
+    int capacity;
+};
+
+struct memo_header { // start of a result cache entry, followed by the key and the captured stdout
+    char magic[8];
+    int32_t status;    // wait status of the run
+    uint32_t key_length;
+    uint64_t output_length;
+    int64_t run_ns;    // what a hit saves
+};
+
+struct memo_file { // entry seen by a scan of the cache directory
+    char name[MEMO_NAME_SIZE];
+    struct timespec mtime; // refreshed by every hit: the oldest is the least recently used
+    long size;
+};
+
+struct memo_store {
+    int dir_fd;        // -1 until the first memo line, -2 when the directory cannot be used
+    long limit;        // bytes, entries are evicted down to 3/4 of it
+    long bytes;        // total size of the entries, as of the last scan plus what was stored since
+    long hits;
+    long misses;
+    long stores;
+    long evictions;
+    long uncacheable;  // ran without the cache: output redirected, input not a regular file, command not found
+    long replayed_bytes;
+    long saved_ns;
+    struct word_buffer key; // of the command being looked up
+};
+
+struct fd_action { // dup2(source, target), or close(target) when source is negative
+    int source;
+    int target;
+};
+
+struct fd_plan {
+    struct fd_action *actions;
+    int count;
+    int *opened; // descriptors opened by the shell for the command, closed once it is started
+    int opened_count;
+};
+
+struct command_limits { // 0 means no limit
+    long timeout_ms;                    // wall clock, enforced by the shell while it waits
+    long cpu_seconds;                   // RLIMIT_CPU of every stage: SIGXCPU, then SIGKILL one second later
+    long memory_bytes;                  // RLIMIT_AS of every stage: allocations fail past it
+    long kill_grace_ms;                 // SIGTERM first, SIGKILL after this delay; 0 sends SIGKILL at once
+};
+
+struct snapshot_header { // start of a startup snapshot, followed by PATH, the prompt format and name/path pairs of the hash, all NUL-terminated
+    char magic[8];
+    int32_t engine;               // enum spawn_engine
+    uint32_t entry_count;
+    uint32_t path_var_length;     // NUL included, the entries were resolved against this PATH
+    uint32_t prompt_length;       // NUL included, 0 when ENSEASH_PROMPT was unset
+    struct command_limits limits; // defaults of the limits builtin
+};
+
+struct snapshot_map { // the mapping stays for the whole session: the compiled prompt points into it
+    const struct snapshot_header *header;
+    size_t size;
+    const char *prompt_format;    // NULL when the snapshot has none
+};
+
+struct cgroup_leaf { // cgroup v2 directory holding the processes of one command
+    long id;                            // part of the directory name
+    int dir_fd;                         // -1 when the command is not placed
+    int procs_fd;                       // cgroup.procs: a forked stage writes 0 to it to move itself in
+    int parent_fd;                      // its own copy of the parent: the cgroup builtin may switch parents while the command runs
+};
+
+struct cgroup_usage { // read from the leaf once the command is done, grandchildren included
+    long cpu_us;                        // -1 when not measured
+    long user_us;
+    long system_us;
+    long memory_peak;                   // bytes, -1 without the memory controller
+    long oom_kills;
+};
+
+enum limit_kind { // why a command was stopped, shown instead of exit/sign
+    LIMIT_NONE,
+    LIMIT_TIMEOUT,
+    LIMIT_CPU,
+    LIMIT_MEMORY
+};
+
+struct job {
+    int id;                             // number shown as [id], 0 marks a free slot
+    int done;                           // every stage reaped, waiting to be reported before the next prompt
+    pid_t pgid;
+    pid_t *pids;                        // stages still to reap, -1 once reaped or never started
+    int count;
+    int status;                         // wait status of the last stage
     struct timespec time_start;
     struct timespec time_end;
+    struct rusage usage;                // summed over the reaped stages
+    struct command_limits limits;       // in force when the job started
+    enum limit_kind limit;              // set once the job is done
+    struct cgroup_leaf cgroup;
+    struct cgroup_usage cgroup_usage;   // set once the job is done
+    char *command_line;                 // pids and command_line are owned by the job, freed when it is reported
+    int *pidfds;                        // per stage, watched by the event loop; -1 once reaped or when pidfd_open() failed
+};
 
-    write(STDOUT_FILENO, WELCOME_MESSAGE, strlen(WELCOME_MESSAGE)); // Welcome message
+enum event_kind { // top byte of the epoll tag
+    EVENT_INPUT = 1, // the shell's input, one-shot: armed only while a line is awaited
+    EVENT_SIGNAL,    // the signalfd
+    EVENT_CHILD,     // pidfd of a foreground stage, the index is the stage
+    EVENT_TIMER,     // deadline of a limit line
+    EVENT_JOB        // pidfd of a background stage: job slot and stage
+};
 
-    while (1) {
-        if (first_prompt) { // First condition made to display the prefix of the first prompt
-            strncpy(prompt_buffer, PROMPT_DEFAULT, MAX_PROMPT_SIZE - 1); // copy of the content in PROMPT_DEFAULT to prompt_buffer up until MAX_PROMPT_SIZE bytes
-            prompt_buffer[MAX_PROMPT_SIZE - 1] = '\0'; // ensure null-termination
-            first_prompt = 0;
+struct event_loop {
+    int epoll_fd;
+    int signal_fd;
+    int input_fd;        // registered by the first wait for a line
+    int input_pollable;  // 0 for a regular file, which epoll refuses and which is always readable
+    sigset_t signals;    // SIGINT, SIGCHLD and SIGWINCH: blocked, read from signal_fd
+    sigset_t child_mask; // the mask the shell started with, given back to the commands
+    int interrupts;      // SIGINT that reached the shell, not acted on yet
+    int resized;         // SIGWINCH: the line editor redraws
+    int jobs_finished;   // background jobs reaped through their pidfds, reported by reap_jobs()
+};
+
+enum prompt_op {
+    PROMPT_TEXT,         // literal run of the format
+    PROMPT_STATUS,       // %e exit:N or sign:N, memo:N after a cache hit
+    PROMPT_EXIT_CODE,    // %x N, or 128 + signal
+    PROMPT_SIGNAL,       // %g signal number, empty after a normal exit
+    PROMPT_TIME_MS,      // %t
+    PROMPT_TIME_US,      // %T
+    PROMPT_USER_MS,      // %u
+    PROMPT_SYSTEM_MS,    // %s
+    PROMPT_MAXRSS,       // %m
+    PROMPT_MAJOR_FAULTS, // %f
+    PROMPT_MINOR_FAULTS, // %F
+    PROMPT_SWITCHES,     // %c
+    PROMPT_CWD,          // %w
+    PROMPT_JOBS,         // %j background jobs still running
+    PROMPT_CGROUP_CPU_MS, // %C CPU time of the command's cgroup, - when not placed
+    PROMPT_CGROUP_PEAK   // %P memory.peak of the command's cgroup in kB
+};
+
+struct prompt_part {
+    enum prompt_op op;
+    const char *text; // PROMPT_TEXT: points into the format string
+    size_t length;
+};
+
+struct prompt_template { // ENSEASH_PROMPT compiled once at startup
+    struct prompt_part *parts;
+    int count;
+};
+
+struct history_header { // start of the history file, the ring of records follows
+    char magic[8];
+    uint64_t capacity;                  // bytes of the ring
+    uint64_t head;                      // logical offset of the oldest record, offsets only grow
+    uint64_t tail;                      // logical offset of the next record
+    uint64_t next_sequence;             // number of the next entry, as shown by history and !N
+};
+
+struct history_record { // one command, 8-byte aligned, never split across the end of the ring
+    uint32_t size;                      // whole record with its padding
+    int32_t status;                     // wait status
+    uint32_t time_ms;
+    uint32_t length;                    // of line, HISTORY_PADDING for the filler at the end of the ring
+    uint64_t sequence;
+    char line[];                        // NUL terminated
+};
+
+struct history_index { // built on the first search, then extended with what was appended
+    uint64_t *offsets;                  // logical offset of each entry, oldest first: entry number = base + position
+    uint64_t *signatures;               // one bit per hashed pair of adjacent characters of the line
+    uint64_t base;
+    size_t first;                       // position of the oldest entry still in the ring
+    size_t count;
+    size_t size;
+    uint64_t synced;                    // logical offset up to which records are indexed
+    int built;
+    long *sorted;                       // entry numbers ordered by line: the entries starting with a prefix are a range
+    long *sorted_newest;                // newest entry of each block of HISTORY_SORTED_BLOCK sorted entries
+    size_t sorted_count;
+    long sorted_oldest;                 // older entries were evicted and dropped from sorted
+    long sorted_until;                  // newer entries are not sorted yet, prefix searches scan them
+};
+
+struct history {
+    int fd;                             // -1 when history is off
+    struct history_header *header;
+    char *ring;
+    size_t map_size;
+    struct history_index index;
+};
+
+struct trie_node { // one character of an executable name, the root is node 0
+    uint64_t dirs;         // PATH directories holding the name ending here, one bit each
+    uint32_t child;        // first child, 0 when none
+    uint32_t sibling;      // next child of the same parent, siblings sorted by character
+    uint32_t names;        // names ending in this subtree, 0 once they were all removed
+    unsigned char character;
+};
+
+struct path_trie { // executables of every PATH directory, built on the first Tab, then kept up to date by inotify
+    struct trie_node *nodes;
+    uint32_t count;
+    uint32_t size;
+    int inotify_fd;
+    int watches[PATH_TRIE_MAX_DIRS]; // watch descriptor of each directory
+    int dir_fds[PATH_TRIE_MAX_DIRS];
+    int dir_count;
+    struct word_buffer path_var; // PATH the trie was built from, whatever its length
+    int built;
+};
+
+enum editor_key {
+    KEY_LEFT = 256, // above the byte values
+    KEY_RIGHT,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE,
+    KEY_ESCAPE,
+    KEY_NONE        // a sequence the editor does not use
+};
 
-        } else if (last_signal != 0) { // Second condition made to display the prefix of the prompt when the last command was terminated by a signal
-            snprintf(prompt_buffer, MAX_PROMPT_SIZE, "%s%d|%ldms%s", PROMPT_SIGN_PREFIX, last_signal, last_time_ms, PROMPT_SUFFIX);
-        } else { // Third condition made to display the prefix of the prompt when the last command exited normally
-            snprintf(prompt_buffer, MAX_PROMPT_SIZE, "%s%d|%ldms%s", PROMPT_EXIT_PREFIX, last_exit_code, last_time_ms, PROMPT_SUFFIX);
+struct line_editor { // raw-mode editing of the interactive prompt
+    char *line;              // NUL-terminated, stays valid until the next line is read
+    size_t length;
+    size_t cursor;           // byte offset in line
+    size_t size;
+    char *display;           // line, or the reverse search, as it should look after the prompt
+    size_t display_size;
+    char *shown;             // what the terminal holds after the prompt: only the cells that differ are redrawn
+    size_t shown_length;
+    size_t shown_size;
+    size_t shown_cursor;     // column of the terminal cursor after the prompt
+    size_t scroll;           // first column shown, a line wider than the terminal scrolls horizontally
+    char prompt[MESSAGE_BUFFER_SIZE]; // last row of the prompt, redrawn after Ctrl-L or a list of candidates
+    size_t prompt_length;
+    size_t prompt_columns;
+    size_t columns;
+    int fd;
+    struct termios cooked;   // restored while commands run
+    char pending[EDITOR_READ_SIZE]; // an escape sequence split across two reads
+    size_t pending_length;
+    long browse;             // history entry shown by Up and Down, 0 for the line being typed
+    char *saved;             // the line being typed, kept while browsing
+    int searching;           // Ctrl-R: typed characters go to search
+    int search_failed;
+    char search[HASH_NAME_SIZE];
+    size_t search_length;
+    long search_match;
+    int tabs;                // consecutive Tabs, the second one lists the candidates
+    int done;                // 1 when the line was accepted, -1 at end of input
+    struct path_trie *trie;
+};
+
+enum hash_slot_state {
+    HASH_SLOT_EMPTY,
+    HASH_SLOT_USED,
+    HASH_SLOT_DELETED // tombstone, keeps probe chains intact
+};
+
+struct hash_entry {
+    enum hash_slot_state state;
+    int hits;
+    char name[HASH_NAME_SIZE];
+    char path[HASH_PATH_SIZE];
+};
+
+struct command_hash {
+    struct hash_entry entries[HASH_TABLE_SIZE];
+    int used;                          // USED + DELETED slots, the table is flushed before it fills up
+    struct word_buffer path_var; // PATH the entries were resolved against, whatever its length
+    long hits;
+    long misses;
+};
+
+enum line_status {
+    LINE_OK,
+    LINE_EOF,
+    LINE_INTERRUPTED // read() returned EINTR, nothing consumed
+};
+
+struct line_reader { // newline-delimited input without any line length limit
+    int fd;
+    char *buffer;    // buffered mode: bytes [start, end) not consumed yet
+    size_t capacity;
+    size_t start;
+    size_t end;
+    size_t scanned;  // bytes after start already known to contain no newline
+    int eof;
+    char *map;       // mmap mode: whole script file, private writable mapping
+    size_t map_size;
+    size_t map_offset;
+    int waits_in_loop; // the shell's own input: the read waits in the event loop, woken by Ctrl-C and finished jobs
+};
+
+static struct command_hash command_hash;
+static struct history history = { .fd = -1 };
+static struct path_trie path_trie = { .inotify_fd = -1 };
+static struct dir_cache dir_cache;
+static struct word_buffer expand_literal; // the word being expanded, with quotes removed
+static struct word_buffer expand_pattern; // the same word with the quoted glob characters escaped by a backslash
+static struct word_buffer glob_path;
+static struct word_buffer passwd_text; // /etc/passwd, read again for each ~user
+static int last_wait_status = 0;  // of the last foreground pipeline, for $?
+static int exit_requested = 0;    // set by the exit builtin: the rest of the line is skipped and the shell ends
+static struct memo_store memo = { .dir_fd = -1 };
+static struct snapshot_map snapshot;
+static int memo_hit = 0;          // the last foreground command was replayed from the cache, shown by %e
+static struct trace_ring trace;
+static struct job *job_table; // grown on demand, a job outlives the line that started it
+static int job_table_size = 0;
+static int stats_log_fd = -1;
+static struct arena line_arena;   // parse tree and execution state of the current line
+static int terminal_control = 0;  // stdin is a terminal handed to foreground jobs with tcsetpgrp()
+static pid_t job_pgid = 0;        // in a background subshell, the process group every pipeline joins
+static int running_jobs = 0;      // jobs not finished yet, shown by %j
+static char *prompt_cwd;          // %w, refreshed after a cd
+static size_t prompt_cwd_length;
+static int prompt_cwd_changed = 1;
+static struct command_limits default_limits = { .kill_grace_ms = LIMIT_KILL_GRACE_DEFAULT_MS }; // set by the limits builtin
+static struct command_limits active_limits = { .kill_grace_ms = LIMIT_KILL_GRACE_DEFAULT_MS };  // the defaults, or those of a limit prefix
+static enum spawn_engine shell_engine = SPAWN_ENGINE_POSIX; // that of main, for the builtins that start commands (parallel)
+static struct rusage builtin_jobs_usage; // children waited for by the running builtin (parallel), added to its own usage
+static enum limit_kind limit_hit = LIMIT_NONE; // of the last foreground pipeline, for %e and the stats log
+static const char *const limit_names[] = { "none", "timeout", "cpu", "mem" };
+static int cgroup_parent_fd = -1;  // ENSEASH_CGROUP or the cgroup builtin, -1 when commands stay in the shell's cgroup
+static char *cgroup_parent_path;
+static char *cgroup_settings[CGROUP_SETTING_COUNT]; // written to every new leaf, NULL keeps the kernel default
+static const char *const cgroup_setting_files[CGROUP_SETTING_COUNT] = { "cpu.max", "memory.max", "io.max" };
+static const char *const cgroup_controllers[CGROUP_SETTING_COUNT] = { "cpu", "memory", "io" };
+static long cgroup_leaf_count = 0;
+static int stage_cgroup_fd = -1;   // cgroup.procs of the leaf the stages being started join
+static struct cgroup_usage last_cgroup_usage = { -1, -1, -1, -1, 0 }; // of the last foreground pipeline, for %C and %P
+static struct event_loop events = { .epoll_fd = -1, .signal_fd = -1, .input_fd = -1 };
+
+static long elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+struct output_buffer { // coalesces small writes: echo and printf, and the shell's own prompt and messages
+    int fd;
+    char data[BUILTIN_OUTPUT_SIZE];
+    size_t length;
+};
+
+static struct output_buffer shell_output = { .fd = STDOUT_FILENO, .length = 0 }; // prompt, job reports, welcome and goodbye
+static struct output_buffer shell_errors = { .fd = STDERR_FILENO, .length = 0 };  // the shell's error messages
+
+static void writev_full(int fd, struct iovec *parts, int count) { // retries short writes, gives up on errors
+    while (count > 0) {
+        ssize_t written = writev(fd, parts, count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return;
+        }
+        while (count > 0 && (size_t)written >= parts->iov_len) {
+            written -= parts->iov_len;
+            parts++;
+            count--;
         }
+        if (count > 0) {
+            parts->iov_base = (char *)parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+}
 
-        write(STDOUT_FILENO, prompt_buffer, strlen(prompt_buffer)); // display the prompt using write system call
-        read_size = read(STDIN_FILENO, input_buffer, READ_BUFFER_SIZE - 1); // read user input from stdin
+static void output_flush(struct output_buffer *output) {
+    if (output->length > 0) {
+        struct iovec part = { output->data, output->length };
+        writev_full(output->fd, &part, 1);
+        output->length = 0;
+    }
+}
 
-        if (read_size <= 0) { // handle end-of-file or read error
-            write(STDOUT_FILENO, GOODBYE_MESSAGE, strlen(GOODBYE_MESSAGE));
-            break;
+static void output_append(struct output_buffer *output, const char *text, size_t length) {
+    if (output->length + length <= BUILTIN_OUTPUT_SIZE) {
+        memcpy(output->data + output->length, text, length);
+        output->length += length;
+        return;
+    }
+    struct iovec parts[2] = { { output->data, output->length }, { (char *)text, length } }; // pending bytes and the large text in one syscall
+    writev_full(output->fd, parts, 2);
+    output->length = 0;
+}
+
+static void shell_write(int fd, const char *text, size_t length) { // queued until shell_flush(), in place of write() for the shell's messages
+    output_append(fd == STDERR_FILENO ? &shell_errors : &shell_output, text, length);
+}
+
+static void shell_flush(void) { // before blocking on input and before anything else may write to the terminal
+    output_flush(&shell_errors);
+    output_flush(&shell_output);
+}
+
+static int format_long(char *out, long value) { // decimal digits without snprintf, returns the length
+    char digits[24];
+    unsigned long magnitude = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    int count = 0;
+    int length = 0;
+
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+        out[length++] = '-';
+    }
+    while (count > 0) {
+        out[length++] = digits[--count];
+    }
+    return length;
+}
+
+static int64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void trace_record(enum trace_phase phase, int64_t start_ns, int64_t end_ns, pid_t pid, int value, const char *name) { // a slot is claimed with one atomic add, no lock; no signal handler records any more
+    if (!trace.enabled) {
+        return;
+    }
+    uint64_t position = __atomic_fetch_add(&trace.head, 1, __ATOMIC_RELAXED);
+    struct trace_event *event = &trace.events[position & (TRACE_RING_SIZE - 1)];
+    size_t length = name != NULL ? strnlen(name, TRACE_NAME_SIZE - 1) : 0;
+
+    __atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED); // the dump skips the slot until it is complete
+    event->start_ns = start_ns;
+    event->end_ns = end_ns;
+    event->pid = pid;
+    event->value = value;
+    event->phase = phase;
+    memset(event->name, 0, TRACE_NAME_SIZE);
+    memcpy(event->name, name != NULL ? name : "", length);
+    __atomic_store_n(&event->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+static int64_t trace_begin(void) { // 0 when tracing is off, the matching trace_end() then records nothing
+    return trace.enabled ? trace_now() : 0;
+}
+
+static void trace_end(enum trace_phase phase, int64_t start_ns, pid_t pid, int value, const char *name) {
+    if (start_ns != 0) {
+        trace_record(phase, start_ns, trace_now(), pid, value, name);
+    }
+}
+
+static struct trace_child *trace_find_child(pid_t pid) { // also called by trace_exited(), from event_read_signals()
+    for (int i = 0; i < TRACE_CHILDREN; i++) {
+        if (trace.children[i].pid == pid) {
+            return &trace.children[i];
         }
-        input_buffer[read_size] = '\0';
+    }
+    return NULL;
+}
+
+static void trace_exec_pipe(int fds[2]) { // before a fork: the child writes the time it calls exec into fds[1], closed by the exec itself
+    fds[0] = -1;
+    fds[1] = -1;
+    if (trace.enabled && pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+        fds[0] = -1;
+        fds[1] = -1;
+    }
+}
+
+static void trace_exec_start(int fd, int failed) { // in the forked child: the time right before exec, and a second record when it failed
+    if (fd >= 0) {
+        int64_t now = failed ? 0 : trace_now();
+        write(fd, &now, sizeof(now));
+    }
+}
+
+static void trace_spawned(pid_t pid, int exec_fd, int64_t exec_ns) { // exec_fd: the read end of trace_exec_pipe(), or exec_ns when the spawn returns after the exec
+    struct trace_child *child = pid > 0 && trace.enabled ? trace_find_child(0) : NULL;
 
-        if (input_buffer[read_size - 1] == '\n') { // handle newline character at the end of input in case user pressed Enter
-            input_buffer[read_size - 1] = '\0';
+    if (child == NULL) { // not traced, or too many children running: only their exit and reap are recorded
+        if (exec_fd >= 0) {
+            close(exec_fd);
         }
-        if (strncmp(input_buffer, EXIT_CMD, EXIT_CMD_LENGTH) == 0) { // check for exit command by comparing input with the "exit" string
-            write(STDOUT_FILENO, GOODBYE_MESSAGE, strlen(GOODBYE_MESSAGE));
-            break;
+        return;
+    }
+    child->exec_fd = exec_fd;
+    child->exec_ns = exec_ns;
+    child->exit_ns = 0;
+    __atomic_store_n(&child->pid, pid, __ATOMIC_RELEASE);
+}
+
+static void trace_exited(pid_t pid, int status) { // called by event_read_signals() when the epoll loop reads SIGCHLD from the signalfd: the exit is timed now, the reap may come much later
+    int64_t now = trace_now();
+    struct trace_child *child = trace.events != NULL ? trace_find_child(pid) : NULL;
+
+    if (child != NULL) {
+        __atomic_store_n(&child->exit_ns, now, __ATOMIC_RELAXED);
+    }
+    trace_record(TRACE_EXIT, now, now, pid, status, NULL);
+}
+
+static void trace_reap(pid_t pid, int status) { // the child's run from its exec to its exit, then the reap
+    int64_t now = trace_now();
+    struct trace_child *child = trace.events != NULL ? trace_find_child(pid) : NULL;
+
+    if (child != NULL) {
+        int64_t exec_ns[2] = { child->exec_ns, 0 };
+        int64_t exit_ns = __atomic_load_n(&child->exit_ns, __ATOMIC_RELAXED);
+        if (child->exec_fd >= 0 && read(child->exec_fd, exec_ns, sizeof(exec_ns)) != sizeof(exec_ns[0])) { // the child is gone, its pipe holds all it wrote
+            exec_ns[0] = 0; // no exec, or a failed one
         }
-        clock_gettime(CLOCK_MONOTONIC, &time_start); // start timing the command execution
-        child_pid = fork(); // create a new child process to execute the command
-
-        if (child_pid == 0) {
-            char *argv[MAX_ARGS]; // array to hold command arguments
-            int argc = 0;
-            char *input_file = NULL;
-            char *output_file = NULL;
-
-            char *token = strtok(input_buffer, " "); // tokenize the input string based on spaces using strtok, which modifies the input string into tokens
-            while (token != NULL) {
-                if (strcmp(token, "<") == 0) { // handle input redirection by checking for "<" token
-                    token = strtok(NULL, " ");
-                    input_file = token;
-                } else if (strcmp(token, ">") == 0) { // handle output redirection by checking for ">" token
-                    token = strtok(NULL, " ");
-                    output_file = token;
-                } else {
-                    argv[argc] = token;
-                    argc++;
+        if (exec_ns[0] != 0) {
+            trace_record(TRACE_RUN, exec_ns[0], exit_ns != 0 ? exit_ns : now, pid, status, NULL);
+        }
+        if (child->exec_fd >= 0) {
+            close(child->exec_fd);
+        }
+        __atomic_store_n(&child->pid, 0, __ATOMIC_RELEASE);
+    }
+    trace_record(TRACE_REAP, now, now, pid, status, NULL);
+}
+
+static void *arena_reserve(struct arena *arena, size_t size) { // room for size bytes at the top of the arena, claimed by arena_commit()
+    struct arena_block *block = arena->current;
+
+    while (block == NULL || block->capacity - block->used < size) {
+        if (block != NULL && block->next != NULL) { // a block kept from a previous line
+            block = block->next;
+            block->used = 0;
+            continue;
+        }
+        size_t capacity = ARENA_BLOCK_SIZE;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        struct arena_block *new_block = malloc(sizeof(*new_block) + capacity);
+        if (new_block == NULL) { // nothing sensible can be done for this line or the next ones
+            write(STDERR_FILENO, OUTOFMEMORY_MSG, OUTOFMEMORY_MSG_LENGTH);
+            exit(1);
+        }
+        new_block->next = NULL;
+        new_block->capacity = capacity;
+        new_block->used = 0;
+        if (block == NULL) {
+            arena->first = new_block;
+        } else {
+            block->next = new_block;
+        }
+        arena->reserved += capacity;
+        arena->blocks++;
+        block = new_block;
+    }
+    arena->current = block;
+    return block->data + block->used;
+}
+
+static void arena_commit(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    arena->current->used += size;
+    arena->used += size;
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+}
+
+static void *arena_alloc(struct arena *arena, size_t size) {
+    void *memory = arena_reserve(arena, size);
+    arena_commit(arena, size);
+    return memory;
+}
+
+static void arena_trim(struct arena *arena) { // gives back every block but the first one, and that one too when a large request sized it
+    struct arena_block *block = arena->first->next;
+
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        arena->reserved -= block->capacity;
+        arena->blocks--;
+        free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    if (arena->first->capacity > ARENA_BLOCK_SIZE) { // the next allocation starts a default block again
+        arena->reserved -= arena->first->capacity;
+        arena->blocks--;
+        free(arena->first);
+        arena->first = NULL;
+        arena->current = NULL;
+    }
+}
+
+static void arena_reset(struct arena *arena) { // O(1): the blocks stay allocated for the next line
+    arena->resets++;
+    arena->used = 0;
+    arena->current = arena->first;
+    if (arena->first == NULL) {
+        return;
+    }
+    arena->first->used = 0;
+    if (arena->reserved > ARENA_RETAIN_SIZE) { // a huge line should not pin its memory for the rest of the session
+        arena_trim(arena);
+    }
+}
+
+static struct arena_mark arena_mark(const struct arena *arena) {
+    struct arena_mark mark = { arena->current, arena->current != NULL ? arena->current->used : 0, arena->used };
+    return mark;
+}
+
+static void arena_release(struct arena *arena, const struct arena_mark *mark) { // drops what was allocated since the mark
+    if (mark->block == NULL) {
+        arena_reset(arena);
+        return;
+    }
+    arena->current = mark->block;
+    arena->current->used = mark->block_used;
+    arena->used = mark->used;
+}
+
+static void arena_free(struct arena *arena) {
+    if (arena->first != NULL) {
+        arena_trim(arena);
+        free(arena->first);
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+static void arena_print(const struct arena *arena, const char *name) {
+    char message[MESSAGE_BUFFER_SIZE];
+    struct output_buffer output;
+    int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%s: %zu bytes in use, peak %zu bytes, %zu bytes in %d blocks, %ld resets\n",
+                          name, arena->used, arena->peak, arena->reserved, arena->blocks, arena->resets);
+
+    output.fd = STDOUT_FILENO;
+    output.length = 0;
+    output_append(&output, message, length);
+    output_flush(&output);
+}
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static int is_operator(char c) { // characters that end an unquoted word
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+static void lex_word(struct lexer *lexer, const char *cursor) { // quote removal happens while scanning, straight into the arena
+    char *word = arena_reserve(lexer->arena, lexer->line_end - cursor + 1); // a word never grows when its quotes are removed
+    const char *start = cursor;
+    int expands = *cursor == '~'; // expanded when the command runs, from the text as written
+    size_t length = 0;
+
+    while (*cursor != '\0' && !is_blank(*cursor) && !is_operator(*cursor)) {
+        if (*cursor == '\'') { // everything is literal up to the closing quote
+            const char *close = memchr(cursor + 1, '\'', lexer->line_end - cursor - 1);
+            if (close == NULL) {
+                lexer->type = TOKEN_ERROR;
+                lexer->error = UNTERMINATEDQUOTE_MSG;
+                return;
+            }
+            memcpy(word + length, cursor + 1, close - cursor - 1);
+            length += close - cursor - 1;
+            cursor = close + 1;
+        } else if (*cursor == '"') { // backslash only escapes " \ $ ` inside double quotes
+            cursor++;
+            while (*cursor != '"') {
+                if (*cursor == '\0') {
+                    lexer->type = TOKEN_ERROR;
+                    lexer->error = UNTERMINATEDQUOTE_MSG;
+                    return;
+                }
+                if (*cursor == '\\' && (cursor[1] == '"' || cursor[1] == '\\' || cursor[1] == '$' || cursor[1] == '`')) {
+                    cursor++;
+                } else if (*cursor == '$') {
+                    expands = 1;
                 }
+                word[length++] = *cursor++;
+            }
+            cursor++;
+        } else if (*cursor == '\\') {
+            cursor++;
+            if (*cursor != '\0') { // a trailing backslash is dropped
+                word[length++] = *cursor++;
+            }
+        } else {
+            expands |= *cursor == '$' || *cursor == '*' || *cursor == '?' || *cursor == '[';
+            word[length++] = *cursor++;
+        }
+    }
+    word[length] = '\0';
+    arena_commit(lexer->arena, length + 1);
+
+    lexer->type = TOKEN_WORD;
+    lexer->word = word;
+    lexer->source = NULL;
+    lexer->end = cursor;
+    if (expands) {
+        lexer->source = arena_alloc(lexer->arena, cursor - start + 1);
+        memcpy(lexer->source, start, cursor - start);
+        lexer->source[cursor - start] = '\0';
+    }
+}
+
+static void next_token(struct lexer *lexer) {
+    const char *cursor = lexer->end;
+
+    while (is_blank(*cursor)) {
+        cursor++;
+    }
+    lexer->start = cursor;
+    lexer->io_number = -1;
+
+    if (*cursor == '\0' || *cursor == '#') { // a comment runs to the end of the line
+        lexer->type = TOKEN_END;
+        lexer->end = cursor;
+        return;
+    }
+
+    const char *digits = cursor;
+    while (*digits >= '0' && *digits <= '9' && digits - cursor < MAX_IO_NUMBER_DIGITS + 1) {
+        digits++;
+    }
+    if (digits > cursor && digits - cursor <= MAX_IO_NUMBER_DIGITS && (*digits == '<' || *digits == '>')) { // 2> and friends
+        lexer->io_number = atoi(cursor);
+        cursor = digits;
+    }
+
+    lexer->type = TOKEN_REDIRECT;
+    switch (*cursor) {
+    case '|':
+        lexer->type = cursor[1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+        cursor += cursor[1] == '|' ? 2 : 1;
+        break;
+    case '&':
+        lexer->type = cursor[1] == '&' ? TOKEN_AND : TOKEN_BACKGROUND;
+        cursor += cursor[1] == '&' ? 2 : 1;
+        break;
+    case ';':
+        lexer->type = TOKEN_SEMICOLON;
+        cursor++;
+        break;
+    case '<':
+        if (cursor[1] == '<' && cursor[2] == '<') {
+            lexer->redirect = REDIRECT_HERE_STRING;
+            cursor += 3;
+            break;
+        }
+        if (cursor[1] == '<') {
+            lexer->type = TOKEN_ERROR;
+            lexer->error = HEREDOC_MSG;
+            return;
+        }
+        lexer->redirect = cursor[1] == '&' ? REDIRECT_DUP_INPUT : cursor[1] == '>' ? REDIRECT_READ_WRITE : REDIRECT_INPUT;
+        cursor += lexer->redirect == REDIRECT_INPUT ? 1 : 2;
+        break;
+    case '>':
+        lexer->redirect = cursor[1] == '>' ? REDIRECT_APPEND : cursor[1] == '&' ? REDIRECT_DUP_OUTPUT : REDIRECT_OUTPUT;
+        cursor += cursor[1] == '>' || cursor[1] == '&' || cursor[1] == '|' ? 2 : 1; // >| is a plain > since there is no noclobber
+        break;
+    default:
+        lex_word(lexer, cursor);
+        return;
+    }
+    lexer->end = cursor;
+}
+
+static int syntax_error(struct parser *parser) {
+    if (parser->lexer.type == TOKEN_ERROR) {
+        snprintf(parser->error, MESSAGE_BUFFER_SIZE, "%s", parser->lexer.error);
+    } else if (parser->lexer.type == TOKEN_END) {
+        snprintf(parser->error, MESSAGE_BUFFER_SIZE, "Syntax error near 'newline'.\n");
+    } else {
+        snprintf(parser->error, MESSAGE_BUFFER_SIZE, "Syntax error near '%.*s'.\n",
+                 (int)(parser->lexer.end - parser->lexer.start), parser->lexer.start);
+    }
+    return -1;
+}
+
+static struct command *parse_command(struct parser *parser) { // (word | redirection)+
+    struct lexer *lexer = &parser->lexer;
+    struct command *cmd = arena_alloc(parser->arena, sizeof(*cmd));
+    struct word_node *words = NULL;
+    struct word_node **word_tail = &words;
+    struct redirection **redirection_tail = &cmd->redirections;
+    int expands = 0;
+
+    cmd->argc = 0;
+    cmd->sources = NULL;
+    cmd->redirections = NULL;
+    cmd->next = NULL;
+
+    while (1) {
+        if (lexer->type == TOKEN_WORD) {
+            struct word_node *node = arena_alloc(parser->arena, sizeof(*node));
+            node->word = lexer->word;
+            node->source = lexer->source;
+            node->next = NULL;
+            *word_tail = node;
+            word_tail = &node->next;
+            cmd->argc++;
+            expands |= node->source != NULL;
+        } else if (lexer->type == TOKEN_REDIRECT) {
+            struct redirection *redirection = arena_alloc(parser->arena, sizeof(*redirection));
+            int reads = lexer->redirect == REDIRECT_INPUT || lexer->redirect == REDIRECT_DUP_INPUT || lexer->redirect == REDIRECT_READ_WRITE ||
+                        lexer->redirect == REDIRECT_HERE_STRING;
 
-                token = strtok(NULL, " ");
+            redirection->type = lexer->redirect;
+            redirection->fd = lexer->io_number >= 0 ? lexer->io_number : reads ? STDIN_FILENO : STDOUT_FILENO;
+            redirection->next = NULL;
+            next_token(lexer);
+            if (lexer->type != TOKEN_WORD) { // redirection operator without a file name
+                syntax_error(parser);
+                return NULL;
             }
-            argv[argc] = NULL;
+            redirection->target = lexer->word;
+            redirection->source = lexer->source;
+            *redirection_tail = redirection;
+            redirection_tail = &redirection->next;
+        } else {
+            break;
+        }
+        next_token(lexer);
+    }
+    if (cmd->argc == 0 && cmd->redirections == NULL) {
+        syntax_error(parser);
+        return NULL;
+    }
+
+    cmd->argv = arena_alloc(parser->arena, sizeof(char *) * (cmd->argc + 1)); // NULL-terminated argument list handed to exec
+    if (expands) {
+        cmd->sources = arena_alloc(parser->arena, sizeof(char *) * cmd->argc);
+    }
+    for (int i = 0; i < cmd->argc; i++) {
+        cmd->argv[i] = words->word;
+        if (expands) {
+            cmd->sources[i] = words->source;
+        }
+        words = words->next;
+    }
+    cmd->argv[cmd->argc] = NULL;
+    return cmd;
+}
 
-            if (input_file != NULL) { // handle input redirection if an input file was specified
-                int fd_in = open(input_file, O_RDONLY); // open the input file for reading
+static struct pipeline *parse_pipeline(struct parser *parser) { // command ('|' command)*
+    struct pipeline *pipeline = arena_alloc(parser->arena, sizeof(*pipeline));
+    struct command **tail = &pipeline->stages;
 
-                if (fd_in >= 0) { // check if the file was opened successfully
-                    dup2(fd_in, STDIN_FILENO); // redirect stdin to the input file using dup2 system call
-                    close(fd_in);
-                } else {
-                    write(STDERR_FILENO, INPUTFILENOTFOUND_MSG, INPUTFILENOTFOUND_MSG_LENGTH);
-                    _exit(1);
+    pipeline->count = 0;
+    pipeline->connector = CONNECT_ALWAYS;
+    pipeline->next = NULL;
+    while (1) {
+        struct command *cmd = parse_command(parser);
+        if (cmd == NULL) {
+            return NULL;
+        }
+        *tail = cmd;
+        tail = &cmd->next;
+        pipeline->count++;
+        if (parser->lexer.type != TOKEN_PIPE) {
+            return pipeline;
+        }
+        next_token(&parser->lexer);
+    }
+}
+
+static struct and_or *parse_and_or(struct parser *parser) { // pipeline (('&&' | '||') pipeline)*
+    struct and_or *and_or = arena_alloc(parser->arena, sizeof(*and_or));
+    struct pipeline **tail = &and_or->pipelines;
+    const char *text_start = parser->lexer.start;
+    enum connector connector = CONNECT_ALWAYS;
+
+    and_or->background = 0;
+    and_or->next = NULL;
+    while (1) {
+        struct pipeline *pipeline = parse_pipeline(parser);
+        if (pipeline == NULL) {
+            return NULL;
+        }
+        pipeline->connector = connector;
+        *tail = pipeline;
+        tail = &pipeline->next;
+        if (parser->lexer.type != TOKEN_AND && parser->lexer.type != TOKEN_OR) {
+            break;
+        }
+        connector = parser->lexer.type == TOKEN_AND ? CONNECT_AND : CONNECT_OR;
+        next_token(&parser->lexer);
+    }
+
+    size_t text_length = parser->lexer.start - text_start; // source text, shown by the job table
+    while (text_length > 0 && is_blank(text_start[text_length - 1])) {
+        text_length--;
+    }
+    and_or->text = arena_alloc(parser->arena, text_length + 1);
+    memcpy(and_or->text, text_start, text_length);
+    and_or->text[text_length] = '\0';
+    return and_or;
+}
+
+static int parse_line(struct arena *arena, const char *line, struct and_or **list, char *error) { // and_or ((';' | '&') and_or)*, error receives the message on failure
+    struct parser parser;
+    struct and_or **tail = list;
+
+    parser.arena = arena;
+    parser.lexer.arena = arena;
+    parser.lexer.end = line;
+    parser.lexer.line_end = line + strlen(line);
+    parser.error = error;
+    error[0] = '\0';
+    *list = NULL;
+
+    next_token(&parser.lexer);
+    while (parser.lexer.type != TOKEN_END) {
+        struct and_or *and_or = parse_and_or(&parser);
+        if (and_or == NULL) {
+            return -1;
+        }
+        *tail = and_or;
+        tail = &and_or->next;
+        if (parser.lexer.type == TOKEN_BACKGROUND) {
+            and_or->background = 1;
+        } else if (parser.lexer.type != TOKEN_SEMICOLON && parser.lexer.type != TOKEN_END) {
+            return syntax_error(&parser);
+        }
+        if (parser.lexer.type != TOKEN_END) {
+            next_token(&parser.lexer);
+        }
+    }
+    return 0;
+}
+
+static void word_reserve(struct word_buffer *buffer, size_t more) { // room for more bytes and the NUL
+    if (buffer->length + more + 1 <= buffer->size) {
+        return;
+    }
+    size_t size = buffer->size > 0 ? buffer->size : WORD_BUFFER_INITIAL_SIZE;
+    while (size < buffer->length + more + 1) {
+        size *= 2;
+    }
+    char *text = realloc(buffer->text, size);
+    if (text == NULL) { // same policy as the arena
+        write(STDERR_FILENO, OUTOFMEMORY_MSG, OUTOFMEMORY_MSG_LENGTH);
+        exit(1);
+    }
+    buffer->text = text;
+    buffer->size = size;
+}
+
+static void word_append(struct word_buffer *buffer, const char *text, size_t length) {
+    word_reserve(buffer, length);
+    memcpy(buffer->text + buffer->length, text, length);
+    buffer->length += length;
+    buffer->text[buffer->length] = '\0';
+}
+
+static void word_truncate(struct word_buffer *buffer, size_t length) {
+    buffer->length = length;
+    buffer->text[length] = '\0';
+}
+
+static void expansion_push(struct expansion *expansion, char *word) {
+    if (expansion->count == expansion->capacity) {
+        int capacity = expansion->capacity > 0 ? expansion->capacity * 2 : EXPANSION_INITIAL_FIELDS;
+        char **words = arena_alloc(&line_arena, sizeof(char *) * capacity);
+        for (int i = 0; i < expansion->count; i++) {
+            words[i] = expansion->words[i];
+        }
+        expansion->words = words;
+        expansion->capacity = capacity;
+    }
+    expansion->words[expansion->count++] = word;
+}
+
+static char *expansion_copy(const struct word_buffer *buffer) { // into the line arena, where the argv lives
+    char *word = arena_alloc(&line_arena, buffer->length + 1);
+    memcpy(word, buffer->text, buffer->length + 1);
+    return word;
+}
+
+static int dir_entry_compare(const void *a, const void *b, void *names) {
+    return strcmp((const char *)names + ((const struct dir_entry *)a)->name, (const char *)names + ((const struct dir_entry *)b)->name);
+}
+
+static int dir_read(struct dir_listing *listing, int fd) { // every name but . and .., sorted once so that a literal prefix is a binary search
+    char buffer[DIR_CACHE_READ_SIZE];
+    size_t names_size = 0;
+    size_t names_length = 0;
+    uint32_t capacity = 0;
+    ssize_t got;
+
+    listing->count = 0;
+    while ((got = getdents64(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t offset = 0; offset < got;) {
+            struct dirent64 *entry = (struct dirent64 *)(buffer + offset);
+            size_t length = strlen(entry->d_name) + 1;
+            offset += entry->d_reclen;
+            if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+                continue;
+            }
+            if (names_length + length > names_size) {
+                names_size = names_size > 0 ? names_size * 2 : DIR_CACHE_READ_SIZE;
+                char *names = realloc(listing->names, names_size);
+                if (names == NULL) {
+                    return -1;
                 }
+                listing->names = names;
             }
-            if (output_file != NULL) { // handle output redirection if an output file was specified
-                int fd_out = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-
-                if (fd_out >= 0) { // check if the file was opened successfully
-                    dup2(fd_out, STDOUT_FILENO); // redirect stdout to the output file using dup2 system call
-                    close(fd_out);
-                } else {
-                    write(STDERR_FILENO, OUTPUTFILENOTFOUND_MSG, OUTPUTFILENOTFOUND_MSG_LENGTH);
-                    _exit(1);
+            if (listing->count == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : DIR_CACHE_READ_SIZE / 32;
+                struct dir_entry *entries = realloc(listing->entries, sizeof(struct dir_entry) * capacity);
+                if (entries == NULL) {
+                    return -1;
                 }
+                listing->entries = entries;
             }
+            memcpy(listing->names + names_length, entry->d_name, length);
+            listing->entries[listing->count].name = names_length;
+            listing->entries[listing->count].type = entry->d_type;
+            listing->count++;
+            names_length += length;
+        }
+    }
+    if (got < 0) {
+        return -1;
+    }
+    qsort_r(listing->entries, listing->count, sizeof(struct dir_entry), dir_entry_compare, listing->names);
+    return 0;
+}
 
-            execvp(argv[0], argv); // execute the command in the child process using execvp
-            write(STDERR_FILENO, CMDNOTFOUND_MSG, CMDNOTFOUND_MSG_LENGTH); // handle command not found error
-            _exit(1);
+static struct dir_listing *dir_cache_get(const char *path) { // valid until the next call unless pinned, NULL when the directory cannot be read
+    struct dir_listing *listing = NULL;
+    struct stat dir_stat;
+
+    if (stat(path, &dir_stat) < 0 || !S_ISDIR(dir_stat.st_mode)) {
+        return NULL;
+    }
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) { // by inode: the same directory reached through another path, or after a cd, is the same entry
+        if (dir_cache.slots[i].inode == dir_stat.st_ino && dir_cache.slots[i].device == dir_stat.st_dev) {
+            listing = &dir_cache.slots[i];
+            break;
         }
-        wait(&child_status);
-        clock_gettime(CLOCK_MONOTONIC, &time_end); // end timing the command execution
+    }
+    if (listing != NULL) {
+        int unchanged = listing->mtime.tv_sec == dir_stat.st_mtim.tv_sec && listing->mtime.tv_nsec == dir_stat.st_mtim.tv_nsec;
+        long racy_ns = listing->mtime.tv_nsec == 0 ? DIR_CACHE_COARSE_RACY_NS : DIR_CACHE_RACY_NS;
+        if (listing->pinned > 0 || (unchanged && elapsed_ns(&listing->mtime, &listing->read_at) > racy_ns)) {
+            dir_cache.hits++;
+            listing->last_use = ++dir_cache.clock;
+            return listing;
+        }
+    } else {
+        for (int i = 0; i < DIR_CACHE_SLOTS; i++) { // free slots have never been used
+            struct dir_listing *slot = &dir_cache.slots[i];
+            if (slot->pinned == 0 && (listing == NULL || slot->last_use < listing->last_use)) {
+                listing = slot;
+            }
+        }
+        if (listing == NULL) { // deeper than the cache, every slot is being iterated
+            return NULL;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    listing->inode = 0;
+    clock_gettime(CLOCK_REALTIME, &listing->read_at); // a change after this is newer than the mtime read below, unless it lands in the same tick
+    if (fd < 0 || fstat(fd, &dir_stat) < 0 || dir_read(listing, fd) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    close(fd);
+    listing->device = dir_stat.st_dev;
+    listing->inode = dir_stat.st_ino;
+    listing->mtime = dir_stat.st_mtim;
+    listing->last_use = ++dir_cache.clock;
+    dir_cache.reads++;
+    return listing;
+}
+
+static const char *glob_bracket(const char *pattern, const char *end, unsigned char c, int *matched) { // pattern is on the [, returns what follows the ], NULL when it is not closed
+    const char *cursor = pattern + 1;
+    int negate = cursor < end && (*cursor == '!' || *cursor == '^');
+
+    cursor += negate;
+    const char *first = cursor; // a ] right after [ or [! is a member
+    *matched = 0;
+    while (cursor < end && (*cursor != ']' || cursor == first)) {
+        unsigned char low = *cursor;
+        if (low == '\\' && cursor + 1 < end) {
+            low = *++cursor;
+        }
+        cursor++;
+        unsigned char high = low;
+        if (cursor + 1 < end && *cursor == '-' && cursor[1] != ']') { // a range, - is literal at either end
+            cursor++;
+            high = *cursor;
+            if (high == '\\' && cursor + 1 < end) {
+                high = *++cursor;
+            }
+            cursor++;
+        }
+        *matched |= c >= low && c <= high;
+    }
+    if (cursor >= end) {
+        return NULL;
+    }
+    *matched ^= negate;
+    return cursor + 1;
+}
 
-        last_time_ms = (time_end.tv_sec - time_start.tv_sec) * 1000 + (time_end.tv_nsec - time_start.tv_nsec) / 1000000; // calculate elapsed time in milliseconds
+static const char *glob_match_char(const char *pattern, const char *end, unsigned char c) { // one element of the pattern against c, returns what follows it or NULL
+    if (*pattern == '?') {
+        return pattern + 1;
+    }
+    if (*pattern == '[') {
+        int matched;
+        const char *close = glob_bracket(pattern, end, c, &matched);
+        if (close != NULL) {
+            return matched ? close : NULL;
+        }
+    }
+    if (*pattern == '\\' && pattern + 1 < end) {
+        pattern++;
+    }
+    return (unsigned char)*pattern == c ? pattern + 1 : NULL;
+}
+
+static int glob_match(const char *pattern, const char *end, const char *name) { // one path component, only the last * is ever retried
+    const char *star = NULL;
+    const char *star_name = NULL;
+
+    while (*name != '\0') {
+        if (pattern < end && *pattern == '*') {
+            star = ++pattern;
+            star_name = name;
+            continue;
+        }
+        const char *next = pattern < end ? glob_match_char(pattern, end, *name) : NULL;
+        if (next != NULL) {
+            pattern = next;
+            name++;
+        } else if (star == NULL) {
+            return 0;
+        } else { // the last * takes one more character
+            pattern = star;
+            name = ++star_name;
+        }
+    }
+    while (pattern < end && *pattern == '*') {
+        pattern++;
+    }
+    return pattern == end;
+}
+
+static int glob_is_pattern(const char *pattern, const char *end) {
+    for (; pattern < end; pattern++) {
+        if (*pattern == '\\') {
+            pattern++;
+        } else if (*pattern == '*' || *pattern == '?' || *pattern == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-        if (WIFEXITED(child_status)) { // check if the child process exited normally
-            last_exit_code = WEXITSTATUS(child_status);
-            last_signal = 0;
-        } else if (WIFSIGNALED(child_status)) { // check if the child process was terminated by a signal
-            last_signal = WTERMSIG(child_status);
-            last_exit_code = 0;
+static int glob_walk(struct expansion *expansion, const char *pattern, int check) { // matches of pattern below glob_path, check: the path may not exist
+    struct stat file_stat;
+    int found = 0;
+
+    while (*pattern == '/') {
+        word_append(&glob_path, "/", 1);
+        pattern++;
+    }
+    if (*pattern == '\0') {
+        if (check && lstat(glob_path.text, &file_stat) < 0) {
+            return 0;
         }
+        expansion_push(expansion, expansion_copy(&glob_path));
+        return 1;
     }
+    const char *end = pattern + strcspn(pattern, "/");
+    size_t length = glob_path.length;
 
+    if (!glob_is_pattern(pattern, end)) { // a plain component is not listed, only checked at the end
+        for (const char *cursor = pattern; cursor < end; cursor++) {
+            cursor += *cursor == '\\' && cursor + 1 < end;
+            word_append(&glob_path, cursor, 1);
+        }
+        found = glob_walk(expansion, end, 1);
+        word_truncate(&glob_path, length);
+        return found;
+    }
+
+    struct dir_listing *listing = dir_cache_get(length > 0 ? glob_path.text : ".");
+    char prefix[HASH_NAME_SIZE]; // literal start of the component: only the names in its range are matched
+    size_t prefix_length = 0;
+    if (listing == NULL) {
+        return 0;
+    }
+    for (const char *cursor = pattern; cursor < end && *cursor != '*' && *cursor != '?' && *cursor != '[' && prefix_length < HASH_NAME_SIZE - 1; cursor++) {
+        cursor += *cursor == '\\' && cursor + 1 < end;
+        prefix[prefix_length++] = *cursor;
+    }
+    prefix[prefix_length] = '\0';
+    uint32_t low = 0;
+    uint32_t high = listing->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (strcmp(listing->names + listing->entries[middle].name, prefix) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    listing->pinned++;
+    for (uint32_t i = low; i < listing->count; i++) {
+        const char *name = listing->names + listing->entries[i].name;
+        unsigned char type = listing->entries[i].type;
+        if (strncmp(name, prefix, prefix_length) != 0) {
+            break;
+        }
+        if ((name[0] == '.' && prefix[0] != '.') || !glob_match(pattern, end, name)) { // a leading dot is only matched by a literal one
+            continue;
+        }
+        word_append(&glob_path, name, strlen(name));
+        if (*end != '/' || type == DT_DIR || ((type == DT_UNKNOWN || type == DT_LNK) && stat(glob_path.text, &file_stat) == 0 && S_ISDIR(file_stat.st_mode))) {
+            found += glob_walk(expansion, end, 0);
+        }
+        word_truncate(&glob_path, length);
+    }
+    listing->pinned--;
+    return found;
+}
+
+static int is_glob_special(char c) { // escaped in the pattern when quoted
+    return c == '*' || c == '?' || c == '[' || c == ']' || c == '\\';
+}
+
+static void expand_append(const char *text, size_t length, int quoted) { // quoted text is never a glob
+    word_append(&expand_literal, text, length);
+    if (!quoted) {
+        word_append(&expand_pattern, text, length);
+        return;
+    }
+    word_reserve(&expand_pattern, length * 2);
+    for (size_t i = 0; i < length; i++) {
+        if (is_glob_special(text[i])) {
+            expand_pattern.text[expand_pattern.length++] = '\\';
+        }
+        expand_pattern.text[expand_pattern.length++] = text[i];
+    }
+    expand_pattern.text[expand_pattern.length] = '\0';
+}
+
+static const char *passwd_home(const char *name, size_t *length) { // the home field of name in /etc/passwd, NULL when absent
+    // Read directly rather than with getpwnam(), which would load the NSS modules of the build machine into the static build
+    int fd = open(PASSWD_PATH, O_RDONLY | O_CLOEXEC);
+    size_t name_length = strlen(name);
+    ssize_t count;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    passwd_text.length = 0;
+    word_append(&passwd_text, "", 0);
+    do {
+        word_reserve(&passwd_text, PASSWD_READ_SIZE);
+        count = read(fd, passwd_text.text + passwd_text.length, PASSWD_READ_SIZE);
+        passwd_text.length += count > 0 ? count : 0;
+    } while (count > 0 || (count < 0 && errno == EINTR));
+    close(fd);
+    passwd_text.text[passwd_text.length] = '\0';
+    for (const char *line = passwd_text.text; *line != '\0'; line = strchrnul(line, '\n') + (strchr(line, '\n') != NULL)) {
+        if (strncmp(line, name, name_length) != 0 || line[name_length] != ':') {
+            continue;
+        }
+        const char *field = line; // name:password:uid:gid:gecos:home:shell
+        for (int i = 0; i < PASSWD_HOME_FIELD && field != NULL; i++) {
+            field = memchr(field, ':', strchrnul(field, '\n') - field);
+            field = field != NULL ? field + 1 : NULL;
+        }
+        if (field != NULL) {
+            *length = strcspn(field, ":\n");
+            return field;
+        }
+    }
+    return NULL;
+}
+
+static int is_name_char(char c, int first) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
+
+static const char *lookup_variable(const char *name, size_t length, char *number) { // NULL when unset, number receives $? and $$
+    if (length == 1 && (*name == '?' || *name == '$')) {
+        int status = last_wait_status;
+        int value = *name == '$' ? (int)getpid() : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+        snprintf(number, EXPAND_NUMBER_SIZE, "%d", value);
+        return number;
+    }
+    for (char **entry = environ; *entry != NULL; entry++) { // no copy of the name as getenv() would need
+        if (strncmp(*entry, name, length) == 0 && (*entry)[length] == '=') {
+            return *entry + length + 1;
+        }
+    }
+    return NULL;
+}
+
+static const char *expand_variable(const char *cursor) { // cursor is on the $, returns what follows the expansion, NULL on a bad ${...}
+    char number[EXPAND_NUMBER_SIZE];
+    const char *name = cursor + 1;
+    int braced = *name == '{';
+
+    name += braced;
+    const char *end = name;
+    if (*end == '?' || *end == '$') {
+        end++;
+    } else {
+        while (is_name_char(*end, end == name)) {
+            end++;
+        }
+    }
+    if (braced && (end == name || *end != '}')) {
+        return NULL;
+    }
+    if (end == name) { // not a parameter: the $ stays
+        expand_append("$", 1, 1);
+        return cursor + 1;
+    }
+    const char *value = lookup_variable(name, end - name, number);
+    if (value != NULL) { // not split and not globbed, as if it were double quoted
+        expand_append(value, strlen(value), 1);
+    }
+    return end + braced;
+}
+
+static int expand_word(struct expansion *expansion, const char *source, int globbing) { // appends the fields of one word, -1 on a bad substitution
+    const char *cursor = source;
+    int quoted = 0;   // a word with quotes yields a field even when it expands to nothing
+    int pattern = 0;  // unquoted glob characters
+
+    expand_literal.length = 0;
+    expand_pattern.length = 0;
+    word_append(&expand_literal, "", 0);
+    word_append(&expand_pattern, "", 0);
+    if (*cursor == '~') { // ~ and ~user up to the first slash, when no part of the name is quoted
+        const char *end = cursor + 1 + strcspn(cursor + 1, "/'\"\\$");
+        const char *home = NULL;
+        size_t home_length = 0;
+        if (end == cursor + 1 && (*end == '\0' || *end == '/')) {
+            home = getenv("HOME");
+            home_length = home != NULL ? strlen(home) : 0;
+        } else if (*end == '\0' || *end == '/') {
+            glob_path.length = 0;
+            word_append(&glob_path, cursor + 1, end - cursor - 1);
+            home = passwd_home(glob_path.text, &home_length);
+        }
+        if (home != NULL) {
+            expand_append(home, home_length, 1);
+            cursor = end;
+        }
+    }
+
+    while (*cursor != '\0') {
+        if (*cursor == '\'') { // closed: the lexer checked it
+            const char *close = strchr(cursor + 1, '\'');
+            expand_append(cursor + 1, close - cursor - 1, 1);
+            cursor = close + 1;
+            quoted = 1;
+        } else if (*cursor == '"') {
+            cursor++;
+            quoted = 1;
+            while (*cursor != '"') {
+                size_t run = strcspn(cursor, "\"\\$");
+                if (run > 0) {
+                    expand_append(cursor, run, 1);
+                    cursor += run;
+                } else if (*cursor == '$') {
+                    if ((cursor = expand_variable(cursor)) == NULL) {
+                        return -1;
+                    }
+                } else {
+                    cursor += cursor[1] == '"' || cursor[1] == '\\' || cursor[1] == '$' || cursor[1] == '`';
+                    expand_append(cursor++, 1, 1);
+                }
+            }
+            cursor++;
+        } else if (*cursor == '\\') {
+            cursor++;
+            quoted = 1;
+            if (*cursor != '\0') {
+                expand_append(cursor++, 1, 1);
+            }
+        } else if (*cursor == '$') {
+            if ((cursor = expand_variable(cursor)) == NULL) {
+                return -1;
+            }
+        } else {
+            size_t run = strcspn(cursor, "'\"\\$*?[");
+            if (run == 0) {
+                pattern = 1;
+                run = 1;
+            }
+            expand_append(cursor, run, 0);
+            cursor += run;
+        }
+    }
+
+    if (pattern && globbing) {
+        glob_path.length = 0;
+        word_append(&glob_path, "", 0);
+        if (glob_walk(expansion, expand_pattern.text, 0) > 0) {
+            return 0;
+        }
+    }
+    if (expand_literal.length > 0 || quoted) { // no match: the word stays as written, without its quotes
+        expansion_push(expansion, expansion_copy(&expand_literal));
+    }
+    return 0;
+}
+
+static struct command *expand_command(struct command *cmd) { // the command as it runs, in the line arena; NULL once the error is reported
+    int redirections = 0;
+
+    for (const struct redirection *redirection = cmd->redirections; redirection != NULL; redirection = redirection->next) {
+        redirections |= redirection->source != NULL;
+    }
+    if (cmd->sources == NULL && !redirections) { // nothing to expand: the parsed command is used as it is
+        return cmd;
+    }
+    struct command *expanded = arena_alloc(&line_arena, sizeof(*expanded));
+    int64_t expand_start = trace_begin();
+    *expanded = *cmd;
+    expanded->sources = NULL;
+
+    if (cmd->sources != NULL) {
+        struct expansion fields = { NULL, 0, 0 };
+        for (int i = 0; i < cmd->argc; i++) {
+            if (cmd->sources[i] == NULL) {
+                expansion_push(&fields, cmd->argv[i]);
+            } else if (expand_word(&fields, cmd->sources[i], 1) < 0) {
+                shell_write(STDERR_FILENO, BADSUBSTITUTION_MSG, BADSUBSTITUTION_MSG_LENGTH);
+                return NULL;
+            }
+        }
+        expansion_push(&fields, NULL);
+        expanded->argv = fields.words;
+        expanded->argc = fields.count - 1;
+    }
+
+    struct redirection **tail = &expanded->redirections;
+    for (const struct redirection *redirection = redirections ? cmd->redirections : NULL; redirection != NULL; redirection = redirection->next) {
+        struct redirection *copy = arena_alloc(&line_arena, sizeof(*copy));
+        *copy = *redirection;
+        copy->next = NULL;
+        if (redirection->source != NULL) { // exactly one file name, a here-string is never globbed
+            struct expansion target = { NULL, 0, 0 };
+            if (expand_word(&target, redirection->source, redirection->type != REDIRECT_HERE_STRING) < 0) {
+                shell_write(STDERR_FILENO, BADSUBSTITUTION_MSG, BADSUBSTITUTION_MSG_LENGTH);
+                return NULL;
+            }
+            if (target.count == 0 && redirection->type == REDIRECT_HERE_STRING) {
+                expansion_push(&target, "");
+            }
+            if (target.count != 1) {
+                shell_write(STDERR_FILENO, AMBIGUOUSREDIRECT_MSG, AMBIGUOUSREDIRECT_MSG_LENGTH);
+                return NULL;
+            }
+            copy->target = target.words[0];
+            copy->source = NULL;
+        }
+        *tail = copy;
+        tail = &copy->next;
+    }
+    trace_end(TRACE_EXPAND, expand_start, 0, expanded->argc, expanded->argc > 0 ? expanded->argv[0] : NULL);
+    return expanded;
+}
+
+static void expand_free(void) {
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        free(dir_cache.slots[i].names);
+        free(dir_cache.slots[i].entries);
+    }
+    memset(&dir_cache, 0, sizeof(dir_cache));
+    free(expand_literal.text);
+    free(expand_pattern.text);
+    free(glob_path.text);
+}
+
+static int open_redirection(const struct redirection *redirection) { // opened in the parent with O_CLOEXEC, the child only inherits it through dup2
+    static const int flags[] = {
+        [REDIRECT_INPUT] = O_RDONLY,
+        [REDIRECT_OUTPUT] = O_WRONLY | O_CREAT | O_TRUNC,
+        [REDIRECT_APPEND] = O_WRONLY | O_CREAT | O_APPEND,
+        [REDIRECT_READ_WRITE] = O_RDWR | O_CREAT,
+    };
+    int fd;
+
+    if (redirection->type == REDIRECT_HERE_STRING) { // an anonymous file rather than a pipe: no size limit and no writer to keep around
+        size_t length = strlen(redirection->target);
+        fd = memfd_create("enseash-here-string", MFD_CLOEXEC);
+        if (fd >= 0 && (write(fd, redirection->target, length) != (ssize_t)length || write(fd, "\n", 1) != 1 || lseek(fd, 0, SEEK_SET) < 0)) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = open(redirection->target, flags[redirection->type] | O_CLOEXEC, 0644);
+    }
+
+    if (fd < 0) {
+        if (redirection->type == REDIRECT_INPUT || redirection->type == REDIRECT_HERE_STRING) {
+            shell_write(STDERR_FILENO, INPUTFILENOTFOUND_MSG, INPUTFILENOTFOUND_MSG_LENGTH);
+        } else {
+            shell_write(STDERR_FILENO, OUTPUTFILENOTFOUND_MSG, OUTPUTFILENOTFOUND_MSG_LENGTH);
+        }
+        return -1;
+    }
+    if (fd < FD_RELOCATION_BASE) { // keep clear of the small descriptors a later "n>&m" of the same command may overwrite
+        int relocated = fcntl(fd, F_DUPFD_CLOEXEC, FD_RELOCATION_BASE);
+        close(fd);
+        fd = relocated;
+    }
+    return fd;
+}
+
+static void close_fd_plan(struct fd_plan *plan) {
+    for (int i = 0; i < plan->opened_count; i++) {
+        close(plan->opened[i]);
+    }
+    plan->opened_count = 0;
+}
+
+static void add_fd_action(struct fd_plan *plan, int source, int target) {
+    plan->actions[plan->count].source = source;
+    plan->actions[plan->count].target = target;
+    plan->count++;
+}
+
+static int build_fd_plan(const struct command *cmd, int pipe_in, int pipe_out, struct fd_plan *plan) { // pipe ends first, then the redirections from left to right
+    int capacity = 2;
+
+    for (const struct redirection *redirection = cmd->redirections; redirection != NULL; redirection = redirection->next) {
+        capacity++;
+    }
+    plan->actions = arena_alloc(&line_arena, sizeof(struct fd_action) * capacity);
+    plan->opened = arena_alloc(&line_arena, sizeof(int) * capacity);
+    plan->count = 0;
+    plan->opened_count = 0;
+
+    if (pipe_in >= 0) {
+        add_fd_action(plan, pipe_in, STDIN_FILENO);
+    }
+    if (pipe_out >= 0) {
+        add_fd_action(plan, pipe_out, STDOUT_FILENO);
+    }
+    for (const struct redirection *redirection = cmd->redirections; redirection != NULL; redirection = redirection->next) {
+        if (redirection->type == REDIRECT_DUP_INPUT || redirection->type == REDIRECT_DUP_OUTPUT) { // n>&m duplicates, n>&- closes
+            const char *target = redirection->target;
+            char *end;
+            long source = strtol(target, &end, 10);
+
+            if (strncmp(target, "-", 2) == 0) {
+                add_fd_action(plan, -1, redirection->fd);
+            } else if (end != target && *end == '\0' && source >= 0 && source < FD_RELOCATION_BASE) {
+                add_fd_action(plan, (int)source, redirection->fd);
+            } else {
+                shell_write(STDERR_FILENO, REDIRECT_MSG, REDIRECT_MSG_LENGTH);
+                close_fd_plan(plan);
+                return -1;
+            }
+        } else {
+            int fd = open_redirection(redirection);
+            if (fd < 0) {
+                close_fd_plan(plan);
+                return -1;
+            }
+            plan->opened[plan->opened_count++] = fd;
+            add_fd_action(plan, fd, redirection->fd);
+        }
+    }
+    return 0;
+}
+
+static unsigned int hash_name(const char *name) { // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+static void hash_reset(void) {
+    if (command_hash.used == 0) { // every slot still empty: the first lookup does not fault in the whole table
+        return;
+    }
+    memset(command_hash.entries, 0, sizeof(command_hash.entries));
+    command_hash.used = 0;
+}
+
+static const char *current_path_var(void) {
+    const char *path_var = getenv("PATH");
+    return path_var != NULL ? path_var : DEFAULT_PATH;
+}
+
+static int path_var_matches(const struct word_buffer *seen, const char *path_var) { // the whole PATH, so a long one is not taken for a new one on every lookup
+    return seen->text != NULL && strcmp(seen->text, path_var) == 0;
+}
+
+static void path_var_remember(struct word_buffer *seen, const char *path_var) {
+    seen->length = 0;
+    word_append(seen, path_var, strlen(path_var));
+}
+
+static int resolve_in_path(const char *name, const char *path_var, char *resolved, size_t size) { // same search order as execvp
+    struct stat file_info;
+
+    while (1) {
+        const char *separator = strchrnul(path_var, ':');
+        size_t dir_length = separator - path_var;
+        size_t name_length = strlen(name);
+        size_t length = dir_length + (dir_length > 0) + name_length; // empty PATH element means the current directory
+
+        if (length < size) { // built with memcpy: no stdio on the way to the first exec
+            memcpy(resolved, path_var, dir_length);
+            resolved[dir_length] = '/';
+            memcpy(resolved + length - name_length, name, name_length + 1);
+        }
+        if (length < size && stat(resolved, &file_info) == 0
+            && S_ISREG(file_info.st_mode) && access(resolved, X_OK) == 0) {
+            return 0;
+        }
+        if (*separator == '\0') {
+            return -1;
+        }
+        path_var = separator + 1;
+    }
+}
+
+static struct hash_entry *hash_find(const char *name, int *free_slot) { // returns the entry for name, or NULL and the slot where it would go
+    unsigned int index = hash_name(name) & (HASH_TABLE_SIZE - 1);
+
+    *free_slot = -1;
+    for (int probe = 0; probe < HASH_TABLE_SIZE; probe++) {
+        struct hash_entry *entry = &command_hash.entries[index];
+        if (entry->state == HASH_SLOT_EMPTY) {
+            if (*free_slot < 0) {
+                *free_slot = index;
+            }
+            return NULL;
+        }
+        if (entry->state == HASH_SLOT_DELETED && *free_slot < 0) {
+            *free_slot = index;
+        } else if (entry->state == HASH_SLOT_USED && strncmp(entry->name, name, HASH_NAME_SIZE) == 0) {
+            return entry;
+        }
+        index = (index + 1) & (HASH_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+static struct hash_entry *hash_store(const char *name, const char *path, int free_slot, int hits) { // free_slot from hash_find()
+    struct hash_entry *entry = &command_hash.entries[free_slot];
+
+    if (entry->state == HASH_SLOT_EMPTY) {
+        command_hash.used++;
+    }
+    entry->state = HASH_SLOT_USED;
+    entry->hits = hits;
+    strncpy(entry->name, name, HASH_NAME_SIZE);
+    strncpy(entry->path, path, HASH_PATH_SIZE);
+    return entry;
+}
+
+static const char *hash_lookup(const char *name) { // absolute path to hand to execve, NULL when the command is not on PATH
+    static char uncached_path[HASH_PATH_SIZE];
+    const char *path_var = current_path_var();
+    struct hash_entry *entry;
+    int free_slot;
+
+    if (strchr(name, '/') != NULL) { // explicit paths are not searched
+        return name;
+    }
+    if (!path_var_matches(&command_hash.path_var, path_var)) { // PATH changed since the entries were resolved
+        hash_reset();
+        path_var_remember(&command_hash.path_var, path_var);
+    }
+
+    entry = hash_find(name, &free_slot);
+    if (entry != NULL) {
+        entry->hits++;
+        command_hash.hits++;
+        return entry->path;
+    }
+
+    command_hash.misses++;
+    if (resolve_in_path(name, path_var, uncached_path, HASH_PATH_SIZE) < 0) {
+        return NULL;
+    }
+    if (strnlen(name, HASH_NAME_SIZE) == HASH_NAME_SIZE || command_hash.used >= HASH_TABLE_SIZE * 3 / 4) {
+        if (command_hash.used >= HASH_TABLE_SIZE * 3 / 4) { // flush rather than let probe chains grow
+            hash_reset();
+        }
+        return uncached_path;
+    }
+
+    return hash_store(name, uncached_path, free_slot, 1)->path;
+}
+
+static void hash_forget(const char *name) { // the cached file vanished or stopped being executable
+    int free_slot;
+    struct hash_entry *entry = hash_find(name, &free_slot);
+    if (entry != NULL) {
+        entry->state = HASH_SLOT_DELETED;
+    }
+}
+
+static void hash_print(void) { // one write for the whole table
+    char message[MESSAGE_BUFFER_SIZE + HASH_PATH_SIZE];
+    struct output_buffer output;
+    int length;
+
+    output.fd = STDOUT_FILENO;
+    output.length = 0;
+    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
+        const struct hash_entry *entry = &command_hash.entries[i];
+        if (entry->state == HASH_SLOT_USED) {
+            length = snprintf(message, sizeof(message), "%6d  %s\n", entry->hits, entry->path);
+            output_append(&output, message, length);
+        }
+    }
+    length = snprintf(message, sizeof(message), "hash: %ld hits, %ld misses\n", command_hash.hits, command_hash.misses);
+    output_append(&output, message, length);
+    output_flush(&output);
+}
+
+static int limits_active(void) { // rlimits to set: only a forked child can set them before its exec
+    return active_limits.cpu_seconds > 0 || active_limits.memory_bytes > 0;
+}
+
+static int apply_limits(void) { // in a forked child before its exec, -1 when a limit could not be set
+    struct rlimit limit;
+
+    if (active_limits.cpu_seconds > 0) {
+        limit.rlim_cur = active_limits.cpu_seconds;
+        limit.rlim_max = active_limits.cpu_seconds + 1; // SIGXCPU at the soft limit, SIGKILL at the hard one
+        if (setrlimit(RLIMIT_CPU, &limit) < 0) {
+            return -1;
+        }
+    }
+    if (active_limits.memory_bytes > 0) {
+        limit.rlim_cur = active_limits.memory_bytes;
+        limit.rlim_max = active_limits.memory_bytes;
+        if (setrlimit(RLIMIT_AS, &limit) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void cgroup_join(void) { // in a forked child, before exec: whatever it starts lands in the leaf too
+    if (stage_cgroup_fd >= 0) {
+        write(stage_cgroup_fd, "0", 1);
+    }
+}
+
+static pid_t spawn_posix(struct command *cmd, const struct fd_plan *plan, pid_t pgid) { // pgid 0 puts the child in a new process group
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    sigset_t default_signals;
+    pid_t child_pid = -1;
+    int error;
+
+    posix_spawn_file_actions_init(&actions);
+    for (int i = 0; i < plan->count; i++) {
+        if (plan->actions[i].source < 0) {
+            posix_spawn_file_actions_addclose(&actions, plan->actions[i].target);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, plan->actions[i].source, plan->actions[i].target); // dup2 clears O_CLOEXEC on the target descriptor
+        }
+    }
+
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGTTOU); // ignored by the shell, restored for the command
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    posix_spawnattr_setsigmask(&attributes, &events.child_mask); // the signals of the event loop are blocked in the shell only
+    posix_spawnattr_setpgroup(&attributes, pgid);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    const char *path = hash_lookup(cmd->argv[0]);
+    error = path != NULL ? posix_spawn(&child_pid, path, &actions, &attributes, cmd->argv, environ) : ENOENT; // no PATH walk, execve the cached path
+    if ((error == ENOENT || error == EACCES) && path != NULL && path != cmd->argv[0]) { // stale entry: resolve again once
+        hash_forget(cmd->argv[0]);
+        path = hash_lookup(cmd->argv[0]);
+        error = path != NULL ? posix_spawn(&child_pid, path, &actions, &attributes, cmd->argv, environ) : ENOENT;
+    }
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error != 0) { // glibc reports exec failures back to the parent
+        shell_write(STDERR_FILENO, CMDNOTFOUND_MSG, CMDNOTFOUND_MSG_LENGTH);
+        return -1;
+    }
+    trace_spawned(child_pid, -1, trace.enabled ? trace_now() : 0); // glibc returns once the child has exec'ed
+    return child_pid;
+}
+
+static void apply_fd_plan(const struct fd_plan *plan) { // in a forked child
+    for (int i = 0; i < plan->count; i++) { // redirect the standard streams using dup2 system call
+        if (plan->actions[i].source < 0) {
+            close(plan->actions[i].target);
+        } else {
+            dup2(plan->actions[i].source, plan->actions[i].target);
+        }
+    }
+}
+
+static pid_t spawn_fork(struct command *cmd, const struct fd_plan *plan, pid_t pgid) {
+    const char *path = hash_lookup(cmd->argv[0]); // resolved in the parent so the cache outlives the child
+    int exec_pipe[2];
+    trace_exec_pipe(exec_pipe);
+    pid_t child_pid = fork(); // create a new child process to execute the command
+
+    if (child_pid == 0) {
+        cgroup_join();
+        setpgid(0, pgid);
+        signal(SIGTTOU, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &events.child_mask, NULL);
+        apply_fd_plan(plan);
+        if (apply_limits() < 0) { // never run the command without the limits it was given
+            write(STDERR_FILENO, LIMIT_FAILED_MSG, LIMIT_FAILED_MSG_LENGTH);
+            _exit(1);
+        }
+        trace_exec_start(exec_pipe[1], 0);
+        if (path != NULL) {
+            execv(path, cmd->argv);
+        }
+        execvp(cmd->argv[0], cmd->argv); // stale or missing entry: fall back to the PATH search of execvp
+        trace_exec_start(exec_pipe[1], 1);
+        write(STDERR_FILENO, CMDNOTFOUND_MSG, CMDNOTFOUND_MSG_LENGTH); // handle command not found error
+        _exit(1);
+    }
+    if (exec_pipe[1] >= 0) { // the next stages must not inherit it
+        close(exec_pipe[1]);
+    }
+    if (child_pid > 0) {
+        setpgid(child_pid, pgid == 0 ? child_pid : pgid); // also done by the parent so the group exists before the next stage starts
+    }
+    trace_spawned(child_pid, exec_pipe[0], 0);
+    return child_pid;
+}
+
+static void builtin_error(const char *name, const char *detail) {
+    char message[MESSAGE_BUFFER_SIZE];
+    int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%s: %s\n", name, detail);
+    if (length >= MESSAGE_BUFFER_SIZE) {
+        length = MESSAGE_BUFFER_SIZE - 1;
+    }
+    shell_write(STDERR_FILENO, message, length);
+}
+
+static int copy_unsupported(int error) { // the kernel cannot do this copy this way, try the next method
+    return error == EINVAL || error == EXDEV || error == EBADF || error == ENOSYS || error == EOPNOTSUPP;
+}
+
+static int copy_fd(int in, int out) { // in-kernel when possible: copy_file_range, then sendfile, then splice, then read/write
+    struct stat in_info;
+    struct stat out_info;
+    ssize_t copied = -1;
+    int started = 0; // once bytes moved, a failure is an error and not a reason to switch method
+
+    if (fstat(in, &in_info) < 0 || fstat(out, &out_info) < 0) {
+        return -1;
+    }
+    if (S_ISREG(in_info.st_mode) && S_ISREG(out_info.st_mode)) { // file to file: reflink or in-kernel copy, no page cache round trip
+        while ((copied = copy_file_range(in, NULL, out, NULL, COPY_CHUNK_SIZE, 0)) > 0 || (copied < 0 && errno == EINTR)) {
+            started |= copied > 0;
+        }
+        if (copied == 0 || started || !copy_unsupported(errno)) { // O_APPEND outputs and cross-device copies fall through
+            return copied == 0 ? 0 : -1;
+        }
+    }
+    if (S_ISREG(in_info.st_mode) || S_ISBLK(in_info.st_mode)) { // file to pipe, socket, terminal or appended file
+        while ((copied = sendfile(out, in, NULL, COPY_CHUNK_SIZE)) > 0 || (copied < 0 && errno == EINTR)) {
+            started |= copied > 0;
+        }
+        if (copied == 0 || started || !copy_unsupported(errno)) {
+            return copied == 0 ? 0 : -1;
+        }
+    }
+    if (S_ISFIFO(in_info.st_mode) || S_ISFIFO(out_info.st_mode)) { // pipe pages are moved, not copied
+        while ((copied = splice(in, NULL, out, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 || (copied < 0 && errno == EINTR)) {
+            started |= copied > 0;
+        }
+        if (copied == 0 || started || !copy_unsupported(errno)) {
+            return copied == 0 ? 0 : -1;
+        }
+    }
+
+    char buffer[COPY_BUFFER_SIZE];
+    ssize_t length;
+    while ((length = read(in, buffer, sizeof(buffer))) != 0) {
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length < 0) {
+            return -1;
+        }
+        for (ssize_t written = 0; written < length; written += copied) {
+            copied = write(out, buffer + written, length - written);
+            if (copied < 0 && errno == EINTR) {
+                copied = 0;
+            } else if (copied < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int is_plain_cat(int argc, char *argv[]) { // cat without options only moves bytes, the shell can do it
+    if (strncmp(argv[0], "cat", 4) != 0) {
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_regular_file(const char *path) {
+    struct stat file_info;
+    return stat(path, &file_info) == 0 && S_ISREG(file_info.st_mode);
+}
+
+static int has_regular_stdin(const struct command *cmd) { // the last redirection of descriptor 0, or the shell's own stdin
+    const struct redirection *input = NULL;
+    struct stat file_info;
+
+    for (const struct redirection *redirection = cmd->redirections; redirection != NULL; redirection = redirection->next) {
+        if (redirection->fd == STDIN_FILENO) {
+            input = redirection;
+        }
+    }
+    if (input == NULL) {
+        return fstat(STDIN_FILENO, &file_info) == 0 && S_ISREG(file_info.st_mode);
+    }
+    if (input->type == REDIRECT_HERE_STRING) { // an anonymous regular file
+        return 1;
+    }
+    return (input->type == REDIRECT_INPUT || input->type == REDIRECT_READ_WRITE) && is_regular_file(input->target);
+}
+
+static int accepts_cat(const struct command *cmd) { // in the shell process only when the copy cannot block: regular files in, no limit that needs a child
+    if (!is_plain_cat(cmd->argc, cmd->argv) || active_limits.timeout_ms > 0 || active_limits.cpu_seconds > 0 || active_limits.memory_bytes > 0) {
+        return 0;
+    }
+    if (cmd->argc == 1) {
+        return has_regular_stdin(cmd);
+    }
+    for (int i = 1; i < cmd->argc; i++) {
+        int regular = strncmp(cmd->argv[i], "-", 2) == 0 ? has_regular_stdin(cmd) : is_regular_file(cmd->argv[i]);
+        if (!regular) { // a tty, a pipe or a device: a forked copy that Ctrl-C and deadlines can reach
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int cat_files(int argc, char *argv[]) { // cat [file | -]...: returns the exit status
+    int status = 0;
+
+    if (argc == 1) {
+        return copy_fd(STDIN_FILENO, STDOUT_FILENO) < 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        int standard_input = strncmp(argv[i], "-", 2) == 0;
+        int fd = standard_input ? STDIN_FILENO : open(argv[i], O_RDONLY | O_CLOEXEC);
+        int error = fd < 0 || copy_fd(fd, STDOUT_FILENO) < 0 ? errno : 0;
+        if (fd >= 0 && !standard_input) {
+            close(fd);
+        }
+        if (error == EPIPE) { // the reader is gone, like the SIGPIPE an external cat would get
+            return 1;
+        }
+        if (error != 0) {
+            char detail[MESSAGE_BUFFER_SIZE];
+            snprintf(detail, MESSAGE_BUFFER_SIZE, "%s: %s", argv[i], strerror(error));
+            builtin_error("cat", detail);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static void close_if_open(int fd) {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static int write_file_at(int dir_fd, const char *file, const char *text) { // a single write, as cgroup files expect; -1 with errno set on failure
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t written = write(fd, text, strlen(text));
+    int error = errno;
+    close(fd);
+    errno = error;
+    return written < 0 ? -1 : 0;
+}
+
+static ssize_t read_file_at(int dir_fd, const char *file, char *buffer, size_t size) { // NUL terminated, -1 when missing
+    int fd = openat(dir_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    buffer[length > 0 ? length : 0] = '\0';
+    return length;
+}
+
+static long cgroup_stat_field(const char *text, const char *key) { // "key value" lines of cpu.stat and memory.events, -1 when absent
+    size_t key_length = strlen(key);
+    for (const char *line = text; *line != '\0'; line = strchrnul(line, '\n') + (strchr(line, '\n') != NULL)) {
+        if (strncmp(line, key, key_length) == 0 && line[key_length] == ' ') {
+            return strtol(line + key_length + 1, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+static void cgroup_leaf_name(char *name, long id) {
+    snprintf(name, CGROUP_NAME_SIZE, "enseash-%d-%ld", (int)getpid(), id);
+}
+
+static void cgroup_create(struct cgroup_leaf *leaf) { // a new leaf with the configured limits, procs_fd stays -1 when commands are not placed
+    char name[CGROUP_NAME_SIZE];
+
+    leaf->dir_fd = -1;
+    leaf->procs_fd = -1;
+    leaf->parent_fd = -1;
+    if (cgroup_parent_fd < 0) {
+        return;
+    }
+    leaf->id = ++cgroup_leaf_count;
+    cgroup_leaf_name(name, leaf->id);
+    if (mkdirat(cgroup_parent_fd, name, 0755) < 0 || (leaf->dir_fd = openat(cgroup_parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        builtin_error("cgroup", strerror(errno));
+        return;
+    }
+    leaf->parent_fd = fcntl(cgroup_parent_fd, F_DUPFD_CLOEXEC, 0);
+    for (int i = 0; i < CGROUP_SETTING_COUNT; i++) {
+        if (cgroup_settings[i] != NULL && write_file_at(leaf->dir_fd, cgroup_setting_files[i], cgroup_settings[i]) < 0) {
+            builtin_error(cgroup_setting_files[i], strerror(errno));
+        }
+    }
+    leaf->procs_fd = openat(leaf->dir_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+}
+
+static void cgroup_collect(struct cgroup_leaf *leaf, struct cgroup_usage *usage) { // once every process of the leaf is reaped: read the counters, remove the leaf
+    char text[CGROUP_FILE_SIZE];
+    char name[CGROUP_NAME_SIZE];
+
+    usage->cpu_us = usage->user_us = usage->system_us = usage->memory_peak = -1;
+    usage->oom_kills = 0;
+    if (leaf->dir_fd < 0) {
+        return;
+    }
+    if (read_file_at(leaf->dir_fd, "cpu.stat", text, sizeof(text)) > 0) {
+        usage->cpu_us = cgroup_stat_field(text, "usage_usec");
+        usage->user_us = cgroup_stat_field(text, "user_usec");
+        usage->system_us = cgroup_stat_field(text, "system_usec");
+    }
+    if (read_file_at(leaf->dir_fd, "memory.peak", text, sizeof(text)) > 0) {
+        usage->memory_peak = strtol(text, NULL, 10);
+    }
+    if (read_file_at(leaf->dir_fd, "memory.events", text, sizeof(text)) > 0 && cgroup_stat_field(text, "oom_kill") > 0) {
+        usage->oom_kills = cgroup_stat_field(text, "oom_kill");
+    }
+    close_if_open(leaf->procs_fd);
+    close(leaf->dir_fd);
+    leaf->procs_fd = -1;
+    leaf->dir_fd = -1;
+    cgroup_leaf_name(name, leaf->id);
+    if (leaf->parent_fd >= 0) {
+        unlinkat(leaf->parent_fd, name, AT_REMOVEDIR); // EBUSY when the command left processes behind: the leaf stays until they exit
+        close(leaf->parent_fd);
+        leaf->parent_fd = -1;
+    }
+}
+
+static void cgroup_enter_subshell(const struct cgroup_leaf *leaf) { // in a forked subshell: it and every command it runs share its leaf
+    stage_cgroup_fd = leaf->procs_fd;
+    cgroup_join();
+    stage_cgroup_fd = -1;
+    cgroup_parent_fd = -1;
+}
+
+static uint64_t event_tag(enum event_kind kind, int slot, int index) { // epoll data: kind, job slot, stage
+    return (uint64_t)kind << 56 | (uint64_t)(uint32_t)slot << 24 | (uint64_t)(index & 0xffffff);
+}
+
+static enum event_kind event_kind_of(uint64_t tag) {
+    return (enum event_kind)(tag >> 56);
+}
+
+static int event_slot(uint64_t tag) {
+    return (int)(tag >> 24 & 0xffffffff);
+}
+
+static int event_index(uint64_t tag) {
+    return (int)(tag & 0xffffff);
+}
+
+static int event_watch(int fd, uint64_t tag) { // level-triggered: a descriptor left unread is reported again by the next wait
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = tag };
+    return epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void event_loop_init(void) { // SIGINT, SIGCHLD and SIGWINCH become readable on a descriptor instead of interrupting system calls
+    sigemptyset(&events.signals);
+    sigaddset(&events.signals, SIGINT);
+    sigaddset(&events.signals, SIGCHLD);
+    sigaddset(&events.signals, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &events.signals, &events.child_mask);
+    events.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    events.signal_fd = signalfd(-1, &events.signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    event_watch(events.signal_fd, event_tag(EVENT_SIGNAL, 0, 0));
+    events.input_fd = -1;
+    events.interrupts = 0;
+    events.jobs_finished = 0;
+}
+
+static void event_loop_reset(void) { // in a forked subshell: an inherited epoll instance would be shared with the parent
+    close_if_open(events.epoll_fd);
+    close_if_open(events.signal_fd);
+    event_loop_init();
+}
+
+static int builtin_parallel(int argc, char *argv[]); // a pipeline stage of its own, with the parallel runs
+
+static pid_t spawn_in_shell(struct command *cmd, const struct fd_plan *plan, pid_t pgid) { // a pipeline stage that is a plain cat or parallel: a forked shell runs it, no exec
+    pid_t child_pid = fork();
+
+    if (child_pid == 0) {
+        cgroup_join();
+        setpgid(0, pgid);
+        signal(SIGTTOU, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &events.child_mask, NULL); // Ctrl-C ends the copy like any command
+        apply_fd_plan(plan);
+        close_range(STDERR_FILENO + 1, ~0U, 0); // no exec to drop the O_CLOEXEC descriptors, e.g. the read end of our own output pipe
+        if (apply_limits() < 0) {
+            write(STDERR_FILENO, LIMIT_FAILED_MSG, LIMIT_FAILED_MSG_LENGTH);
+            _exit(1);
+        }
+        int status;
+        if (is_plain_cat(cmd->argc, cmd->argv)) {
+            status = cat_files(cmd->argc, cmd->argv);
+        } else { // its jobs join the stage's process group, waited for by the forked shell's own event loop
+            event_loop_reset();
+            job_pgid = getpgrp();
+            terminal_control = 0;
+            status = builtin_parallel(cmd->argc, cmd->argv);
+        }
+        shell_flush();
+        _exit(status);
+    }
+    if (child_pid > 0) {
+        setpgid(child_pid, pgid == 0 ? child_pid : pgid);
+        trace_spawned(child_pid, -1, trace.enabled ? trace_now() : 0); // no exec: the stage starts with the fork
+    }
+    return child_pid;
+}
+
+static pid_t start_pipeline(struct pipeline *pipeline, enum spawn_engine engine, pid_t child_pids[], struct cgroup_leaf *cgroup) { // returns the process group, 0 when no stage started
+    pid_t pgid = job_pgid;
+    int previous_read = -1; // read end of the pipe feeding the current stage
+    int i = 0;
+
+    shell_flush(); // nothing pending may be duplicated into a forked stage or come out after its output
+    if (cgroup != NULL) {
+        cgroup_create(cgroup);
+        stage_cgroup_fd = cgroup->procs_fd;
+    }
+    if (stage_cgroup_fd >= 0 || limits_active()) { // the child moves itself into the leaf and sets its rlimits before exec, posix_spawn cannot do that
+        engine = SPAWN_ENGINE_FORK;
+    }
+
+    for (int stage = 0; stage < pipeline->count; stage++) {
+        child_pids[stage] = -1;
+    }
+    for (struct command *stage = pipeline->stages; stage != NULL; stage = stage->next, i++) {
+        int pipe_fds[2] = { -1, -1 };
+        struct fd_plan plan;
+
+        if (stage->next != NULL && pipe2(pipe_fds, O_CLOEXEC) < 0) {
+            shell_write(STDERR_FILENO, PIPE_MSG, PIPE_MSG_LENGTH);
+            break;
+        }
+
+        struct command *cmd = expand_command(stage); // right before the spawn: sees the files the previous stages of the line created
+        int64_t spawn_start = trace_begin();
+        if (cmd != NULL && build_fd_plan(cmd, previous_read, pipe_fds[1], &plan) == 0) { // explicit redirections are applied after the pipe, like in sh
+            if (cmd->argc == 0) { // redirections only: the files are created, nothing runs
+            } else if (is_plain_cat(cmd->argc, cmd->argv) || strncmp(cmd->argv[0], "parallel", 9) == 0) {
+                child_pids[i] = spawn_in_shell(cmd, &plan, pgid);
+            } else if (engine == SPAWN_ENGINE_FORK) {
+                child_pids[i] = spawn_fork(cmd, &plan, pgid);
+            } else {
+                child_pids[i] = spawn_posix(cmd, &plan, pgid);
+            }
+            close_fd_plan(&plan);
+            trace_end(TRACE_SPAWN, spawn_start, child_pids[i], cmd->argc, cmd->argc > 0 ? cmd->argv[0] : NULL);
+        }
+        if (pgid == 0 && child_pids[i] > 0) { // the first started stage leads the process group
+            pgid = child_pids[i];
+        }
+
+        close_if_open(previous_read); // the parent keeps no pipe ends, so EOF and SIGPIPE propagate
+        close_if_open(pipe_fds[1]);
+        previous_read = pipe_fds[0];
+    }
+    close_if_open(previous_read);
+    stage_cgroup_fd = -1;
+    return pgid;
+}
+
+static int grow_job_table(void) { // the returned slot is free
+    int size = job_table_size > 0 ? job_table_size * 2 : JOB_TABLE_INITIAL_SIZE;
+    struct job *table = realloc(job_table, sizeof(struct job) * size);
+
+    if (table == NULL) {
+        return -1;
+    }
+    memset(table + job_table_size, 0, sizeof(struct job) * (size - job_table_size));
+    job_table = table;
+    int slot = job_table_size;
+    job_table_size = size;
+    return slot;
+}
+
+static struct job *add_job(pid_t child_pids[], int count, pid_t pgid, const char *command_line) { // NULL when out of memory
+    int slot = 0;
+
+    while (slot < job_table_size && job_table[slot].id != 0) {
+        slot++;
+    }
+    if (slot == job_table_size && grow_job_table() < 0) {
+        return NULL;
+    }
+    struct job *job = &job_table[slot];
+    job->pids = malloc(sizeof(pid_t) * count);
+    job->pidfds = malloc(sizeof(int) * count);
+    job->command_line = strdup(command_line);
+    if (job->pids == NULL || job->pidfds == NULL || job->command_line == NULL) {
+        free(job->pids);
+        free(job->pidfds);
+        free(job->command_line);
+        return NULL;
+    }
+    job->id = slot + 1; // lowest free number, like sh
+    running_jobs++;
+    job->done = 0;
+    job->pgid = pgid;
+    job->count = count;
+    job->status = W_EXITCODE(1, 0);
+    memcpy(job->pids, child_pids, sizeof(pid_t) * count);
+    memset(&job->usage, 0, sizeof(job->usage));
+    job->limits = active_limits;
+    job->limit = LIMIT_NONE;
+    job->cgroup.dir_fd = -1;
+    job->cgroup.parent_fd = -1;
+    job->cgroup.procs_fd = -1;
+    for (int i = 0; i < count; i++) { // each exit wakes the loop on its own stage: no scan of the job table
+        job->pidfds[i] = child_pids[i] > 0 ? pidfd_open(child_pids[i], 0) : -1;
+        if (job->pidfds[i] >= 0 && event_watch(job->pidfds[i], event_tag(EVENT_JOB, slot, i)) < 0) {
+            close(job->pidfds[i]);
+            job->pidfds[i] = -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->time_start);
+    return job;
+}
+
+static long timeval_us(const struct timeval *time) {
+    return time->tv_sec * 1000000L + time->tv_usec;
+}
+
+static void add_usage(struct rusage *total, const struct rusage *stage) { // times and counters add up, memory is the largest stage
+    total->ru_utime.tv_sec += stage->ru_utime.tv_sec;
+    total->ru_utime.tv_usec += stage->ru_utime.tv_usec;
+    total->ru_stime.tv_sec += stage->ru_stime.tv_sec;
+    total->ru_stime.tv_usec += stage->ru_stime.tv_usec;
+    if (stage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = stage->ru_maxrss;
+    }
+    total->ru_minflt += stage->ru_minflt;
+    total->ru_majflt += stage->ru_majflt;
+    total->ru_nvcsw += stage->ru_nvcsw;
+    total->ru_nivcsw += stage->ru_nivcsw;
+}
+
+static enum limit_kind limit_of_status(int status, const struct rusage *usage, const struct command_limits *limits) { // which limit, if any, ended the command
+    if (!WIFSIGNALED(status)) {
+        return LIMIT_NONE;
+    }
+    int signal_number = WTERMSIG(status);
+    long cpu_us = timeval_us(&usage->ru_utime) + timeval_us(&usage->ru_stime);
+    if (signal_number == SIGXCPU || (signal_number == SIGKILL && limits->cpu_seconds > 0 && cpu_us >= limits->cpu_seconds * 1000000)) {
+        return LIMIT_CPU;
+    }
+    if (limits->memory_bytes > 0 && (signal_number == SIGSEGV || signal_number == SIGABRT || signal_number == SIGBUS)) { // what a failed allocation usually ends in
+        return LIMIT_MEMORY;
+    }
+    return LIMIT_NONE;
+}
+
+static int json_escape(char *out, size_t size, const char *text) { // returns the length written, truncates to fit
+    static const char hex_digits[] = "0123456789abcdef";
+    size_t length = 0;
+
+    for (; *text != '\0' && length + 6 < size; text++) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') {
+            out[length++] = '\\';
+            out[length++] = c;
+        } else if (c < 0x20) {
+            memcpy(out + length, "\\u00", 4);
+            out[length + 4] = hex_digits[c >> 4];
+            out[length + 5] = hex_digits[c & 0xf];
+            length += 6;
+        } else {
+            out[length++] = c;
+        }
+    }
+    out[length] = '\0';
+    return length;
+}
+
+static void log_command_stats(const char *command_line, int status, long wall_ns, const struct rusage *usage, int background, enum limit_kind limit,
+                              const struct cgroup_usage *cgroup) { // one JSON line per command
+    struct timespec now;
+    int length;
+
+    if (stats_log_fd < 0) {
+        return;
+    }
+    size_t escaped_size = strlen(command_line) * 6 + 7; // every character may become \u00XX
+    char *escaped = arena_alloc(&line_arena, escaped_size);
+    size_t line_size = STATS_LOG_LINE_SIZE + escaped_size;
+    char *line = arena_alloc(&line_arena, line_size);
+    clock_gettime(CLOCK_REALTIME, &now);
+    json_escape(escaped, escaped_size, command_line);
+    length = snprintf(line, line_size,
+                      "{\"time\":%ld.%03ld,\"command\":\"%s\",\"background\":%s,\"%s\":%d,\"limit\":\"%s\",\"wall_us\":%ld,"
+                      "\"user_us\":%ld,\"sys_us\":%ld,\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,"
+                      "\"cgroup_cpu_us\":%ld,\"cgroup_memory_peak\":%ld}\n",
+                      (long)now.tv_sec, now.tv_nsec / 1000000, escaped, background ? "true" : "false",
+                      WIFSIGNALED(status) ? "signal" : "exit", WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status),
+                      limit_names[limit], wall_ns / 1000, timeval_us(&usage->ru_utime), timeval_us(&usage->ru_stime), usage->ru_maxrss,
+                      usage->ru_minflt, usage->ru_majflt, usage->ru_nvcsw, usage->ru_nivcsw, cgroup->cpu_us, cgroup->memory_peak);
+    write(stats_log_fd, line, length); // O_APPEND: each record lands in one write
+}
+
+static void job_reap_stage(struct job *job, int i, int options) { // wait4() on one stage; WNOHANG leaves it for later when it is still running
+    int stage_status;
+    struct rusage stage_usage;
+
+    if (job->pids[i] <= 0 || wait4(job->pids[i], &stage_status, options, &stage_usage) <= 0) {
+        return;
+    }
+    trace_reap(job->pids[i], stage_status);
+    add_usage(&job->usage, &stage_usage);
+    job->pids[i] = -1;
+    close_if_open(job->pidfds[i]); // also leaves the epoll set
+    job->pidfds[i] = -1;
+    if (i == job->count - 1) {
+        job->status = stage_status;
+    }
+}
+
+static int job_finish(struct job *job) { // 1 when every stage has been reaped: the job is done and waits to be reported
+    for (int i = 0; i < job->count; i++) {
+        if (job->pids[i] > 0) {
+            return 0;
+        }
+    }
+    job->done = 1;
+    running_jobs--;
+    if (job->limits.timeout_ms > 0 && WIFEXITED(job->status) && WEXITSTATUS(job->status) == LIMIT_TIMEOUT_EXIT_STATUS) { // run by a subshell, see run_background()
+        job->limit = LIMIT_TIMEOUT;
+    } else {
+        job->limit = limit_of_status(job->status, &job->usage, &job->limits);
+    }
+    cgroup_collect(&job->cgroup, &job->cgroup_usage);
+    if (job->limit == LIMIT_NONE && job->cgroup_usage.oom_kills > 0 && WIFSIGNALED(job->status)) {
+        job->limit = LIMIT_MEMORY;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->time_end);
+    return 1;
+}
+
+static int job_event(uint64_t tag) { // a background stage exited: only that pid is reaped, 1 when its job is done
+    int slot = event_slot(tag);
+
+    if (slot >= job_table_size || job_table[slot].id == 0 || job_table[slot].done || event_index(tag) >= job_table[slot].count) {
+        return 0;
+    }
+    job_reap_stage(&job_table[slot], event_index(tag), WNOHANG);
+    return job_finish(&job_table[slot]);
+}
+
+static void event_read_signals(void) {
+    struct signalfd_siginfo signals[EVENT_BATCH];
+    ssize_t length;
+
+    while ((length = read(events.signal_fd, signals, sizeof(signals))) > 0) {
+        for (size_t i = 0; i < (size_t)length / sizeof(signals[0]); i++) {
+            const struct signalfd_siginfo *info = &signals[i];
+            if (info->ssi_signo == SIGINT) {
+                events.interrupts++;
+            } else if (info->ssi_signo == SIGWINCH) {
+                events.resized = 1;
+            } else if (trace.enabled && info->ssi_code != CLD_STOPPED && info->ssi_code != CLD_CONTINUED) { // one SIGCHLD may stand for several children, only this one is timed
+                trace_exited(info->ssi_pid, info->ssi_code == CLD_EXITED ? W_EXITCODE(info->ssi_status, 0) : info->ssi_status);
+            }
+        }
+    }
+}
+
+static int event_wait(struct epoll_event ready[], int max, int timeout_ms) { // the caller's ready descriptors; signals and background jobs are handled here
+    struct epoll_event batch[EVENT_BATCH];
+    int count;
+    int kept = 0;
+
+    while ((count = epoll_wait(events.epoll_fd, batch, EVENT_BATCH, timeout_ms)) < 0 && errno == EINTR) {
+    }
+    for (int i = 0; i < count; i++) {
+        switch (event_kind_of(batch[i].data.u64)) {
+        case EVENT_SIGNAL:
+            event_read_signals();
+            break;
+        case EVENT_JOB:
+            events.jobs_finished += job_event(batch[i].data.u64);
+            break;
+        default:
+            if (kept < max) {
+                ready[kept++] = batch[i];
+            }
+        }
+    }
+    return kept;
+}
+
+static int event_wait_input(int fd, int wake_on_resize) { // 1 once fd is readable; 0 when a job finished, Ctrl-C reached the shell or (wake_on_resize) the terminal was resized
+    struct epoll_event ready[EVENT_BATCH];
+    struct epoll_event input = { .events = EPOLLIN | EPOLLONESHOT, .data.u64 = event_tag(EVENT_INPUT, 0, 0) };
+
+    if (fd != events.input_fd) {
+        events.input_fd = fd;
+        events.input_pollable = epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, fd, &input) == 0; // EPERM for a regular file
+    } else if (events.input_pollable) {
+        epoll_ctl(events.epoll_fd, EPOLL_CTL_MOD, fd, &input); // one-shot: typeahead does not wake the waits for commands
+    }
+    if (!events.input_pollable) {
+        return 1;
+    }
+    while (events.jobs_finished == 0 && events.interrupts == 0 && !(wake_on_resize && events.resized)) {
+        int count = event_wait(ready, EVENT_BATCH, -1);
+        for (int i = 0; i < count; i++) {
+            if (event_kind_of(ready[i].data.u64) == EVENT_INPUT) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int event_take_interrupt(void) {
+    int interrupted = events.interrupts > 0;
+    events.interrupts = 0;
+    return interrupted;
+}
+
+static int reap_jobs(void) { // non-blocking: one epoll_wait() reaps the stages whose pidfd is readable, wait4() only for those without one
+    event_wait(NULL, 0, 0);
+    int finished = events.jobs_finished;
+    events.jobs_finished = 0;
+
+    for (int slot = 0; slot < job_table_size; slot++) {
+        struct job *job = &job_table[slot];
+        int unwatched = 0;
+
+        if (job->id == 0 || job->done) {
+            continue;
+        }
+        for (int i = 0; i < job->count; i++) {
+            if (job->pids[i] > 0 && job->pidfds[i] < 0) {
+                job_reap_stage(job, i, WNOHANG);
+                unwatched = 1;
+            }
+        }
+        if (unwatched) {
+            finished += job_finish(job);
+        }
+    }
+    return finished;
+}
+
+static pid_t wait4_blocking(pid_t pid, int *status, struct rusage *usage) { // for a child without pidfd: SIGCHLD is blocked, nothing interrupts it
+    pid_t result;
+    do {
+        result = wait4(pid, status, 0, usage);
+    } while (result < 0 && errno == EINTR);
+    if (result > 0) {
+        trace_reap(result, *status);
+    }
+    return result;
+}
+
+static void arm_timer(int timer_fd, long delay_ms) {
+    struct itimerspec timer;
+
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = delay_ms / 1000;
+    timer.it_value.tv_nsec = delay_ms % 1000 * 1000000 + 1; // a zero it_value would disarm the timer
+    timerfd_settime(timer_fd, 0, &timer, NULL);
+}
+
+static void signal_stages(int count, const int pidfds[], pid_t pgid, int signal_number) {
+    if (job_pgid == 0) { // the whole group, so that grandchildren go too
+        kill(-pgid, signal_number);
+        return;
+    }
+    for (int i = 0; i < count; i++) { // a background subshell shares the group with its stages: one by one
+        if (pidfds[i] >= 0) {
+            pidfd_send_signal(pidfds[i], signal_number, NULL, 0);
+        }
+    }
+}
+
+static void wait_foreground(struct pipeline *pipeline, pid_t child_pids[], pid_t pgid, int *child_status, struct rusage *usage) { // one event loop: a pidfd per stage, the deadline, Ctrl-C and the background jobs
+    struct epoll_event ready[EVENT_BATCH];
+    struct rusage stage_usage;
+    int *pidfds = arena_alloc(&line_arena, sizeof(int) * pipeline->count);
+    int signal_number = active_limits.kill_grace_ms > 0 ? SIGTERM : SIGKILL;
+    int timer_fd = -1;
+    int timed_out = 0;
+    int remaining = 0;
+    int64_t wait_start = trace_begin();
+
+    shell_flush(); // e.g. command not found for one of the stages
+    if (terminal_control && pgid != 0) {
+        tcsetpgrp(STDIN_FILENO, pgid); // hand the terminal to the pipeline
+    }
+    *child_status = W_EXITCODE(1, 0); // same status as the historical _exit(1) of the child
+    memset(usage, 0, sizeof(*usage));
+    for (int i = 0; i < pipeline->count; i++) {
+        pidfds[i] = child_pids[i] > 0 ? pidfd_open(child_pids[i], 0) : -1; // readable once the stage has exited, wait4() still reaps it
+        if (pidfds[i] >= 0 && event_watch(pidfds[i], event_tag(EVENT_CHILD, 0, i)) < 0) {
+            close(pidfds[i]);
+            pidfds[i] = -1;
+        }
+        remaining += pidfds[i] >= 0;
+    }
+    if (active_limits.timeout_ms > 0 && pgid != 0 && (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) >= 0) {
+        event_watch(timer_fd, event_tag(EVENT_TIMER, 0, 0));
+        arm_timer(timer_fd, active_limits.timeout_ms);
+    }
+
+    while (remaining > 0) {
+        int count = event_wait(ready, EVENT_BATCH, -1);
+        for (int e = 0; e < count; e++) {
+            int i = event_index(ready[e].data.u64);
+            if (event_kind_of(ready[e].data.u64) == EVENT_CHILD && i < pipeline->count && pidfds[i] >= 0) {
+                int stage_status;
+                if (wait4(child_pids[i], &stage_status, WNOHANG, &stage_usage) > 0) {
+                    trace_reap(child_pids[i], stage_status);
+                    add_usage(usage, &stage_usage);
+                    if (i == pipeline->count - 1) {
+                        *child_status = stage_status; // the prompt reports the last stage
+                    }
+                }
+                close(pidfds[i]);
+                pidfds[i] = -1;
+                child_pids[i] = -1;
+                remaining--;
+            } else if (event_kind_of(ready[e].data.u64) == EVENT_TIMER && signal_number != 0) {
+                uint64_t expirations;
+                read(timer_fd, &expirations, sizeof(expirations));
+                timed_out = 1;
+                signal_stages(pipeline->count, pidfds, pgid, signal_number);
+                signal_number = signal_number == SIGTERM ? SIGKILL : 0; // SIGKILL once the grace period is over, then nothing more
+                if (signal_number != 0) {
+                    arm_timer(timer_fd, active_limits.kill_grace_ms);
+                }
+            }
+        }
+        if (event_take_interrupt() && remaining > 0) { // Ctrl-C sent to the shell, e.g. when it does not own the terminal: for the job only
+            signal_stages(pipeline->count, pidfds, pgid, SIGINT);
+        }
+    }
+    close_if_open(timer_fd);
+    for (int i = 0; i < pipeline->count; i++) { // stages without a pidfd
+        int stage_status;
+        if (child_pids[i] > 0 && wait4_blocking(child_pids[i], &stage_status, &stage_usage) > 0) {
+            add_usage(usage, &stage_usage);
+            if (i == pipeline->count - 1) {
+                *child_status = stage_status;
+            }
+        }
+    }
+
+    if (terminal_control && pgid != 0) {
+        tcsetpgrp(STDIN_FILENO, getpgrp()); // take the terminal back
+    }
+    if (timed_out) { // whatever signal ended it, a deadline reads as 124 like timeout(1) and the background path
+        *child_status = W_EXITCODE(LIMIT_TIMEOUT_EXIT_STATUS, 0);
+    }
+    limit_hit = timed_out ? LIMIT_TIMEOUT : limit_of_status(*child_status, usage, &active_limits);
+    trace_end(TRACE_WAIT, wait_start, pgid, *child_status, NULL);
+}
+
+static void report_job(const struct job *job, const char *state, long time_ms) {
+    size_t size = MESSAGE_BUFFER_SIZE + strlen(job->command_line);
+    char *message = arena_alloc(&line_arena, size);
+    int length;
+
+    if (job->done && job->limit != LIMIT_NONE) {
+        int value = WIFSIGNALED(job->status) ? WTERMSIG(job->status) : WEXITSTATUS(job->status);
+        length = snprintf(message, size, "[%d] %s [%s:%d|%ldms] %s\n", job->id, state, limit_names[job->limit], value, time_ms, job->command_line);
+    } else if (job->done && WIFSIGNALED(job->status)) {
+        length = snprintf(message, size, "[%d] %s [sign:%d|%ldms] %s\n", job->id, state, WTERMSIG(job->status), time_ms, job->command_line);
+    } else if (job->done) {
+        length = snprintf(message, size, "[%d] %s [exit:%d|%ldms] %s\n", job->id, state, WEXITSTATUS(job->status), time_ms, job->command_line);
+    } else {
+        length = snprintf(message, size, "[%d] %s [%ldms] %s\n", job->id, state, time_ms, job->command_line);
+    }
+    shell_write(STDOUT_FILENO, message, length);
+}
+
+static void report_finished_jobs(void) { // called before each prompt, frees the slots
+    for (int slot = 0; slot < job_table_size; slot++) {
+        struct job *job = &job_table[slot];
+        if (job->id != 0 && job->done) {
+            long wall_ns = elapsed_ns(&job->time_start, &job->time_end);
+            report_job(job, "done", wall_ns / 1000000);
+            log_command_stats(job->command_line, job->status, wall_ns, &job->usage, 1, job->limit, &job->cgroup_usage);
+            free(job->pids);
+            free(job->pidfds);
+            free(job->command_line);
+            job->id = 0;
+        }
+    }
+}
+
+static void list_jobs(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int slot = 0; slot < job_table_size; slot++) {
+        struct job *job = &job_table[slot];
+        if (job->id != 0 && !job->done) {
+            report_job(job, "running", elapsed_ns(&job->time_start, &now) / 1000000);
+        }
+    }
+}
+
+static void line_reader_init(struct line_reader *reader, int fd) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+}
+
+static int line_reader_open_script(struct line_reader *reader, const char *path) { // maps the file, falls back to buffered reads for pipes and devices
+    struct stat file_info;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+    line_reader_init(reader, fd);
+    if (fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode) && file_info.st_size > 0) {
+        void *map = mmap(NULL, file_info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); // private: newlines are replaced in place, the file is untouched
+        if (map != MAP_FAILED) {
+            madvise(map, file_info.st_size, MADV_SEQUENTIAL);
+            reader->map = map;
+            reader->map_size = file_info.st_size;
+        }
+    }
+    return 0;
+}
+
+static int line_reader_reserve(struct line_reader *reader, size_t needed) {
+    if (needed <= reader->capacity) {
+        return 0;
+    }
+    size_t capacity = reader->capacity != 0 ? reader->capacity : LINE_READER_CHUNK;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    char *buffer = realloc(reader->buffer, capacity);
+    if (buffer == NULL) {
+        write(STDERR_FILENO, OUTOFMEMORY_MSG, OUTOFMEMORY_MSG_LENGTH);
+        return -1;
+    }
+    reader->buffer = buffer;
+    reader->capacity = capacity;
+    return 0;
+}
+
+static enum line_status read_line_mapped(struct line_reader *reader, char **line) {
+    char *start = reader->map + reader->map_offset;
+    size_t remaining = reader->map_size - reader->map_offset;
+    char *newline;
+
+    if (remaining == 0) {
+        return LINE_EOF;
+    }
+    newline = memchr(start, '\n', remaining);
+    if (newline != NULL) {
+        *newline = '\0';
+        reader->map_offset += newline - start + 1;
+        *line = start;
+        return LINE_OK;
+    }
+    if (line_reader_reserve(reader, remaining + 1) < 0) { // last line without newline: no room for the terminator in the mapping
+        return LINE_EOF;
+    }
+    memcpy(reader->buffer, start, remaining);
+    reader->buffer[remaining] = '\0';
+    reader->map_offset = reader->map_size;
+    *line = reader->buffer;
+    return LINE_OK;
+}
+
+static enum line_status read_line(struct line_reader *reader, char **line) { // *line stays valid until the next call
+    if (reader->map != NULL) {
+        return read_line_mapped(reader, line);
+    }
+
+    while (1) {
+        char *start = reader->buffer + reader->start;
+        char *newline = reader->end > reader->start + reader->scanned
+                        ? memchr(start + reader->scanned, '\n', reader->end - reader->start - reader->scanned) : NULL;
+
+        if (newline != NULL) {
+            *newline = '\0';
+            reader->start += newline - start + 1;
+            reader->scanned = 0;
+            *line = start;
+            return LINE_OK;
+        }
+        reader->scanned = reader->end - reader->start;
+
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return LINE_EOF;
+            }
+            reader->buffer[reader->end] = '\0'; // last line without newline, room was kept by the reads below
+            reader->start = reader->end;
+            reader->scanned = 0;
+            *line = start;
+            return LINE_OK;
+        }
+
+        if (reader->start > 0) { // move the partial line to the front before reading more
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (line_reader_reserve(reader, reader->end + LINE_READER_CHUNK / 2) < 0) {
+            return LINE_EOF;
+        }
+
+        if (reader->waits_in_loop && !event_wait_input(reader->fd, 0)) {
+            return LINE_INTERRUPTED;
+        }
+        ssize_t read_size = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1); // keep one byte for a final terminator
+        if (read_size < 0 && errno == EINTR) {
+            return LINE_INTERRUPTED;
+        }
+        if (read_size <= 0) { // handle end-of-file or read error
+            reader->eof = 1;
+        } else {
+            reader->end += read_size;
+        }
+    }
+}
+
+static uint64_t history_align(uint64_t size) {
+    return (size + HISTORY_ALIGNMENT - 1) & ~(uint64_t)(HISTORY_ALIGNMENT - 1);
+}
+
+static struct history_record *history_record_at(const struct history *history, uint64_t offset) { // offset is logical, it grows forever
+    return (struct history_record *)(history->ring + offset % history->header->capacity);
+}
+
+static uint64_t history_skip_padding(const struct history *history, uint64_t offset) { // the end of the ring is skipped when a record did not fit there
+    uint64_t remaining = history->header->capacity - offset % history->header->capacity;
+    if (remaining < sizeof(struct history_record)) {
+        return offset + remaining; // too short even for a padding record
+    }
+    if (offset != history->header->tail && history_record_at(history, offset)->length == HISTORY_PADDING) {
+        return offset + remaining;
+    }
+    return offset;
+}
+
+static int history_open(struct history *history, int fd, uint64_t capacity) { // maps the ring, O(1): nothing is parsed until a search needs the index
+    struct stat file_stat;
+    uint64_t file_size = sizeof(struct history_header) + capacity;
+
+    memset(history, 0, sizeof(*history));
+    history->fd = -1;
+    if (fstat(fd, &file_stat) < 0 || (file_stat.st_size != 0 && (uint64_t)file_stat.st_size < sizeof(struct history_header))) {
+        return -1;
+    }
+    if (file_stat.st_size != 0) { // an existing ring keeps the size it was created with
+        file_size = file_stat.st_size;
+    } else if (ftruncate(fd, file_size) < 0) { // sparse until written
+        return -1;
+    }
+    void *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    history->header = map;
+    history->ring = (char *)map + sizeof(struct history_header);
+    if (file_stat.st_size == 0) {
+        memcpy(history->header->magic, HISTORY_MAGIC, sizeof(history->header->magic));
+        history->header->capacity = capacity;
+        history->header->next_sequence = 1;
+    } else if (memcmp(history->header->magic, HISTORY_MAGIC, sizeof(history->header->magic)) != 0
+               || history->header->capacity != file_size - sizeof(struct history_header) || history->header->capacity % HISTORY_ALIGNMENT != 0) {
+        munmap(map, file_size); // not a history ring: left untouched
+        return -1;
+    }
+    history->fd = fd;
+    history->map_size = file_size;
+    return 0;
+}
+
+static void history_close(struct history *history) {
+    if (history->fd < 0) {
+        return;
+    }
+    munmap(history->header, history->map_size);
+    close(history->fd);
+    free(history->index.offsets);
+    free(history->index.signatures);
+    free(history->index.sorted);
+    free(history->index.sorted_newest);
+    history->fd = -1;
+}
+
+static void history_append(struct history *history, const char *line, int status, long time_ms) { // O(1) amortized: evicts just enough of the oldest records
+    size_t length = strlen(line);
+    uint64_t size = history_align(sizeof(struct history_record) + length + 1);
+
+    if (history->fd < 0 || size > history->header->capacity / 2) {
+        return;
+    }
+    flock(history->fd, LOCK_EX); // shells sharing the file, e.g. daemon sessions, append one at a time
+    struct history_header *header = history->header;
+    uint64_t remaining = header->capacity - header->tail % header->capacity;
+    uint64_t needed = remaining < size ? remaining + size : size; // a record never wraps: the end of the ring is padded instead
+
+    while (header->head != header->tail && header->tail + needed - header->head > header->capacity) {
+        header->head = history_skip_padding(history, header->head);
+        if (header->head == header->tail) {
+            break;
+        }
+        header->head = history_skip_padding(history, header->head + history_record_at(history, header->head)->size);
+    }
+    if (remaining < size) {
+        if (remaining >= sizeof(struct history_record)) {
+            struct history_record *padding = history_record_at(history, header->tail);
+            padding->size = remaining;
+            padding->length = HISTORY_PADDING;
+        }
+        header->tail += remaining;
+    }
+    struct history_record *record = history_record_at(history, header->tail);
+    record->size = size;
+    record->status = status;
+    record->time_ms = time_ms < 0 ? 0 : (uint32_t)time_ms;
+    record->length = length;
+    record->sequence = header->next_sequence++;
+    memcpy(record->line, line, length + 1);
+    header->tail += size;
+    flock(history->fd, LOCK_UN);
+}
+
+static uint64_t history_signature(const char *text, size_t length) { // a line can only contain text if it has every pair of text
+    uint64_t signature = 0;
+    for (size_t i = 0; i + 1 < length; i++) {
+        signature |= 1ULL << (((unsigned char)text[i] * 31 + (unsigned char)text[i + 1]) & 63);
+    }
+    return signature;
+}
+
+static int history_index_grow(struct history_index *index) {
+    if (index->first > 0) { // slide out the evicted entries before growing
+        memmove(index->offsets, index->offsets + index->first, sizeof(index->offsets[0]) * index->count);
+        memmove(index->signatures, index->signatures + index->first, sizeof(index->signatures[0]) * index->count);
+        index->base += index->first;
+        index->first = 0;
+    }
+    if (index->count < index->size) {
+        return 0;
+    }
+    size_t size = index->size > 0 ? index->size * 2 : HISTORY_INDEX_INITIAL_SIZE;
+    uint64_t *offsets = realloc(index->offsets, sizeof(index->offsets[0]) * size);
+    if (offsets == NULL) {
+        return -1;
+    }
+    index->offsets = offsets;
+    uint64_t *signatures = realloc(index->signatures, sizeof(index->signatures[0]) * size);
+    if (signatures == NULL) {
+        return -1;
+    }
+    index->signatures = signatures;
+    index->size = size;
+    return 0;
+}
+
+static int history_index_push(struct history_index *index, uint64_t offset, const struct history_record *record) {
+    if (index->first + index->count == index->size && history_index_grow(index) < 0) {
+        return -1;
+    }
+    if (index->count == 0) {
+        index->base = record->sequence - index->first;
+    }
+    size_t position = index->first + index->count++;
+    index->offsets[position] = offset;
+    index->signatures[position] = history_signature(record->line, record->length);
+    return 0;
+}
+
+static void history_index_reset(struct history_index *index) {
+    index->first = 0;
+    index->count = 0;
+    index->sorted_count = 0;
+    index->sorted_oldest = 0;
+    index->sorted_until = 0;
+}
+
+static void history_sync(struct history *history) { // brings the index up to the tail: the whole ring the first time, then only what was appended
+    struct history_index *index = &history->index;
+    struct history_header *header = history->header;
+
+    if (!index->built || index->synced < header->head) { // first use, or more than a whole ring was written meanwhile
+        history_index_reset(index);
+        index->synced = header->head;
+        index->built = 1;
+    }
+    while (index->count > 0 && index->offsets[index->first] < header->head) { // evicted since the last sync
+        index->first++;
+        index->count--;
+    }
+    uint64_t offset = history_skip_padding(history, index->synced);
+    while (offset < header->tail) {
+        const struct history_record *record = history_record_at(history, offset);
+        if (history_index_push(index, offset, record) < 0) {
+            break;
+        }
+        offset = history_skip_padding(history, offset + record->size);
+    }
+    index->synced = offset;
+}
+
+static const struct history_record *history_entry(const struct history *history, long sequence) { // NULL when evicted or never written
+    const struct history_index *index = &history->index;
+    uint64_t first = index->base + index->first;
+
+    if (sequence < 0 || (uint64_t)sequence < first || (uint64_t)sequence >= first + index->count) {
+        return NULL;
+    }
+    return history_record_at(history, index->offsets[sequence - index->base]);
+}
+
+static long history_newest(const struct history *history) {
+    return history->index.count > 0 ? (long)(history->index.base + history->index.first + history->index.count - 1) : -1;
+}
+
+static int history_compare_lines(const void *left, const void *right, void *context) {
+    const struct history *history = context;
+    return strcmp(history_entry(history, *(const long *)left)->line, history_entry(history, *(const long *)right)->line);
+}
+
+static int history_sort(struct history *history) { // drops the evicted entries from the sorted index, merges the recent ones in once there are enough
+    struct history_index *index = &history->index;
+    long oldest = (long)(index->base + index->first);
+    long newest = history_newest(history);
+    int changed = 0;
+
+    if (index->count > 0 && oldest > index->sorted_oldest) { // no comparison needed: what remains stays in order
+        size_t kept = 0;
+        for (size_t i = 0; i < index->sorted_count; i++) {
+            if (index->sorted[i] >= oldest) {
+                index->sorted[kept++] = index->sorted[i];
+            }
+        }
+        index->sorted_count = kept;
+        index->sorted_oldest = oldest;
+        changed = 1;
+    }
+    long from = index->sorted_until > oldest ? index->sorted_until : oldest;
+    if (index->count > 0 && newest - from + 1 > HISTORY_UNSORTED_MAX) {
+        size_t added = newest - from + 1;
+        long *merged = malloc(sizeof(long) * (index->sorted_count + added));
+        long *recent = merged + index->sorted_count; // sorted in place, then merged from the front: the writes never pass the reads
+        size_t i = 0;
+        size_t j = 0;
+        size_t k = 0;
+        if (merged == NULL) {
+            return -1;
+        }
+        for (size_t n = 0; n < added; n++) {
+            recent[n] = from + n;
+        }
+        qsort_r(recent, added, sizeof(long), history_compare_lines, history);
+        while (i < index->sorted_count || j < added) {
+            if (j == added || (i < index->sorted_count && history_compare_lines(&index->sorted[i], &recent[j], history) <= 0)) {
+                merged[k++] = index->sorted[i++];
+            } else {
+                merged[k++] = recent[j++];
+            }
+        }
+        free(index->sorted);
+        index->sorted = merged;
+        index->sorted_count = k;
+        index->sorted_until = newest + 1;
+        changed = 1;
+    }
+    if (changed) {
+        long *blocks = realloc(index->sorted_newest, sizeof(long) * (index->sorted_count / HISTORY_SORTED_BLOCK + 1));
+        if (blocks == NULL) {
+            return -1;
+        }
+        index->sorted_newest = blocks;
+        for (size_t i = 0; i + HISTORY_SORTED_BLOCK <= index->sorted_count; i += HISTORY_SORTED_BLOCK) {
+            long block_newest = -1;
+            for (size_t n = i; n < i + HISTORY_SORTED_BLOCK; n++) {
+                block_newest = index->sorted[n] > block_newest ? index->sorted[n] : block_newest;
+            }
+            blocks[i / HISTORY_SORTED_BLOCK] = block_newest;
+        }
+    }
+    return 0;
+}
+
+static void history_prefix_range(const struct history *history, const char *prefix, size_t *low, size_t *high) { // the sorted entries starting with prefix are [*low, *high)
+    const struct history_index *index = &history->index;
+    size_t length = strlen(prefix);
+
+    for (int bound = 0; bound < 2; bound++) { // first entry not before the prefix, then first entry after it
+        size_t left = 0;
+        size_t right = index->sorted_count;
+        while (left < right) {
+            size_t middle = left + (right - left) / 2;
+            int order = strncmp(history_entry(history, index->sorted[middle])->line, prefix, length);
+            if (order < 0 || (bound == 1 && order == 0)) {
+                left = middle + 1;
+            } else {
+                right = middle;
+            }
+        }
+        *(bound == 0 ? low : high) = left;
+    }
+}
+
+static long history_find_prefix(struct history *history, const char *prefix) { // newest entry starting with prefix, -1 when none
+    const struct history_index *index = &history->index;
+    size_t length = strlen(prefix);
+    size_t low;
+    size_t high;
+    long newest = -1;
+
+    if (history_sort(history) < 0) {
+        return -1;
+    }
+    for (long current = history_newest(history); current >= index->sorted_until; current--) { // not sorted yet, and newer than every sorted entry
+        const struct history_record *record = history_entry(history, current);
+        if (record == NULL) {
+            break;
+        }
+        if (strncmp(record->line, prefix, length) == 0) {
+            return current;
+        }
+    }
+    history_prefix_range(history, prefix, &low, &high);
+    for (size_t i = low; i < high;) {
+        if (i % HISTORY_SORTED_BLOCK == 0 && i + HISTORY_SORTED_BLOCK <= high) { // a whole block: its newest entry is known
+            newest = index->sorted_newest[i / HISTORY_SORTED_BLOCK] > newest ? index->sorted_newest[i / HISTORY_SORTED_BLOCK] : newest;
+            i += HISTORY_SORTED_BLOCK;
+        } else {
+            newest = index->sorted[i] > newest ? index->sorted[i] : newest;
+            i++;
+        }
+    }
+    return newest;
+}
+
+static const struct history_record *history_find_substring(const struct history *history, const char *text, long *sequence) { // newest entry at or before *sequence containing text
+    const struct history_index *index = &history->index;
+    size_t length = strlen(text);
+    uint64_t signature = history_signature(text, length);
+
+    for (long current = *sequence; current >= 0; current--) {
+        const struct history_record *record = history_entry(history, current);
+        if (record == NULL) {
+            return NULL;
+        }
+        if ((index->signatures[current - index->base] & signature) == signature && memmem(record->line, record->length, text, length) != NULL) {
+            *sequence = current;
+            return record;
+        }
+    }
+    return NULL;
+}
+
+static int builtin_true(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+    return 0;
+}
+
+static int builtin_false(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+    return 1;
+}
+
+static int builtin_exit(int argc, char *argv[]) { // exit [n]: ends the shell after this command, with n, 0 by default as the shell always did
+    int status = 0;
+
+    if (argc > 1) {
+        char *end;
+        long value = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0') {
+            builtin_error("exit", "numeric argument required");
+            value = 2;
+        }
+        status = value & 0xff;
+    }
+    exit_requested = 1;
+    return status;
+}
+
+static int builtin_cd(int argc, char *argv[]) { // cd [dir | -], HOME by default
+    char previous[HASH_PATH_VAR_SIZE];
+    const char *target = argc > 1 ? argv[1] : getenv("HOME");
+
+    if (target != NULL && strncmp(target, "-", 2) == 0) {
+        target = getenv("OLDPWD");
+    }
+    if (target == NULL) {
+        builtin_error(argv[0], "no directory");
+        return 1;
+    }
+    if (getcwd(previous, sizeof(previous)) == NULL) {
+        previous[0] = '\0';
+    }
+    if (chdir(target) < 0) {
+        builtin_error(target, strerror(errno));
+        return 1;
+    }
+
+    char current[HASH_PATH_VAR_SIZE];
+    if (getcwd(current, sizeof(current)) != NULL) {
+        setenv("PWD", current, 1);
+    }
+    setenv("OLDPWD", previous, 1);
+    prompt_cwd_changed = 1;
+    return 0;
+}
+
+static int builtin_pwd(int argc, char *argv[]) {
+    char current[HASH_PATH_VAR_SIZE];
+    (void)argc;
+
+    if (getcwd(current, sizeof(current) - 1) == NULL) {
+        builtin_error(argv[0], strerror(errno));
+        return 1;
+    }
+    size_t length = strnlen(current, sizeof(current) - 1);
+    current[length] = '\n';
+    shell_write(STDOUT_FILENO, current, length + 1);
+    return 0;
+}
+
+static int builtin_echo(int argc, char *argv[]) { // echo [-n] words...
+    struct output_buffer output;
+    int newline = 1;
+    int first = 1;
+
+    output.fd = STDOUT_FILENO;
+    output.length = 0;
+    if (argc > 1 && strncmp(argv[1], "-n", 3) == 0) {
+        newline = 0;
+        first = 2;
+    }
+    for (int i = first; i < argc; i++) {
+        if (i > first) {
+            output_append(&output, " ", 1);
+        }
+        output_append(&output, argv[i], strlen(argv[i]));
+    }
+    if (newline) {
+        output_append(&output, "\n", 1);
+    }
+    output_flush(&output);
+    return 0;
+}
+
+static int accepts_echo(const struct command *cmd) { // -e, -E and their combinations are left to the external echo
+    const char *option = cmd->argc > 1 ? cmd->argv[1] : "";
+
+    if (option[0] != '-' || strncmp(option, "-n", 3) == 0) {
+        return 1;
+    }
+    return option[strspn(option + 1, "neE") + 1] != '\0'; // not an option list: echoed as a word
+}
+
+static const char *printf_escape(const char *format, struct output_buffer *output) { // \n \t \\ and friends, returns the last consumed character
+    static const char escapes[] = "n\nt\tr\rv\va\ab\bf\f\\\\";
+    for (int i = 0; escapes[i] != '\0'; i += 2) {
+        if (format[1] == escapes[i]) {
+            output_append(output, &escapes[i + 1], 1);
+            return format + 1;
+        }
+    }
+    output_append(output, format, 1);
+    return format;
+}
+
+static int builtin_printf(int argc, char *argv[]) { // printf format [args...], format reused while arguments remain
+    struct output_buffer output;
+    char number[32];
+    int next = 2;
+
+    if (argc < 2) {
+        builtin_error(argv[0], "usage: printf format [arguments]");
+        return 1;
+    }
+    output.fd = STDOUT_FILENO;
+    output.length = 0;
+    do {
+        int consumed = 0;
+        for (const char *format = argv[1]; *format != '\0'; format++) {
+            if (*format == '\\' && format[1] != '\0') {
+                format = printf_escape(format, &output);
+            } else if (*format == '%' && format[1] == '%') {
+                output_append(&output, "%", 1);
+                format++;
+            } else if (*format == '%' && (format[1] == 's' || format[1] == 'd' || format[1] == 'i' || format[1] == 'x' || format[1] == 'c')) {
+                const char *argument = next < argc ? argv[next] : "";
+                int length;
+                format++;
+                next += next < argc;
+                consumed = 1;
+                switch (*format) {
+                case 's': output_append(&output, argument, strlen(argument)); break;
+                case 'c': output_append(&output, argument, *argument != '\0'); break;
+                case 'x':
+                    length = snprintf(number, sizeof(number), "%lx", strtol(argument, NULL, 0));
+                    output_append(&output, number, length);
+                    break;
+                default:
+                    length = snprintf(number, sizeof(number), "%ld", strtol(argument, NULL, 0));
+                    output_append(&output, number, length);
+                    break;
+                }
+            } else {
+                output_append(&output, format, 1);
+            }
+        }
+        if (!consumed) {
+            break;
+        }
+    } while (next < argc);
+    output_flush(&output);
+    return 0;
+}
+
+static int accepts_printf(const struct command *cmd) { // flags, widths, precisions and other conversions or escapes go to the external printf
+    if (cmd->argc < 2) {
+        return 1;
+    }
+    const char *format = cmd->argv[1];
+    if (format[0] == '-' && format[1] != '\0') { // an option, or -- before the format
+        return 0;
+    }
+    for (; *format != '\0'; format++) {
+        if (*format == '\\' && format[1] != '\0') {
+            if (strchr("ntrvabf\\", format[1]) == NULL) {
+                return 0;
+            }
+            format++;
+        } else if (*format == '%') {
+            if (format[1] == '\0' || strchr("%sdixc", format[1]) == NULL) {
+                return 0;
+            }
+            format++;
+        }
+    }
+    return 1;
+}
+
+static int test_unary(const char *operator, const char *operand) { // returns 0 true, 1 false, 2 unknown operator
+    struct stat file_info;
+    int exists;
+
+    if (strlen(operator) != 2) { // -foo is not -f
+        return 2;
+    }
+    exists = stat(operand, &file_info) == 0;
+    switch (operator[1]) {
+    case 'n': return *operand == '\0';
+    case 'z': return *operand != '\0';
+    case 'e': return !exists;
+    case 'f': return !(exists && S_ISREG(file_info.st_mode));
+    case 'd': return !(exists && S_ISDIR(file_info.st_mode));
+    case 's': return !(exists && file_info.st_size > 0);
+    case 'r': return access(operand, R_OK) != 0;
+    case 'w': return access(operand, W_OK) != 0;
+    case 'x': return access(operand, X_OK) != 0;
+    default: return 2;
+    }
+}
+
+static int test_integer(const char *text, long *value) { // the whole word must be a decimal integer, leading blanks allowed as in sh
+    char *end;
+
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE) {
+        builtin_error(text, "integer expression expected");
+        return -1;
+    }
+    return 0;
+}
+
+static int test_binary(const char *left, const char *operator, const char *right) { // returns 0 true, 1 false, 2 unknown operator, -1 when an operand is not an integer (already reported)
+    static const char *integer_operators[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+    long a;
+    long b;
+
+    if (strncmp(operator, "=", 2) == 0 || strncmp(operator, "==", 3) == 0) {
+        return strcmp(left, right) != 0;
+    }
+    if (strncmp(operator, "!=", 3) == 0) {
+        return strcmp(left, right) == 0;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (strncmp(operator, integer_operators[i], 4) == 0) {
+            if (test_integer(left, &a) < 0 || test_integer(right, &b) < 0) {
+                return -1;
+            }
+            int results[] = { a == b, a != b, a < b, a <= b, a > b, a >= b };
+            return !results[i];
+        }
+    }
+    return 2;
+}
+
+static int builtin_test(int argc, char *argv[]) { // test expression / [ expression ], POSIX forms with up to four arguments
+    int negate = 0;
+    int result;
+
+    if (strncmp(argv[0], "[", 2) == 0) {
+        if (strncmp(argv[argc - 1], "]", 2) != 0) {
+            builtin_error(argv[0], "missing ]");
+            return 2;
+        }
+        argc--;
+    }
+    argv++;
+    argc--;
+    if (argc > 1 && strncmp(argv[0], "!", 2) == 0) {
+        negate = 1;
+        argv++;
+        argc--;
+    }
+
+    if (argc == 0) {
+        result = 1;
+    } else if (argc == 1) {
+        result = *argv[0] == '\0';
+    } else if (argc == 2 && argv[0][0] == '-') {
+        result = test_unary(argv[0], argv[1]);
+    } else if (argc == 3) {
+        result = test_binary(argv[0], argv[1], argv[2]);
+    } else {
+        result = 2;
+    }
+    if (result == 2) {
+        builtin_error("test", "unsupported expression");
+        return 2;
+    }
+    if (result < 0) {
+        return 2;
+    }
+    return negate ? !result : result;
+}
+
+static int builtin_export(int argc, char *argv[]) { // export NAME=value..., without arguments lists the environment
+    int status = 0;
+
+    if (argc == 1) {
+        struct output_buffer output;
+        output.fd = STDOUT_FILENO;
+        output.length = 0;
+        for (char **variable = environ; *variable != NULL; variable++) {
+            output_append(&output, "export ", 7);
+            output_append(&output, *variable, strlen(*variable));
+            output_append(&output, "\n", 1);
+        }
+        output_flush(&output);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        char *equal = strchr(argv[i], '=');
+        if (equal == NULL) { // the shell has no unexported variables
+            continue;
+        }
+        *equal = '\0';
+        if (equal == argv[i] || setenv(argv[i], equal + 1, 1) < 0) {
+            builtin_error(argv[0], "invalid variable name");
+            status = 1;
+        }
+        *equal = '=';
+    }
+    return status;
+}
+
+static int builtin_jobs(int argc, char *argv[]) { // list the background jobs still running
+    (void)argc;
+    (void)argv;
+    list_jobs();
+    return 0;
+}
+
+static int builtin_hash(int argc, char *argv[]) { // show remembered locations and hit/miss counters, -r forgets them
+    if (argc > 1 && strncmp(argv[1], "-r", 3) == 0) {
+        hash_reset();
+        return 0;
+    }
+    hash_print();
+    return 0;
+}
+
+static int builtin_arena(int argc, char *argv[]) { // memory profile of the per-line allocator
+    (void)argc;
+    (void)argv;
+    arena_print(&line_arena, "arena");
+    return 0;
+}
+
+static long parse_duration_ms(const char *text) { // 1.5, 1.5s, 300ms or 2m: seconds by default as in timeout(1), -1 when invalid
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || value < 0) {
+        return -1;
+    }
+    if (strncmp(end, "ms", 3) == 0) {
+        return (long)value;
+    }
+    if (*end == '\0' || strncmp(end, "s", 2) == 0) {
+        return (long)(value * 1000);
+    }
+    if (strncmp(end, "m", 2) == 0) {
+        return (long)(value * 60000);
+    }
+    return -1;
+}
+
+static long parse_size(const char *text) { // bytes, or with a K, M or G suffix; -1 when invalid
+    char *end;
+    double value = strtod(text, &end);
+    const char *units = "KMG";
+    const char *unit;
+
+    if (end == text || value < 0) {
+        return -1;
+    }
+    if (*end == '\0') {
+        return (long)value;
+    }
+    if (end[1] != '\0' || (unit = strchr(units, end[0] & ~0x20)) == NULL) { // k and K alike
+        return -1;
+    }
+    return (long)(value * (1L << (10 * (unit - units + 1))));
+}
+
+static int set_limit_option(struct command_limits *limits, const char *option, const char *value) { // -t, -c, -m or -k followed by its value, 0 disables; -1 when invalid
+    long parsed;
+
+    if (value == NULL || option[0] != '-' || option[1] == '\0' || option[2] != '\0') {
+        return -1;
+    }
+    parsed = option[1] == 'm' ? parse_size(value) : parse_duration_ms(value);
+    if (parsed < 0) {
+        return -1;
+    }
+    switch (option[1]) {
+    case 't': limits->timeout_ms = parsed; break;
+    case 'k': limits->kill_grace_ms = parsed; break;
+    case 'c': limits->cpu_seconds = (parsed + 999) / 1000; break; // RLIMIT_CPU counts whole seconds
+    case 'm': limits->memory_bytes = parsed; break;
+    default: return -1;
+    }
+    return 0;
+}
+
+static void history_print(struct output_buffer *output, long sequence, const struct history_record *record) {
+    char prefix[MESSAGE_BUFFER_SIZE];
+    int length = snprintf(prefix, MESSAGE_BUFFER_SIZE, "%6ld  [%s:%d|%ums]  ", sequence, WIFSIGNALED(record->status) ? "sign" : "exit",
+                          WIFSIGNALED(record->status) ? WTERMSIG(record->status) : WEXITSTATUS(record->status), record->time_ms);
+    output_append(output, prefix, length);
+    output_append(output, record->line, record->length);
+    output_append(output, "\n", 1);
+}
+
+static int history_compare_newest(const void *left, const void *right) { // entry numbers, newest first
+    long a = *(const long *)left;
+    long b = *(const long *)right;
+    return (a < b) - (a > b);
+}
+
+static void history_print_prefix(struct output_buffer *output, const char *prefix) { // the unsorted recent matches, then the sorted range by entry number
+    const struct history_index *index = &history.index;
+    size_t length = strlen(prefix);
+    size_t low;
+    size_t high;
+
+    if (history_sort(&history) < 0) {
+        return;
+    }
+    for (long current = history_newest(&history); current >= index->sorted_until; current--) {
+        const struct history_record *record = history_entry(&history, current);
+        if (record == NULL) {
+            break;
+        }
+        if (strncmp(record->line, prefix, length) == 0) {
+            history_print(output, current, record);
+        }
+    }
+    history_prefix_range(&history, prefix, &low, &high);
+    long *matches = arena_alloc(&line_arena, sizeof(long) * (high - low + 1));
+    for (size_t i = low; i < high; i++) {
+        matches[i - low] = index->sorted[i];
+    }
+    qsort(matches, high - low, sizeof(long), history_compare_newest);
+    for (size_t i = 0; i < high - low; i++) {
+        history_print(output, matches[i], history_entry(&history, matches[i]));
+    }
+}
+
+static int builtin_history(int argc, char *argv[]) { // history [count | -p prefix | -s text | -c]: matches are listed newest first
+    struct output_buffer output;
+    const struct history_record *record;
+    long count = HISTORY_DEFAULT_SHOW;
+
+    if (history.fd < 0) {
+        builtin_error("history", "no history file");
+        return 1;
+    }
+    if (argc == 2 && strncmp(argv[1], "-c", 3) == 0) { // the ring is emptied, not rewritten
+        flock(history.fd, LOCK_EX);
+        history.header->head = history.header->tail;
+        flock(history.fd, LOCK_UN);
+        return 0;
+    }
+    int search = argc == 3 && (strncmp(argv[1], "-p", 3) == 0 || strncmp(argv[1], "-s", 3) == 0);
+    if ((argc == 3 && !search) || argc > 3 || (argc == 2 && (count = atol(argv[1])) <= 0)) {
+        write(STDERR_FILENO, HISTORY_USAGE_MSG, HISTORY_USAGE_MSG_LENGTH);
+        return 2;
+    }
+    history_sync(&history);
+    output.fd = STDOUT_FILENO;
+    output.length = 0;
+    long newest = history_newest(&history);
+    if (search && argv[1][1] == 'p') {
+        history_print_prefix(&output, argv[2]);
+    } else if (search) {
+        long sequence = newest;
+        while ((record = history_find_substring(&history, argv[2], &sequence)) != NULL) {
+            history_print(&output, sequence, record);
+            sequence--;
+        }
+    } else {
+        for (long sequence = newest - count + 1; sequence <= newest; sequence++) {
+            if ((record = history_entry(&history, sequence)) != NULL) {
+                history_print(&output, sequence, record);
+            }
+        }
+    }
+    output_flush(&output);
+    return 0;
+}
+
+static void trace_json_string(struct output_buffer *output, const char *text) { // quoted, with the characters JSON does not allow escaped
+    output_append(output, "\"", 1);
+    for (; *text != '\0'; text++) {
+        char escaped[8];
+        if (*text == '"' || *text == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = *text;
+            output_append(output, escaped, 2);
+        } else if ((unsigned char)*text < 0x20) {
+            output_append(output, escaped, snprintf(escaped, sizeof(escaped), "\\u%04x", *text));
+        } else {
+            output_append(output, text, 1);
+        }
+    }
+    output_append(output, "\"", 1);
+}
+
+static int trace_copy(uint64_t position, struct trace_event *event) { // 0 when the slot holds this position, complete and not overwritten meanwhile
+    const struct trace_event *slot = &trace.events[position & (TRACE_RING_SIZE - 1)];
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+        return -1;
+    }
+    *event = *slot;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == position + 1 ? 0 : -1;
+}
+
+static void trace_write_json(int fd) { // Chrome trace format: the shell's phases on its own track, one track per child
+    static const char *const names[] = { "read", "parse", "expand", "spawn", "builtin", "wait", "line", "run", "exit", "reap" };
+    struct output_buffer output;
+    struct trace_event event;
+    char text[MESSAGE_BUFFER_SIZE];
+    int shell_pid = getpid();
+    uint64_t head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+    int length;
+
+    output.fd = fd;
+    output.length = 0;
+    length = snprintf(text, sizeof(text), "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                      "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"enseash\"}}", shell_pid, shell_pid);
+    output_append(&output, text, length);
+    for (uint64_t position = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; position < head; position++) {
+        if (trace_copy(position, &event) < 0) {
+            continue;
+        }
+        double ts = (event.start_ns - trace.origin_ns) / 1e3;
+        int tid = event.phase >= TRACE_RUN ? event.pid : shell_pid;
+        if (event.phase == TRACE_SPAWN && event.pid > 0) { // names the child's track
+            length = snprintf(text, sizeof(text), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", shell_pid, event.pid);
+            output_append(&output, text, length);
+            trace_json_string(&output, event.name);
+            output_append(&output, "}}", 2);
+        }
+        if (event.phase == TRACE_EXIT || event.phase == TRACE_REAP) {
+            length = snprintf(text, sizeof(text), ",\n{\"name\":\"%s\",\"cat\":\"child\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"status\":%d}}",
+                              names[event.phase], ts, shell_pid, tid, event.value);
+            output_append(&output, text, length);
+            continue;
+        }
+        length = snprintf(text, sizeof(text), ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"value\":%d,\"child\":%d,\"text\":",
+                          names[event.phase], event.phase == TRACE_RUN ? "child" : "shell", ts, (event.end_ns - event.start_ns) / 1e3, shell_pid, tid, event.value, event.pid);
+        output_append(&output, text, length);
+        trace_json_string(&output, event.name);
+        output_append(&output, "}}", 2);
+    }
+    output_append(&output, "\n]}\n", 4);
+    output_flush(&output);
+}
+
+static void trace_write_binary(int fd) { // header, then the events oldest first: the ring as it is in memory, without the slots being written
+    struct output_buffer output;
+    struct trace_event event;
+    struct trace_header header;
+    uint64_t head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.event_size = sizeof(struct trace_event);
+    header.origin_ns = trace.origin_ns;
+    header.shell_pid = getpid();
+    for (uint64_t position = first; position < head; position++) {
+        header.count += trace_copy(position, &event) == 0;
+    }
+    output.fd = fd;
+    output.length = 0;
+    output_append(&output, (const char *)&header, sizeof(header));
+    for (uint64_t position = first; position < head && header.count > 0; position++) { // count is a bound: a slot completed meanwhile is not added
+        if (trace_copy(position, &event) == 0) {
+            output_append(&output, (const char *)&event, sizeof(event));
+            header.count--;
+        }
+    }
+    while (header.count-- > 0) { // a slot claimed but not completed meanwhile: an empty record keeps the count right
+        memset(&event, 0, sizeof(event));
+        output_append(&output, (const char *)&event, sizeof(event));
+    }
+    output_flush(&output);
+}
+
+static int trace_dump(const char *path, int binary) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (trace.events != NULL && binary) {
+        trace_write_binary(fd);
+    } else if (trace.events != NULL) {
+        trace_write_json(fd);
+    }
+    close(fd);
+    return 0;
+}
+
+static int trace_start(void) { // the ring is allocated once, zeroed pages only cost when an event lands on them
+    if (trace.events == NULL) {
+        trace.events = mmap(NULL, sizeof(struct trace_event) * TRACE_RING_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (trace.events == MAP_FAILED) {
+            trace.events = NULL;
+            return -1;
+        }
+        trace.origin_ns = trace_now();
+    }
+    trace.enabled = 1;
+    return 0;
+}
+
+static int builtin_trace(int argc, char *argv[]) { // trace [on | off | clear | json file | binary file]
+    char message[MESSAGE_BUFFER_SIZE];
+
+    if (argc == 1) {
+        uint64_t head = trace.head;
+        int length = snprintf(message, MESSAGE_BUFFER_SIZE, "trace %s: %llu events, %llu overwritten\n", trace.enabled ? "on" : "off",
+                              (unsigned long long)(head > TRACE_RING_SIZE ? TRACE_RING_SIZE : head),
+                              (unsigned long long)(head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0));
+        shell_write(STDOUT_FILENO, message, length); // after anything the shell still has queued
+        return 0;
+    }
+    if (argc == 2 && strncmp(argv[1], "on", 3) == 0) {
+        if (trace_start() < 0) {
+            builtin_error("trace", strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 2 && strncmp(argv[1], "off", 4) == 0) { // the events stay for a later dump
+        trace.enabled = 0;
+        return 0;
+    }
+    if (argc == 2 && strncmp(argv[1], "clear", 6) == 0) {
+        trace.head = 0;
+        trace.origin_ns = trace_now();
+        if (trace.events != NULL) {
+            memset(trace.events, 0, sizeof(struct trace_event) * TRACE_RING_SIZE);
+        }
+        return 0;
+    }
+    if (argc == 3 && (strncmp(argv[1], "json", 5) == 0 || strncmp(argv[1], "binary", 7) == 0)) {
+        if (trace_dump(argv[2], argv[1][0] == 'b') < 0) {
+            builtin_error("trace", strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    write(STDERR_FILENO, TRACE_USAGE_MSG, TRACE_USAGE_MSG_LENGTH);
+    return 2;
+}
+
+static int cgroup_enable_controllers(void) { // the leaves only get cpu.max, memory.max and io.max once the parent delegates the controller
+    for (int i = 0; i < CGROUP_SETTING_COUNT; i++) {
+        char request[BUILTIN_NAME_SIZE];
+        snprintf(request, BUILTIN_NAME_SIZE, "+%s", cgroup_controllers[i]);
+        if (cgroup_settings[i] != NULL && write_file_at(cgroup_parent_fd, "cgroup.subtree_control", request) < 0) { // EBUSY when the parent has processes of its own
+            builtin_error(cgroup_controllers[i], strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int cgroup_open(const char *path) { // every later command gets a leaf under path
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *copy = strdup(path);
+
+    if (fd < 0 || copy == NULL) {
+        builtin_error("cgroup", strerror(fd < 0 ? errno : ENOMEM));
+        close_if_open(fd);
+        free(copy);
+        return -1;
+    }
+    close_if_open(cgroup_parent_fd); // the leaves of running jobs keep their own descriptor of it
+    free(cgroup_parent_path);
+    cgroup_parent_fd = fd;
+    cgroup_parent_path = copy;
+    return cgroup_enable_controllers();
+}
+
+static int builtin_cgroup(int argc, char *argv[]) { // cgroup [dir | off | cpu.max value | memory.max value | io.max value], - as value restores the default
+    if (argc == 1) {
+        char message[MESSAGE_BUFFER_SIZE];
+        struct output_buffer output;
+        int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%s  %ld leaves created\n", cgroup_parent_fd >= 0 ? cgroup_parent_path : "off", cgroup_leaf_count);
+        output.fd = STDOUT_FILENO;
+        output.length = 0;
+        output_append(&output, message, length < MESSAGE_BUFFER_SIZE ? length : MESSAGE_BUFFER_SIZE - 1);
+        for (int i = 0; i < CGROUP_SETTING_COUNT; i++) {
+            if (cgroup_settings[i] != NULL) {
+                length = snprintf(message, MESSAGE_BUFFER_SIZE, "%s %s\n", cgroup_setting_files[i], cgroup_settings[i]);
+                output_append(&output, message, length < MESSAGE_BUFFER_SIZE ? length : MESSAGE_BUFFER_SIZE - 1);
+            }
+        }
+        output_flush(&output);
+        return 0;
+    }
+    if (argc == 2 && strncmp(argv[1], "off", 4) == 0) {
+        close_if_open(cgroup_parent_fd);
+        cgroup_parent_fd = -1;
+        return 0;
+    }
+    if (argc == 2) {
+        return cgroup_open(argv[1]) < 0;
+    }
+    for (int i = 0; argc == 3 && i < CGROUP_SETTING_COUNT; i++) {
+        if (strncmp(argv[1], cgroup_setting_files[i], CGROUP_NAME_SIZE) == 0) {
+            free(cgroup_settings[i]);
+            cgroup_settings[i] = strncmp(argv[2], "-", 2) == 0 ? NULL : strdup(argv[2]);
+            return cgroup_parent_fd >= 0 && cgroup_enable_controllers() < 0;
+        }
+    }
+    write(STDERR_FILENO, CGROUP_USAGE_MSG, CGROUP_USAGE_MSG_LENGTH);
+    return 2;
+}
+
+static int builtin_limits(int argc, char *argv[]) { // limits [-t time] [-c cpu_seconds] [-m size] [-k grace]: defaults for every later command, shown without arguments
+    struct command_limits limits = default_limits;
+
+    if (argc == 1) {
+        char message[MESSAGE_BUFFER_SIZE];
+        int length = snprintf(message, MESSAGE_BUFFER_SIZE, "timeout %ldms  cpu %lds  memory %ld bytes  kill grace %ldms\n",
+                              default_limits.timeout_ms, default_limits.cpu_seconds, default_limits.memory_bytes, default_limits.kill_grace_ms);
+        shell_write(STDOUT_FILENO, message, length); // after anything the shell still has queued
+        return 0;
+    }
+    for (int i = 1; i < argc; i += 2) {
+        if (set_limit_option(&limits, argv[i], argv[i + 1]) < 0) { // argv[argc] is NULL
+            write(STDERR_FILENO, LIMITS_USAGE_MSG, LIMITS_USAGE_MSG_LENGTH);
+            return 2;
+        }
+    }
+    default_limits = limits;
+    active_limits = limits;
+    return 0;
+}
+
+struct coprocess { // long-lived worker answering one line per request line
+    char *name;
+    char *command_line;
+    pid_t pid;
+    int fd;                   // our end of the socketpair, the worker has the other one as stdin and stdout
+    struct line_reader reader;
+    long requests;
+    long total_ns;
+    struct coprocess *next;
+};
+
+static struct coprocess *coprocesses;
+
+static struct coprocess *find_coprocess(const char *name) {
+    for (struct coprocess *coprocess = coprocesses; coprocess != NULL; coprocess = coprocess->next) {
+        if (strcmp(coprocess->name, name) == 0) {
+            return coprocess;
+        }
+    }
+    return NULL;
+}
+
+static char *join_words(int count, char *words[], const char *suffix) { // words separated by spaces, in the line arena
+    size_t size = strlen(suffix) + 1;
+    for (int i = 0; i < count; i++) {
+        size += strlen(words[i]) + 1;
+    }
+    char *text = arena_alloc(&line_arena, size);
+    char *out = text;
+    for (int i = 0; i < count; i++) {
+        size_t length = strlen(words[i]);
+        memcpy(out, words[i], length);
+        out += length;
+        if (i + 1 < count) {
+            *out++ = ' ';
+        }
+    }
+    memcpy(out, suffix, strlen(suffix) + 1);
+    return text;
+}
+
+static int coprocess_start(const char *name, int argc, char *argv[]) {
+    struct timeval timeout = { COPROC_TIMEOUT_MS / 1000, (COPROC_TIMEOUT_MS % 1000) * 1000 };
+    int sockets[2];
+
+    if (find_coprocess(name) != NULL) {
+        builtin_error(name, "coprocess already running");
+        return 1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) {
+        write(STDERR_FILENO, PIPE_MSG, PIPE_MSG_LENGTH);
+        return 1;
+    }
+
+    struct fd_action actions[] = { { sockets[1], STDIN_FILENO }, { sockets[1], STDOUT_FILENO } };
+    struct fd_plan plan = { .actions = actions, .count = 2, .opened = NULL, .opened_count = 0 };
+    char **worker_argv = arena_alloc(&line_arena, sizeof(char *) * (argc + 1));
+    memcpy(worker_argv, argv, sizeof(char *) * argc);
+    worker_argv[argc] = NULL;
+    struct command cmd = { .argv = worker_argv, .argc = argc, .redirections = NULL, .next = NULL };
+    pid_t pid = limits_active() ? spawn_fork(&cmd, &plan, 0) : spawn_posix(&cmd, &plan, 0); // own process group: ^C at the prompt does not reach the workers
+    close(sockets[1]);
+    if (pid < 0) {
+        close(sockets[0]);
+        return 127;
+    }
+    setsockopt(sockets[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)); // a worker that does not answer is stopped instead of hanging the shell
+
+    struct coprocess *coprocess = calloc(1, sizeof(*coprocess));
+    if (coprocess == NULL) {
+        write(STDERR_FILENO, OUTOFMEMORY_MSG, OUTOFMEMORY_MSG_LENGTH);
+        close(sockets[0]);
+        return 1;
+    }
+    coprocess->name = strdup(name);
+    coprocess->command_line = strdup(join_words(argc, argv, ""));
+    coprocess->pid = pid;
+    coprocess->fd = sockets[0];
+    line_reader_init(&coprocess->reader, sockets[0]);
+    coprocess->next = coprocesses;
+    coprocesses = coprocess;
+    return 0;
+}
+
+static int coprocess_stop(struct coprocess *coprocess, int kill_worker) { // returns the exit status of the worker
+    struct rusage usage;
+    int status = W_EXITCODE(1, 0);
+
+    close(coprocess->fd); // EOF on its stdin
+    if (kill_worker) { // it stopped answering, it may not notice EOF either
+        kill(coprocess->pid, SIGKILL);
+    }
+    if (wait4_blocking(coprocess->pid, &status, &usage) < 0) {
+        status = W_EXITCODE(1, 0);
+    }
+    for (struct coprocess **link = &coprocesses; *link != NULL; link = &(*link)->next) {
+        if (*link == coprocess) {
+            *link = coprocess->next;
+            break;
+        }
+    }
+    free(coprocess->reader.buffer);
+    free(coprocess->name);
+    free(coprocess->command_line);
+    free(coprocess);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static int coprocess_request(struct coprocess *coprocess, int argc, char *argv[]) { // one line out, one line back
+    struct timespec time_start;
+    struct timespec time_end;
+    enum line_status status;
+    char *response;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    char *request = join_words(argc, argv, "\n");
+    size_t length = strlen(request);
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t written = send(coprocess->fd, request + sent, length - sent, MSG_NOSIGNAL); // a dead worker must not kill the shell with SIGPIPE
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            builtin_error(coprocess->name, "coprocess is gone");
+            coprocess_stop(coprocess, 1);
+            return 1;
+        }
+        sent += written;
+    }
+
+    do {
+        status = read_line(&coprocess->reader, &response);
+    } while (status == LINE_INTERRUPTED);
+    if (status == LINE_EOF || coprocess->reader.eof) { // exited, or no answer within COPROC_TIMEOUT_MS
+        builtin_error(coprocess->name, "no response, coprocess stopped");
+        coprocess_stop(coprocess, 1);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    coprocess->requests++;
+    coprocess->total_ns += elapsed_ns(&time_start, &time_end);
+
+    length = strlen(response);
+    response[length] = '\n'; // the reader's terminator replaced the newline, put it back for a single write
+    write(STDOUT_FILENO, response, length + 1);
+    response[length] = '\0';
+    return 0;
+}
+
+static void list_coprocesses(void) {
+    struct output_buffer output;
+
+    output.fd = STDOUT_FILENO;
+    output.length = 0;
+    for (struct coprocess *coprocess = coprocesses; coprocess != NULL; coprocess = coprocess->next) {
+        char message[MESSAGE_BUFFER_SIZE];
+        int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%s  pid %d  %ld requests  %.1fus/request  %s\n", coprocess->name, (int)coprocess->pid,
+                              coprocess->requests, coprocess->requests > 0 ? coprocess->total_ns / 1e3 / coprocess->requests : 0.0, coprocess->command_line);
+        if (length >= MESSAGE_BUFFER_SIZE) {
+            length = MESSAGE_BUFFER_SIZE - 1;
+        }
+        output_append(&output, message, length);
+    }
+    output_flush(&output);
+}
+
+static int builtin_coproc(int argc, char *argv[]) { // coproc [start name command... | stop name | name request...]
+    struct coprocess *coprocess;
+
+    if (argc == 1) {
+        list_coprocesses();
+        return 0;
+    }
+    if (strncmp(argv[1], "start", 6) == 0 && argc >= 4) {
+        return coprocess_start(argv[2], argc - 3, argv + 3);
+    }
+    if (strncmp(argv[1], "stop", 5) == 0 && argc == 3) {
+        if ((coprocess = find_coprocess(argv[2])) == NULL) {
+            builtin_error(argv[2], "no such coprocess");
+            return 1;
+        }
+        return coprocess_stop(coprocess, 0);
+    }
+    if ((coprocess = find_coprocess(argv[1])) != NULL) {
+        return coprocess_request(coprocess, argc - 2, argv + 2);
+    }
+    write(STDERR_FILENO, COPROC_USAGE_MSG, COPROC_USAGE_MSG_LENGTH);
+    return 2;
+}
+
+static int builtin_cat(int argc, char *argv[]) { // plain cat: in-kernel copies to the redirected stdout
+    return cat_files(argc, argv);
+}
+
+static void make_directories(char *path) { // mkdir -p, errors are left to the open() that follows
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+    mkdir(path, 0700);
+}
+
+static int memo_is_entry(const char *name) { // 16 hex digits: temporary files and anything else in the directory are skipped
+    size_t length = strnlen(name, MEMO_NAME_SIZE);
+    if (length != MEMO_NAME_SIZE - 1) {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int memo_file_compare(const void *left, const void *right) { // oldest first
+    const struct memo_file *a = left;
+    const struct memo_file *b = right;
+    if (a->mtime.tv_sec != b->mtime.tv_sec) {
+        return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+    }
+    return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : a->mtime.tv_nsec > b->mtime.tv_nsec;
+}
+
+static long memo_scan(long target) { // total size of the entries, the least recently used ones are removed until it is at most target
+    int fd = openat(memo.dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); // a dup() would share the offset left at the end by the previous scan
+    DIR *stream = fd >= 0 ? fdopendir(fd) : NULL;
+    struct memo_file *files = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    long total = 0;
+    struct dirent *entry;
+    struct stat info;
+
+    if (stream == NULL) {
+        close_if_open(fd);
+        return 0;
+    }
+    while ((entry = readdir(stream)) != NULL) {
+        if (!memo_is_entry(entry->d_name) || fstatat(memo.dir_fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : MEMO_INITIAL_FILES;
+            struct memo_file *grown = realloc(files, sizeof(struct memo_file) * capacity);
+            if (grown == NULL) {
+                break;
+            }
+            files = grown;
+        }
+        memcpy(files[count].name, entry->d_name, MEMO_NAME_SIZE);
+        files[count].mtime = info.st_mtim;
+        files[count].size = info.st_size;
+        total += info.st_size;
+        count++;
+    }
+    closedir(stream);
+    if (total > target) {
+        qsort(files, count, sizeof(struct memo_file), memo_file_compare);
+        for (size_t i = 0; i < count && total > target; i++) {
+            if (unlinkat(memo.dir_fd, files[i].name, 0) == 0) {
+                total -= files[i].size;
+                memo.evictions++;
+            }
+        }
+    }
+    free(files);
+    return total;
+}
+
+static int memo_open_store(void) { // the cache directory, created on first use; -1 when it cannot be used
+    const char *path = getenv(MEMO_DIR_ENV);
+    const char *size = getenv(MEMO_SIZE_ENV);
+    const char *home = getenv("HOME");
+    char directory[HASH_PATH_SIZE];
+
+    if (memo.dir_fd != -1) {
+        return memo.dir_fd >= 0 ? memo.dir_fd : -1;
+    }
+    memo.dir_fd = -2;
+    memo.limit = size != NULL && atol(size) > 0 ? atol(size) * 1024 * 1024 : MEMO_DEFAULT_SIZE;
+    if (path == NULL && home != NULL) {
+        snprintf(directory, HASH_PATH_SIZE, "%s/%s", home, MEMO_DIR_DEFAULT);
+    } else if (path != NULL) {
+        strncpy(directory, path, HASH_PATH_SIZE - 1);
+        directory[HASH_PATH_SIZE - 1] = '\0';
+    } else {
+        directory[0] = '\0';
+    }
+    if (directory[0] == '\0') {
+        builtin_error("memo", "no cache directory");
+        return -1;
+    }
+    make_directories(directory);
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        builtin_error("memo", strerror(errno));
+        return -1;
+    }
+    memo.dir_fd = fd;
+    memo.bytes = memo_scan(memo.limit); // also trims a cache left over by a shell with a larger bound
+    return fd;
+}
+
+static uint64_t memo_hash(const char *data, size_t length) { // FNV-1a on 64 bits: names the entry file, the key itself is compared on a hit
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static int memo_key_file(const char *path, int *storable) { // identity of a file the result depends on: -1 unless it is a regular file
+    struct stat info;
+    struct timespec now;
+
+    if (stat(path, &info) < 0 || !S_ISREG(info.st_mode)) {
+        return -1;
+    }
+    long long fields[5] = { (long long)info.st_dev, (long long)info.st_ino, (long long)info.st_size, (long long)info.st_mtim.tv_sec, info.st_mtim.tv_nsec };
+    word_append(&memo.key, (const char *)fields, sizeof(fields));
+    clock_gettime(CLOCK_REALTIME, &now);
+    long racy_ns = info.st_mtim.tv_nsec == 0 ? DIR_CACHE_COARSE_RACY_NS : DIR_CACHE_RACY_NS; // same window as the directory cache
+    if ((now.tv_sec - info.st_mtim.tv_sec) * 1000000000L + now.tv_nsec - info.st_mtim.tv_nsec < racy_ns) {
+        *storable = 0; // may still be written within the same mtime: run it, but do not remember the result
+    }
+    return 0;
+}
+
+static int memo_build_key(const struct command *cmd, int *storable) { // cwd, argv, the program and the input files; -1 when the command cannot be cached
+    char cwd[HASH_PATH_VAR_SIZE];
+    char number[EXPAND_NUMBER_SIZE];
+
+    memo.key.length = 0;
+    word_reserve(&memo.key, 0);
+    if (cmd->argc == 0 || getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+    word_append(&memo.key, cwd, strlen(cwd) + 1);
+    for (int i = 0; i < cmd->argc; i++) {
+        word_append(&memo.key, cmd->argv[i], strlen(cmd->argv[i]) + 1);
+    }
+    const char *program = hash_lookup(cmd->argv[0]);
+    if (program == NULL || memo_key_file(program, storable) < 0) { // a rebuilt program is a new key
+        return -1;
+    }
+    for (int i = 1; i < cmd->argc; i++) { // arguments naming files, as in wc -l list.txt
+        struct stat info;
+        if (stat(cmd->argv[i], &info) == 0 && S_ISREG(info.st_mode)) {
+            word_append(&memo.key, "F", 1);
+            memo_key_file(cmd->argv[i], storable);
+        }
+    }
+    for (const struct redirection *redirection = cmd->redirections; redirection != NULL; redirection = redirection->next) {
+        int length = snprintf(number, sizeof(number), "%d", redirection->fd);
+        if (redirection->type == REDIRECT_INPUT) {
+            word_append(&memo.key, "<", 1);
+            word_append(&memo.key, number, length);
+            word_append(&memo.key, redirection->target, strlen(redirection->target) + 1);
+            if (memo_key_file(redirection->target, storable) < 0) { // pipes and devices are not repeatable
+                return -1;
+            }
+        } else if (redirection->type == REDIRECT_HERE_STRING) {
+            word_append(&memo.key, "<<<", 3);
+            word_append(&memo.key, number, length);
+            word_append(&memo.key, redirection->target, strlen(redirection->target) + 1);
+        } else { // the output is what gets cached, it has to go to stdout
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int memo_lookup(const char *name, struct memo_header *header) { // descriptor positioned on the cached output, -1 on a miss
+    int fd = openat(memo.dir_fd, name, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header) || memcmp(header->magic, MEMO_MAGIC, sizeof(header->magic)) != 0
+        || header->key_length != memo.key.length || fstat(fd, &info) < 0
+        || (uint64_t)info.st_size != sizeof(*header) + header->key_length + header->output_length) { // another key with the same hash, or a damaged entry
+        close(fd);
+        return -1;
+    }
+    char *key = arena_alloc(&line_arena, header->key_length);
+    if (pread(fd, key, header->key_length, sizeof(*header)) != (ssize_t)header->key_length || memcmp(key, memo.key.text, header->key_length) != 0) {
+        close(fd);
+        return -1;
+    }
+    lseek(fd, sizeof(*header) + header->key_length, SEEK_SET);
+    return fd;
+}
+
+static void memo_print(void) {
+    char message[MESSAGE_BUFFER_SIZE];
+    struct output_buffer output;
+    long lookups = memo.hits + memo.misses;
+    int length = snprintf(message, sizeof(message), "memo: %ld hits, %ld misses (%ld%% hit rate), %ld stored, %ld evicted, %ld not cacheable\n",
+                          memo.hits, memo.misses, lookups > 0 ? memo.hits * 100 / lookups : 0, memo.stores, memo.evictions, memo.uncacheable);
+
+    output.fd = STDOUT_FILENO;
+    output.length = 0;
+    output_append(&output, message, length);
+    length = snprintf(message, sizeof(message), "memo: %ldms of runs saved, %ld bytes replayed", memo.saved_ns / 1000000, memo.replayed_bytes);
+    if (memo.dir_fd >= 0) {
+        length += snprintf(message + length, sizeof(message) - length, ", %ldkB of %ldkB on disk\n", memo.bytes / 1024, memo.limit / 1024);
+    } else {
+        length += snprintf(message + length, sizeof(message) - length, "\n");
+    }
+    output_append(&output, message, length);
+    output_flush(&output);
+}
+
+static int builtin_memo(int argc, char *argv[]) { // memo [-c]: hit rate of the result cache, -c empties it
+    if (argc > 1 && strncmp(argv[1], "-c", 3) == 0) {
+        if (memo_open_store() < 0) {
+            return 1;
+        }
+        memo.bytes = memo_scan(0);
+        return 0;
+    }
+    if (argc > 1) {
+        write(STDERR_FILENO, MEMO_USAGE_MSG, MEMO_USAGE_MSG_LENGTH);
+        return 2;
+    }
+    memo_print();
+    return 0;
+}
+
+static int snapshot_load(const char *path) { // one mmap: the hash is filled from it, the limits taken, the prompt format used in place
+    struct stat file_info;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &file_info) < 0 || (size_t)file_info.st_size <= sizeof(struct snapshot_header)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    const struct snapshot_header *header = map;
+    const char *strings = (const char *)(header + 1);
+    const char *end = (const char *)map + file_info.st_size;
+    size_t available = end - strings;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || end[-1] != '\0' // every string below ends before the mapping does
+        || (header->engine != SPAWN_ENGINE_POSIX && header->engine != SPAWN_ENGINE_FORK) || header->path_var_length == 0
+        || (size_t)header->path_var_length + header->prompt_length > available || strings[header->path_var_length - 1] != '\0'
+        || (header->prompt_length > 0 && strings[header->path_var_length + header->prompt_length - 1] != '\0')) {
+        munmap(map, file_info.st_size);
+        return -1;
+    }
+    snapshot.header = header;
+    snapshot.size = file_info.st_size;
+    snapshot.prompt_format = header->prompt_length > 0 ? strings + header->path_var_length : NULL;
+    default_limits = header->limits;
+    if (strcmp(strings, current_path_var()) != 0) { // resolved for another PATH: only the configuration applies
+        return 0;
+    }
+    hash_reset();
+    path_var_remember(&command_hash.path_var, strings);
+    const char *name = strings + header->path_var_length + header->prompt_length;
+    for (uint32_t i = 0; i < header->entry_count && name < end; i++) {
+        const char *entry_path = name + strlen(name) + 1;
+        int free_slot;
+        if (entry_path >= end) {
+            break;
+        }
+        if (strlen(name) < HASH_NAME_SIZE && strlen(entry_path) < HASH_PATH_SIZE && command_hash.used < HASH_TABLE_SIZE * 3 / 4
+            && hash_find(name, &free_slot) == NULL && free_slot >= 0) {
+            hash_store(name, entry_path, free_slot, 0);
+        }
+        name = entry_path + strlen(entry_path) + 1;
+    }
+    return 0;
+}
+
+static int builtin_snapshot(int argc, char *argv[]) { // snapshot file [command...]: resolves the commands, then saves the hash, the limits, the prompt and the spawn engine
+    const char *path_var = current_path_var();
+    const char *prompt_format = getenv(PROMPT_FORMAT_ENV);
+    const char *engine_name = getenv(SPAWN_ENGINE_ENV);
+    char temp_path[HASH_PATH_SIZE + SNAPSHOT_TEMP_SUFFIX_SIZE];
+    struct snapshot_header header;
+    struct word_buffer file = { NULL, 0, 0 };
+    int status = 0;
+
+    if (argc < 2) {
+        write(STDERR_FILENO, SNAPSHOT_USAGE_MSG, SNAPSHOT_USAGE_MSG_LENGTH);
+        return 2;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (hash_lookup(argv[i]) == NULL) {
+            builtin_error(argv[i], "not found");
+            status = 1;
+        }
+    }
+    if (!path_var_matches(&command_hash.path_var, path_var)) { // nothing resolved against this PATH yet
+        hash_reset();
+        path_var_remember(&command_hash.path_var, path_var);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.engine = engine_name != NULL && strncmp(engine_name, SPAWN_ENGINE_FORK_NAME, SPAWN_ENGINE_FORK_NAME_LENGTH + 1) == 0 ? SPAWN_ENGINE_FORK : SPAWN_ENGINE_POSIX;
+    header.path_var_length = command_hash.path_var.length + 1;
+    header.prompt_length = prompt_format != NULL ? strlen(prompt_format) + 1 : 0;
+    header.limits = default_limits;
+    word_append(&file, (const char *)&header, sizeof(header)); // entry_count is patched once the entries are in
+    word_append(&file, command_hash.path_var.text, header.path_var_length);
+    if (prompt_format != NULL) {
+        word_append(&file, prompt_format, header.prompt_length);
+    }
+    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
+        const struct hash_entry *entry = &command_hash.entries[i];
+        if (entry->state == HASH_SLOT_USED) {
+            word_append(&file, entry->name, strnlen(entry->name, HASH_NAME_SIZE - 1) + 1);
+            word_append(&file, entry->path, strnlen(entry->path, HASH_PATH_SIZE - 1) + 1);
+            header.entry_count++;
+        }
+    }
+    memcpy(file.text, &header, sizeof(header));
+
+    int length = snprintf(temp_path, sizeof(temp_path), "%s.%d", argv[1], (int)getpid()); // renamed into place: a starting shell never maps half a file
+    int fd = -1;
+    int written = 0;
+    errno = ENAMETOOLONG;
+    if (length > 0 && (size_t)length < sizeof(temp_path)) {
+        fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd >= 0) {
+        written = write(fd, file.text, file.length) == (ssize_t)file.length;
+        written = close(fd) == 0 && written;
+    }
+    if (!written || rename(temp_path, argv[1]) < 0) {
+        builtin_error("snapshot", strerror(errno));
+        if (fd >= 0) {
+            unlink(temp_path);
+        }
+        status = 1;
+    }
+    free(file.text);
+    return status;
+}
+
+struct builtin {
+    const char name[BUILTIN_NAME_SIZE];
+    int (*run)(int argc, char *argv[]); // returns the exit status shown in the prompt
+    int (*accepts)(const struct command *cmd); // NULL, or whether this command can run in-process instead of the external program
+};
+
+static const struct builtin builtins[] = {
+    { "cd", builtin_cd, NULL },
+    { "exit", builtin_exit, NULL },
+    { "echo", builtin_echo, accepts_echo },
+    { "pwd", builtin_pwd, NULL },
+    { "true", builtin_true, NULL },
+    { "false", builtin_false, NULL },
+    { "export", builtin_export, NULL },
+    { "printf", builtin_printf, accepts_printf },
+    { "test", builtin_test, NULL },
+    { "[", builtin_test, NULL },
+    { "jobs", builtin_jobs, NULL },
+    { "hash", builtin_hash, NULL },
+    { "arena", builtin_arena, NULL },
+    { "coproc", builtin_coproc, NULL },
+    { "limits", builtin_limits, NULL },
+    { "cgroup", builtin_cgroup, NULL },
+    { "history", builtin_history, NULL },
+    { "trace", builtin_trace, NULL },
+    { "memo", builtin_memo, NULL },
+    { "snapshot", builtin_snapshot, NULL },
+    { "cat", builtin_cat, accepts_cat },
+    { "parallel", builtin_parallel, NULL },
+};
+
+static const struct builtin *find_builtin(const struct pipeline *pipeline) { // only a lone foreground command runs in the shell process
+    if (pipeline->count != 1 || pipeline->stages->argc == 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strncmp(builtins[i].name, pipeline->stages->argv[0], BUILTIN_NAME_SIZE) == 0) {
+            int accepted = builtins[i].accepts == NULL || builtins[i].accepts(pipeline->stages);
+            return accepted ? &builtins[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+static void subtract_usage(struct rusage *usage, const struct rusage *before) { // CPU spent by the shell itself while the builtin ran
+    long user_us = timeval_us(&usage->ru_utime) - timeval_us(&before->ru_utime);
+    long sys_us = timeval_us(&usage->ru_stime) - timeval_us(&before->ru_stime);
+
+    usage->ru_utime.tv_sec = user_us / 1000000;
+    usage->ru_utime.tv_usec = user_us % 1000000;
+    usage->ru_stime.tv_sec = sys_us / 1000000;
+    usage->ru_stime.tv_usec = sys_us % 1000000;
+    usage->ru_minflt -= before->ru_minflt;
+    usage->ru_majflt -= before->ru_majflt;
+    usage->ru_nvcsw -= before->ru_nvcsw;
+    usage->ru_nivcsw -= before->ru_nivcsw;
+}
+
+static int run_builtin(const struct builtin *builtin, struct command *cmd, struct rusage *usage) { // returns a wait status like the external commands
+    struct rusage before;
+    struct fd_plan plan;
+    int *saved;
+    int status;
+
+    memset(usage, 0, sizeof(*usage));
+    shell_flush(); // earlier messages go to the real stdout and stderr, not to the builtin's redirections
+    if (build_fd_plan(cmd, -1, -1, &plan) < 0) {
+        return W_EXITCODE(1, 0);
+    }
+    saved = arena_alloc(&line_arena, sizeof(int) * (plan.count + 1));
+    for (int i = 0; i < plan.count; i++) { // same redirections as external commands, undone once the builtin returns
+        saved[i] = fcntl(plan.actions[i].target, F_DUPFD_CLOEXEC, FD_RELOCATION_BASE); // -1 when the target was not open
+        if (plan.actions[i].source < 0) {
+            close(plan.actions[i].target);
+        } else {
+            dup2(plan.actions[i].source, plan.actions[i].target);
+        }
+    }
+    close_fd_plan(&plan);
+
+    getrusage(RUSAGE_SELF, &before);
+    memset(&builtin_jobs_usage, 0, sizeof(builtin_jobs_usage));
+    int64_t builtin_start = trace_begin();
+    status = builtin->run(cmd->argc, cmd->argv);
+    trace_end(TRACE_BUILTIN, builtin_start, 0, W_EXITCODE(status & 0xff, 0), cmd->argv[0]);
+    getrusage(RUSAGE_SELF, usage);
+    subtract_usage(usage, &before);
+    add_usage(usage, &builtin_jobs_usage);
+    shell_flush(); // the builtin's error messages follow its redirections
+
+    for (int i = plan.count - 1; i >= 0; i--) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], plan.actions[i].target);
+            close(saved[i]);
+        } else {
+            close(plan.actions[i].target);
+        }
+    }
+    return W_EXITCODE(status & 0xff, 0);
+}
+
+static int run_external_pipeline(struct pipeline *pipeline, enum spawn_engine engine, struct rusage *usage) { // fork/spawn every stage and wait for all of them
+    pid_t *child_pids = arena_alloc(&line_arena, sizeof(pid_t) * pipeline->count);
+    struct cgroup_leaf cgroup;
+    pid_t pgid = start_pipeline(pipeline, engine, child_pids, &cgroup);
+    int child_status;
+
+    wait_foreground(pipeline, child_pids, pgid, &child_status, usage);
+    cgroup_collect(&cgroup, &last_cgroup_usage);
+    if (limit_hit == LIMIT_NONE && last_cgroup_usage.oom_kills > 0 && WIFSIGNALED(child_status)) { // memory.max reached: killed by the OOM killer
+        limit_hit = LIMIT_MEMORY;
+    }
+    return child_status;
+}
+
+static long memo_replay(int fd) { // cached or just captured output to the shell's stdout, in-kernel when possible
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    off_t end = lseek(fd, 0, SEEK_END);
+
+    lseek(fd, start, SEEK_SET);
+    shell_flush();
+    copy_fd(fd, STDOUT_FILENO);
+    return end > start ? end - start : 0;
+}
+
+static int memo_run(struct pipeline *pipeline, enum spawn_engine engine, struct rusage *usage) { // a lone external command through the result cache
+    struct memo_header header;
+    struct timespec start;
+    struct timespec end;
+    char name[MEMO_NAME_SIZE];
+    char temp_name[MEMO_TEMP_NAME_SIZE];
+    int storable = 1;
+
+    if (memo_open_store() < 0 || memo_build_key(pipeline->stages, &storable) < 0) {
+        memo.uncacheable++;
+        return run_external_pipeline(pipeline, engine, usage);
+    }
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)memo_hash(memo.key.text, memo.key.length));
+
+    int fd = memo_lookup(name, &header);
+    if (fd >= 0) { // hit: no child at all
+        memset(usage, 0, sizeof(*usage));
+        limit_hit = LIMIT_NONE;
+        last_cgroup_usage.cpu_us = -1;
+        last_cgroup_usage.memory_peak = -1;
+        futimens(fd, NULL); // most recently used
+        memo.replayed_bytes += memo_replay(fd);
+        close(fd);
+        memo.hits++;
+        memo.saved_ns += header.run_ns;
+        memo_hit = 1;
+        return header.status;
+    }
+
+    memo.misses++;
+    snprintf(temp_name, sizeof(temp_name), ".%s.%d", name, (int)getpid()); // renamed into place once complete
+    fd = openat(memo.dir_fd, temp_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return run_external_pipeline(pipeline, engine, usage);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MEMO_MAGIC, sizeof(header.magic));
+    header.key_length = memo.key.length;
+    if (pwrite(fd, memo.key.text, memo.key.length, sizeof(header)) != (ssize_t)memo.key.length) {
+        storable = 0;
+    }
+    lseek(fd, sizeof(header) + header.key_length, SEEK_SET);
+
+    shell_flush();
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, FD_RELOCATION_BASE); // stdout of the command is the entry, as a builtin's redirection
+    dup2(fd, STDOUT_FILENO);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = run_external_pipeline(pipeline, engine, usage);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    } else {
+        close(STDOUT_FILENO);
+    }
+
+    lseek(fd, sizeof(header) + header.key_length, SEEK_SET);
+    long output_length = memo_replay(fd);
+    header.status = status;
+    header.output_length = output_length;
+    header.run_ns = elapsed_ns(&start, &end);
+    storable = storable && WIFEXITED(status) && limit_hit == LIMIT_NONE && output_length <= memo.limit / 4; // killed runs are not results
+    if (storable && pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && renameat(memo.dir_fd, temp_name, memo.dir_fd, name) == 0) {
+        memo.stores++;
+        memo.bytes += sizeof(header) + header.key_length + output_length;
+        if (memo.bytes > memo.limit) {
+            memo.bytes = memo_scan(memo.limit / 4 * 3);
+        }
+    } else {
+        unlinkat(memo.dir_fd, temp_name, 0);
+    }
+    close(fd);
+    return status;
+}
+
+static int take_prefix_words(struct pipeline *pipeline, struct command_limits *limits, int *memoize) { // limit [-t time] [-c cpu_seconds] [-m size] [-k grace] and memo in front of a pipeline: 1 when there were any, -1 when nothing is left to run
+    struct command *first = pipeline->stages;
+    int skip = 0;
+
+    while (skip < first->argc) {
+        if (strncmp(first->argv[skip], "limit", 6) == 0) {
+            for (skip++; skip < first->argc && first->argv[skip][0] == '-'; skip += 2) {
+                if (set_limit_option(limits, first->argv[skip], first->argv[skip + 1]) < 0) { // argv[argc] is NULL
+                    return -1;
+                }
+            }
+        } else if (strncmp(first->argv[skip], "memo", 5) == 0 && skip + 1 < first->argc && first->argv[skip + 1][0] != '-') { // memo and memo -c are the builtin
+            *memoize = 1;
+            skip++;
+        } else {
+            break;
+        }
+    }
+    if (skip == 0) {
+        return 0;
+    }
+    if (skip >= first->argc) {
+        return -1;
+    }
+    struct command *command = arena_alloc(&line_arena, sizeof(struct command)); // the other stages and the redirections are shared
+    *command = *first;
+    command->argv += skip;
+    command->argc -= skip;
+    command->sources = first->sources != NULL ? first->sources + skip : NULL;
+    pipeline->stages = command;
+    return 1;
+}
+
+static int run_command_pipeline(struct pipeline *pipeline, enum spawn_engine engine, int memoize, struct rusage *usage) { // without its prefix words
+    struct pipeline expanded = *pipeline; // a lone command is expanded first, its first field may name a builtin
+
+    memo_hit = 0;
+    if (pipeline->count == 1 && (expanded.stages = expand_command(pipeline->stages)) == NULL) {
+        memset(usage, 0, sizeof(*usage));
+        limit_hit = LIMIT_NONE;
+        return W_EXITCODE(1, 0);
+    }
+    const struct builtin *builtin = find_builtin(&expanded);
+
+    if (builtin != NULL) { // no fork at all, timed and reported like an external command
+        limit_hit = LIMIT_NONE; // limits only apply to child processes
+        last_cgroup_usage.cpu_us = -1;
+        last_cgroup_usage.memory_peak = -1;
+        return run_builtin(builtin, expanded.stages, usage);
+    }
+    if (memoize && expanded.count == 1) {
+        return memo_run(&expanded, engine, usage);
+    }
+    return run_external_pipeline(&expanded, engine, usage);
+}
+
+static int run_pipeline(struct pipeline *pipeline, enum spawn_engine engine, struct rusage *usage) { // foreground, returns the wait status of the last stage
+    struct pipeline command = *pipeline;
+    struct command_limits limits = active_limits;
+    int memoize = 0;
+    int prefixed = take_prefix_words(&command, &limits, &memoize);
+
+    if (prefixed < 0) {
+        shell_write(STDERR_FILENO, LIMIT_USAGE_MSG, LIMIT_USAGE_MSG_LENGTH);
+        memset(usage, 0, sizeof(*usage));
+        limit_hit = LIMIT_NONE;
+        return W_EXITCODE(2, 0);
+    }
+    if (!prefixed) {
+        return run_command_pipeline(pipeline, engine, 0, usage);
+    }
+    struct command_limits saved = active_limits; // the limit prefix only holds for this pipeline
+    active_limits = limits;
+    int status = run_command_pipeline(&command, engine, memoize, usage);
+    active_limits = saved;
+    return status;
+}
+
+static int run_and_or(struct and_or *and_or, enum spawn_engine engine, struct rusage *usage) { // && runs the next pipeline after a success, || after a failure
+    struct rusage pipeline_usage;
+    int status = 0;
+
+    memset(usage, 0, sizeof(*usage));
+    for (struct pipeline *pipeline = and_or->pipelines; pipeline != NULL && !exit_requested; pipeline = pipeline->next) {
+        int succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if ((pipeline->connector == CONNECT_AND && !succeeded) || (pipeline->connector == CONNECT_OR && succeeded)) {
+            continue;
+        }
+        status = run_pipeline(pipeline, engine, &pipeline_usage);
+        last_wait_status = status;
+        add_usage(usage, &pipeline_usage);
+    }
+    return status;
+}
+
+static void start_background(struct and_or *and_or, struct pipeline *first, const struct command_limits *outer_limits, enum spawn_engine engine) { // first: without its prefix words, outer_limits: without the limit prefix
+    struct cgroup_leaf cgroup;
+    pid_t *child_pids;
+    pid_t pgid;
+    int count;
+
+    if (and_or->pipelines->next == NULL && active_limits.timeout_ms == 0) { // a single pipeline: its stages are the job
+        count = first->count;
+        child_pids = arena_alloc(&line_arena, sizeof(pid_t) * count);
+        pgid = start_pipeline(first, engine, child_pids, &cgroup);
+    } else { // && and || need a shell to decide what runs next, a deadline a shell to enforce it: a forked subshell becomes the job
+        count = 1;
+        child_pids = arena_alloc(&line_arena, sizeof(pid_t));
+        shell_flush();
+        cgroup_create(&cgroup);
+        pgid = fork();
+        if (pgid == 0) {
+            struct rusage usage;
+            cgroup_enter_subshell(&cgroup);
+            setpgid(0, 0);
+            event_loop_reset();
+            job_pgid = getpid(); // every pipeline of the list joins the job's process group
+            terminal_control = 0;
+            active_limits = *outer_limits; // the first pipeline takes its limit prefix again, the others run without it
+            int status = run_and_or(and_or, engine, &usage);
+            shell_flush();
+            if (limit_hit == LIMIT_TIMEOUT) {
+                _exit(LIMIT_TIMEOUT_EXIT_STATUS);
+            }
+            _exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+        }
+        if (pgid > 0) {
+            setpgid(pgid, pgid);
+        }
+        child_pids[0] = pgid;
+    }
+    if (pgid <= 0) {
+        cgroup_collect(&cgroup, &last_cgroup_usage);
+        return;
+    }
+
+    struct job *job = add_job(child_pids, count, pgid, and_or->text);
+    if (job != NULL) {
+        job->cgroup = cgroup;
+        char message[MESSAGE_BUFFER_SIZE];
+        int length = snprintf(message, MESSAGE_BUFFER_SIZE, "[%d] %d\n", job->id, (int)pgid);
+        shell_write(STDOUT_FILENO, message, length);
+        return;
+    }
+    shell_write(STDERR_FILENO, NOJOBSLOT_MSG, NOJOBSLOT_MSG_LENGTH);
+    struct pipeline waited = { .count = count };
+    int child_status;
+    struct rusage usage;
+    wait_foreground(&waited, child_pids, pgid, &child_status, &usage);
+    cgroup_collect(&cgroup, &last_cgroup_usage);
+}
+
+static void run_background(struct and_or *and_or, enum spawn_engine engine) {
+    struct pipeline first = *and_or->pipelines;
+    struct command_limits saved = active_limits; // a limit prefix holds for the job, stored with it, and for the subshell that enforces its deadline
+    int memoize = 0; // the result cache is for foreground commands
+
+    if (take_prefix_words(&first, &active_limits, &memoize) < 0) {
+        shell_write(STDERR_FILENO, LIMIT_USAGE_MSG, LIMIT_USAGE_MSG_LENGTH);
+    } else {
+        start_background(and_or, &first, &saved, engine);
+    }
+    active_limits = saved;
+}
+
+static int run_list(struct and_or *list, enum spawn_engine engine, int *child_status, struct rusage *usage) { // returns 0 when everything went to the background
+    struct rusage and_or_usage;
+    int ran_foreground = 0;
+
+    memset(usage, 0, sizeof(*usage));
+    for (struct and_or *and_or = list; and_or != NULL && !exit_requested; and_or = and_or->next) {
+        if (and_or->background) {
+            run_background(and_or, engine);
+            continue;
+        }
+        *child_status = run_and_or(and_or, engine, &and_or_usage); // the prompt reports the last foreground status
+        add_usage(usage, &and_or_usage);
+        ran_foreground = 1;
+    }
+    return ran_foreground;
+}
+
+struct parallel_slot {
+    struct arena arena; // command line, parse tree and pids of the running job, reset when the slot is reused
+    int item;           // input item being run, -1 when the slot is free
+    pid_t *pids;        // stages still to reap, -1 once reaped or never started
+    int count;
+    int remaining;
+    int status;         // wait status of the last stage
+    char *command_line;
+    struct timespec time_start;
+    struct rusage usage;
+    struct cgroup_leaf cgroup;
+};
+
+struct parallel_run {
+    char **items;
+    int item_count;
+    const char *template;     // command text, {} is replaced by the quoted item, NULL when items are whole command lines
+    struct parallel_slot *slots;
+    int slot_count;
+    int running;
+    int next_item;            // next item to start
+    int next_output;          // -k: next item whose output may be written
+    int *outputs;             // memfd holding the stdout and stderr of each item, -1 once written
+    int *statuses;
+    long *times_ns;
+    int keep_order;
+    int verbose;
+    int discard;              // benchmark: outputs are dropped
+    enum spawn_engine engine;
+    int saved_stdin;
+    int saved_stdout;
+    int saved_stderr;
+    char *copy_buffer;
+    int failures;
+    long total_job_ns;        // sum of the job wall times, what the sequential loop would roughly take
+    struct rusage usage;      // summed over every job, shown by the prompt
+};
+
+static char *parallel_quote(char *out, const char *item) { // 'item' with ' written as '\'', returns the end
+    *out++ = '\'';
+    for (; *item != '\0'; item++) {
+        if (*item == '\'') {
+            memcpy(out, "'\\''", 4);
+            out += 4;
+        } else {
+            *out++ = *item;
+        }
+    }
+    *out++ = '\'';
+    return out;
+}
+
+static char *parallel_command_line(struct arena *arena, const char *template, const char *item) {
+    if (template == NULL) { // :::: file without a template: each line is a command
+        size_t length = strlen(item);
+        char *line = arena_alloc(arena, length + 1);
+        memcpy(line, item, length + 1);
+        return line;
+    }
+
+    size_t quoted_size = strlen(item) * 4 + 2;
+    size_t size = strlen(template) + 2 + quoted_size;
+    for (const char *brace = strstr(template, "{}"); brace != NULL; brace = strstr(brace + 2, "{}")) {
+        size += quoted_size;
+    }
+    char *line = arena_alloc(arena, size + 1);
+    char *out = line;
+    const char *cursor = template;
+    const char *brace;
+    int substituted = 0;
+
+    while ((brace = strstr(cursor, "{}")) != NULL) {
+        memcpy(out, cursor, brace - cursor);
+        out = parallel_quote(out + (brace - cursor), item);
+        cursor = brace + 2;
+        substituted = 1;
+    }
+    size_t rest = strlen(cursor);
+    memcpy(out, cursor, rest);
+    out += rest;
+    if (!substituted) { // like xargs, the item becomes the last argument
+        *out++ = ' ';
+        out = parallel_quote(out, item);
+    }
+    *out = '\0';
+    return line;
+}
+
+static void parallel_write_output(struct parallel_run *run, int item) { // copies the grouped output of a finished item to the shell's stdout
+    int fd = run->outputs[item];
+    ssize_t length;
+
+    if (fd >= 0 && !run->discard) {
+        lseek(fd, 0, SEEK_SET);
+        while ((length = read(fd, run->copy_buffer, PARALLEL_COPY_SIZE)) > 0) {
+            write(STDOUT_FILENO, run->copy_buffer, length);
+        }
+    }
+    close_if_open(fd);
+    run->outputs[item] = -1;
+
+    if (run->verbose && !run->discard) {
+        char message[MESSAGE_BUFFER_SIZE];
+        int status = run->statuses[item];
+        int length = WIFSIGNALED(status)
+            ? snprintf(message, MESSAGE_BUFFER_SIZE, "[%d] [sign:%d|%ldms] %s\n", item + 1, WTERMSIG(status), run->times_ns[item] / 1000000, run->items[item])
+            : snprintf(message, MESSAGE_BUFFER_SIZE, "[%d] [exit:%d|%ldms] %s\n", item + 1, WEXITSTATUS(status), run->times_ns[item] / 1000000, run->items[item]);
+        if (length >= MESSAGE_BUFFER_SIZE) {
+            length = MESSAGE_BUFFER_SIZE - 1;
+        }
+        write(STDERR_FILENO, message, length);
+    }
+}
+
+static void parallel_finish(struct parallel_run *run, int item, int status, long wall_ns) {
+    run->statuses[item] = status;
+    run->times_ns[item] = wall_ns;
+    run->total_job_ns += wall_ns;
+    run->failures += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+    if (!run->keep_order) {
+        parallel_write_output(run, item);
+        return;
+    }
+    while (run->next_output < run->item_count && run->statuses[run->next_output] >= 0) { // -k: everything finished in front of the queue
+        parallel_write_output(run, run->next_output);
+        run->next_output++;
+    }
+}
+
+static void parallel_start(struct parallel_run *run, struct parallel_slot *slot) { // runs the next item in a free slot
+    int item = run->next_item++;
+    char message[MESSAGE_BUFFER_SIZE];
+    struct and_or *list;
+    pid_t pgid = 0;
+
+    arena_reset(&slot->arena);
+    slot->item = item;
+    slot->command_line = parallel_command_line(&slot->arena, run->template, run->items[item]);
+    run->outputs[item] = memfd_create("enseash-parallel", MFD_CLOEXEC); // -1: the output is not grouped
+    clock_gettime(CLOCK_MONOTONIC, &slot->time_start);
+    memset(&slot->usage, 0, sizeof(slot->usage));
+
+    if (parse_line(&slot->arena, slot->command_line, &list, message) < 0 || list == NULL) {
+        if (run->outputs[item] >= 0) {
+            write(run->outputs[item], message, strnlen(message, MESSAGE_BUFFER_SIZE));
+        }
+        slot->item = -1;
+        parallel_finish(run, item, W_EXITCODE(2, 0), 0);
+        return;
+    }
+
+    shell_flush();
+    if (run->outputs[item] >= 0) { // the children inherit the memfd as stdout and stderr
+        dup2(run->outputs[item], STDOUT_FILENO);
+        dup2(run->outputs[item], STDERR_FILENO);
+    }
+    if (list->next == NULL && !list->background && list->pipelines->next == NULL) { // a plain pipeline is spawned directly
+        struct arena_mark mark = arena_mark(&line_arena); // fd plans are dropped once the stages are started
+        slot->count = list->pipelines->count;
+        slot->pids = arena_alloc(&slot->arena, sizeof(pid_t) * slot->count);
+        pgid = start_pipeline(list->pipelines, run->engine, slot->pids, &slot->cgroup);
+        arena_release(&line_arena, &mark);
+    } else { // ; && || need a shell: a forked subshell runs the list
+        slot->count = 1;
+        slot->pids = arena_alloc(&slot->arena, sizeof(pid_t));
+        cgroup_create(&slot->cgroup);
+        slot->pids[0] = fork();
+        if (slot->pids[0] == 0) {
+            int status;
+            struct rusage usage;
+            cgroup_enter_subshell(&slot->cgroup);
+            setpgid(0, 0);
+            event_loop_reset();
+            job_pgid = getpid();
+            terminal_control = 0;
+            run_list(list, run->engine, &status, &usage);
+            shell_flush();
+            _exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+        }
+        pgid = slot->pids[0];
+    }
+    shell_flush(); // command not found goes to the job's output
+    if (run->outputs[item] >= 0) {
+        dup2(run->saved_stdout, STDOUT_FILENO);
+        dup2(run->saved_stderr, STDERR_FILENO);
+    }
+
+    slot->remaining = 0;
+    for (int i = 0; i < slot->count; i++) {
+        slot->remaining += slot->pids[i] > 0;
+    }
+    if (pgid <= 0 || slot->remaining == 0) { // nothing started: command not found is reported by the spawn
+        struct cgroup_usage cgroup_usage;
+        cgroup_collect(&slot->cgroup, &cgroup_usage);
+        slot->item = -1;
+        parallel_finish(run, item, W_EXITCODE(1, 0), 0);
+        return;
+    }
+    slot->status = W_EXITCODE(1, 0);
+    run->running++;
+}
+
+static struct parallel_slot *parallel_reap_stage(struct parallel_run *run, int *stage, int *status, struct rusage *usage) { // a stage of a running job that has exited, NULL when none has yet
+    for (int s = 0; s < run->slot_count; s++) {
+        struct parallel_slot *slot = &run->slots[s];
+        for (int i = 0; slot->item >= 0 && i < slot->count; i++) {
+            if (slot->pids[i] <= 0) {
+                continue;
+            }
+            pid_t pid = wait4(slot->pids[i], status, WNOHANG, usage); // only our own pids: jobs and coprocess workers keep their exit status
+            if (pid == slot->pids[i]) {
+                trace_reap(pid, *status);
+            } else if (pid < 0 && errno == ECHILD) { // gone without us, counted as failed
+                *status = W_EXITCODE(1, 0);
+                memset(usage, 0, sizeof(*usage));
+            } else {
+                continue;
+            }
+            *stage = i;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static void parallel_interrupt(struct parallel_run *run) { // Ctrl-C reached the shell: every running job gets it, the shell carries on
+    for (int s = 0; s < run->slot_count; s++) {
+        for (int i = 0; run->slots[s].item >= 0 && i < run->slots[s].count; i++) {
+            if (run->slots[s].pids[i] > 0) {
+                kill(run->slots[s].pids[i], SIGINT);
+            }
+        }
+    }
+}
+
+static void parallel_reap(struct parallel_run *run) { // blocks until one child of the run exits
+    struct rusage usage;
+    int status;
+    int stage;
+
+    while (1) {
+        struct parallel_slot *slot = parallel_reap_stage(run, &stage, &status, &usage);
+        if (slot == NULL) { // none has exited yet: the event loop sleeps until SIGCHLD
+            event_wait(NULL, 0, -1);
+            if (event_take_interrupt()) {
+                parallel_interrupt(run);
+            }
+            continue;
+        }
+        add_usage(&slot->usage, &usage);
+        slot->pids[stage] = -1;
+        if (stage == slot->count - 1) {
+            slot->status = status;
+        }
+        if (--slot->remaining > 0) {
+            continue;
+        }
+
+        struct timespec time_end;
+        clock_gettime(CLOCK_MONOTONIC, &time_end);
+        long wall_ns = elapsed_ns(&slot->time_start, &time_end);
+        int item = slot->item;
+        struct cgroup_usage cgroup_usage;
+        cgroup_collect(&slot->cgroup, &cgroup_usage);
+        log_command_stats(slot->command_line, slot->status, wall_ns, &slot->usage, 0, limit_of_status(slot->status, &slot->usage, &active_limits), &cgroup_usage);
+        add_usage(&run->usage, &slot->usage);
+        slot->item = -1;
+        run->running--;
+        parallel_finish(run, item, slot->status, wall_ns);
+        return;
+    }
+}
+
+static int parallel_execute(struct parallel_run *run) { // returns 0 when every item succeeded
+    for (int s = 0; s < run->slot_count; s++) {
+        run->slots[s].item = -1;
+    }
+    for (int i = 0; i < run->item_count; i++) {
+        run->outputs[i] = -1;
+        run->statuses[i] = -1;
+    }
+    run->running = 0;
+    run->next_item = 0;
+    run->next_output = 0;
+    run->failures = 0;
+    run->total_job_ns = 0;
+
+    while (run->next_item < run->item_count || run->running > 0) {
+        for (int s = 0; s < run->slot_count && run->next_item < run->item_count; s++) {
+            if (run->keep_order && run->next_item - run->next_output >= PARALLEL_MAX_PENDING) { // a slow early item: wait for it rather than run out of descriptors
+                break;
+            }
+            if (run->slots[s].item < 0) {
+                parallel_start(run, &run->slots[s]);
+            }
+        }
+        if (run->running > 0) {
+            parallel_reap(run);
+        }
+    }
+    return run->failures;
+}
+
+static long parallel_sequential(struct parallel_run *run) { // the plain read-run-wait loop of the prompt, for the benchmark; returns ns
+    struct timespec time_start;
+    struct timespec time_end;
+    char message[MESSAGE_BUFFER_SIZE];
+    struct and_or *list;
+    struct rusage usage;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (int i = 0; i < run->item_count; i++) {
+        struct arena_mark mark = arena_mark(&line_arena);
+        char *command_line = parallel_command_line(&line_arena, run->template, run->items[i]);
+        int output = memfd_create("enseash-parallel", MFD_CLOEXEC); // same output cost as the grouped run
+        if (output >= 0) {
+            dup2(output, STDOUT_FILENO);
+            dup2(output, STDERR_FILENO);
+        }
+        if (parse_line(&line_arena, command_line, &list, message) == 0) {
+            run_list(list, run->engine, &status, &usage);
+        }
+        if (output >= 0) {
+            dup2(run->saved_stdout, STDOUT_FILENO);
+            dup2(run->saved_stderr, STDERR_FILENO);
+            close(output);
+        }
+        arena_release(&line_arena, &mark);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    return elapsed_ns(&time_start, &time_end);
+}
+
+static int parallel_read_items(struct parallel_run *run, char *words[], int count, int from_files) { // ::: words, or :::: files with one item per line
+    if (!from_files) { // already expanded: ::: *.log lists the files
+        run->items = words;
+        run->item_count = count;
+        return 0;
+    }
+
+    int capacity = 0;
+    run->item_count = 0;
+    for (int f = 0; f < count; f++) {
+        struct stat file_info;
+        int fd = open(words[f], O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &file_info) < 0) {
+            builtin_error("parallel", words[f]);
+            close_if_open(fd);
+            return -1;
+        }
+        char *text = arena_alloc(&line_arena, file_info.st_size + 1);
+        ssize_t length = 0;
+        ssize_t got;
+        while (length < file_info.st_size && (got = read(fd, text + length, file_info.st_size - length)) > 0) {
+            length += got;
+        }
+        close(fd);
+        text[length] = '\0';
+
+        for (char *line = text; *line != '\0';) {
+            char *end = strchrnul(line, '\n');
+            char *next = *end != '\0' ? end + 1 : end;
+            *end = '\0';
+            if (*line != '\0') {
+                if (run->item_count == capacity) { // doubling array in the arena, the old copies are dropped with the line
+                    capacity = capacity > 0 ? capacity * 2 : PARALLEL_INITIAL_ITEMS;
+                    char **items = arena_alloc(&line_arena, sizeof(char *) * capacity);
+                    if (run->item_count > 0) {
+                        memcpy(items, run->items, sizeof(char *) * run->item_count);
+                    }
+                    run->items = items;
+                }
+                run->items[run->item_count++] = line;
+            }
+            line = next;
+        }
+    }
+    return 0;
+}
+
+static int parallel_command(int argc, char *argv[], enum spawn_engine engine, struct rusage *usage) { // parallel [-j N] [-k] [-v] [-b] [command] ::: items | :::: files; returns the exit status
+    struct parallel_run run;
+    struct timespec time_start;
+    struct timespec time_end;
+    char message[MESSAGE_BUFFER_SIZE];
+    int benchmark = 0;
+    int separator = 1;
+    int first = 1;
+
+    memset(&run, 0, sizeof(run));
+    memset(usage, 0, sizeof(*usage));
+    run.engine = engine;
+    run.slot_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while (separator < argc && strncmp(argv[separator], PARALLEL_SEPARATOR, sizeof(PARALLEL_SEPARATOR)) != 0
+           && strncmp(argv[separator], PARALLEL_FILE_SEPARATOR, sizeof(PARALLEL_FILE_SEPARATOR)) != 0) {
+        separator++;
+    }
+    int from_files = separator < argc && strncmp(argv[separator], PARALLEL_FILE_SEPARATOR, sizeof(PARALLEL_FILE_SEPARATOR)) == 0;
+    if (separator == argc || parallel_read_items(&run, argv + separator + 1, argc - separator - 1, from_files) < 0) {
+        write(STDERR_FILENO, PARALLEL_USAGE_MSG, PARALLEL_USAGE_MSG_LENGTH);
+        return 2;
+    }
+
+    for (; first < separator && argv[first][0] == '-'; first++) {
+        if (strncmp(argv[first], "-k", 3) == 0) {
+            run.keep_order = 1;
+        } else if (strncmp(argv[first], "-v", 3) == 0) {
+            run.verbose = 1;
+        } else if (strncmp(argv[first], "-b", 3) == 0) {
+            benchmark = 1;
+        } else if (strncmp(argv[first], "-j", 3) == 0 && first + 1 < separator && atoi(argv[first + 1]) > 0) {
+            run.slot_count = atoi(argv[++first]);
+        } else {
+            write(STDERR_FILENO, PARALLEL_USAGE_MSG, PARALLEL_USAGE_MSG_LENGTH);
+            return 2;
+        }
+    }
+    if (first < separator) { // the words after quote removal, joined by spaces, like GNU parallel
+        size_t size = 1;
+        for (int i = first; i < separator; i++) {
+            size += strlen(argv[i]) + 1;
+        }
+        char *template = arena_alloc(&line_arena, size);
+        char *out = template;
+        for (int i = first; i < separator; i++) {
+            size_t length = strlen(argv[i]);
+            memcpy(out, argv[i], length);
+            out += length;
+            *out++ = i + 1 < separator ? ' ' : '\0';
+        }
+        run.template = template;
+    }
+    if (run.template == NULL && !from_files) { // ::: needs a command to substitute the words into
+        write(STDERR_FILENO, PARALLEL_USAGE_MSG, PARALLEL_USAGE_MSG_LENGTH);
+        return 2;
+    }
+    if (run.item_count == 0) {
+        return 0;
+    }
+    if (run.slot_count > run.item_count) {
+        run.slot_count = run.item_count;
+    }
+
+    run.slots = arena_alloc(&line_arena, sizeof(struct parallel_slot) * run.slot_count);
+    memset(run.slots, 0, sizeof(struct parallel_slot) * run.slot_count);
+    run.outputs = arena_alloc(&line_arena, sizeof(int) * run.item_count);
+    run.statuses = arena_alloc(&line_arena, sizeof(int) * run.item_count);
+    run.times_ns = arena_alloc(&line_arena, sizeof(long) * run.item_count);
+    run.copy_buffer = arena_alloc(&line_arena, PARALLEL_COPY_SIZE);
+    run.saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, FD_RELOCATION_BASE);
+    run.saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, FD_RELOCATION_BASE);
+    run.saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, FD_RELOCATION_BASE);
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // jobs run outside the terminal's foreground group and must not read from it
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+
+    long sequential_ns = 0;
+    if (benchmark) { // same items through the prompt's loop first, outputs dropped in both runs
+        run.discard = 1;
+        sequential_ns = parallel_sequential(&run);
+    }
+    memset(&run.usage, 0, sizeof(run.usage));
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    parallel_execute(&run);
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long wall_ns = elapsed_ns(&time_start, &time_end);
+
+    for (int s = 0; s < run.slot_count; s++) {
+        arena_free(&run.slots[s].arena);
+    }
+    *usage = run.usage;
+    if (run.saved_stdin >= 0) {
+        dup2(run.saved_stdin, STDIN_FILENO);
+    }
+    close_if_open(run.saved_stdin);
+    close_if_open(run.saved_stdout);
+    close_if_open(run.saved_stderr);
+
+    int length;
+    if (benchmark) {
+        length = snprintf(message, MESSAGE_BUFFER_SIZE,
+                          "sequential: %d jobs in %ldms (%.0f jobs/s)\nparallel -j %d: %d jobs in %ldms (%.0f jobs/s), %d failed, speedup x%.2f\n",
+                          run.item_count, sequential_ns / 1000000, sequential_ns > 0 ? run.item_count * 1e9 / sequential_ns : 0.0,
+                          run.slot_count, run.item_count, wall_ns / 1000000, wall_ns > 0 ? run.item_count * 1e9 / wall_ns : 0.0,
+                          run.failures, wall_ns > 0 ? (double)sequential_ns / wall_ns : 0.0);
+        shell_write(STDOUT_FILENO, message, length);
+    } else { // on stderr, like the batch summary, so that stdout only holds the jobs' output
+        length = snprintf(message, MESSAGE_BUFFER_SIZE, "parallel: %d jobs on %d slots, %d failed, %ldms (%.0f jobs/s), %.1f jobs in flight on average\n",
+                          run.item_count, run.slot_count, run.failures, wall_ns / 1000000, wall_ns > 0 ? run.item_count * 1e9 / wall_ns : 0.0,
+                          wall_ns > 0 ? (double)run.total_job_ns / wall_ns : 0.0);
+        shell_write(STDERR_FILENO, message, length);
+    }
+    return run.failures > PARALLEL_MAX_FAILURE_STATUS ? PARALLEL_MAX_FAILURE_STATUS : run.failures;
+}
+
+static int builtin_parallel(int argc, char *argv[]) { // the jobs run with the shell's spawn engine, their usage is the builtin's
+    return parallel_command(argc, argv, shell_engine, &builtin_jobs_usage);
+}
+
+static char *history_expand(const char *line) { // !!, !N, !?text or !prefix as the first word, the rest of the line is kept; NULL when no entry matches
+    const char *event = line + 1;
+    size_t event_length = strcspn(event, " \t");
+    char *word = arena_alloc(&line_arena, event_length + 1);
+    const struct history_record *record;
+
+    memcpy(word, event, event_length);
+    word[event_length] = '\0';
+    history_sync(&history);
+    long sequence = history_newest(&history);
+    if (strncmp(word, "!", 2) == 0) {
+        record = history_entry(&history, sequence);
+    } else if (word[0] == '?') {
+        record = history_find_substring(&history, word + 1, &sequence);
+    } else if (strspn(word, "0123456789") == event_length) {
+        record = history_entry(&history, atol(word));
+    } else {
+        record = history_entry(&history, history_find_prefix(&history, word));
+    }
+    if (record == NULL) {
+        return NULL;
+    }
+    const char *rest = event + event_length;
+    size_t rest_length = strlen(rest);
+    char *expanded = arena_alloc(&line_arena, record->length + rest_length + 1); // copied: appending this line may overwrite the record
+    memcpy(expanded, record->line, record->length);
+    memcpy(expanded + record->length, rest, rest_length + 1);
+    return expanded;
+}
+
+static void history_setup(int interactive) { // ENSEASH_HISTORY, or ~/.enseash_history for an interactive shell
+    const char *path = getenv(HISTORY_ENV);
+    const char *size = getenv(HISTORY_SIZE_ENV);
+    const char *home = getenv("HOME");
+    char default_path[HASH_PATH_SIZE];
+    long capacity = size != NULL && atol(size) > 0 ? atol(size) * 1024 * 1024 : HISTORY_DEFAULT_SIZE;
+
+    if (path == NULL && interactive && home != NULL) {
+        snprintf(default_path, HASH_PATH_SIZE, "%s/%s", home, HISTORY_FILE_NAME);
+        path = default_path;
+    }
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        builtin_error("history", strerror(errno));
+        return;
+    }
+    flock(fd, LOCK_EX); // two shells starting at once create the ring only once
+    int result = history_open(&history, fd, history_align(capacity));
+    flock(fd, LOCK_UN);
+    if (result < 0) {
+        builtin_error("history", "not a history file");
+        close(fd);
+    }
+}
+
+static long trie_child(struct path_trie *trie, long node, unsigned char character, int create) { // -1 when missing and not created
+    uint32_t *link = &trie->nodes[node].child;
+
+    while (*link != 0 && trie->nodes[*link].character < character) {
+        link = &trie->nodes[*link].sibling;
+    }
+    if (*link != 0 && trie->nodes[*link].character == character) {
+        return *link;
+    }
+    if (!create) {
+        return -1;
+    }
+    if (trie->count == trie->size) {
+        size_t offset = (char *)link - (char *)trie->nodes; // the link moves with the array
+        struct trie_node *nodes = realloc(trie->nodes, sizeof(struct trie_node) * trie->size * 2);
+        if (nodes == NULL) {
+            return -1;
+        }
+        trie->nodes = nodes;
+        trie->size *= 2;
+        link = (uint32_t *)((char *)nodes + offset);
+    }
+    uint32_t added = trie->count++;
+    memset(&trie->nodes[added], 0, sizeof(struct trie_node));
+    trie->nodes[added].character = character;
+    trie->nodes[added].sibling = *link;
+    *link = added;
+    return added;
+}
+
+static long trie_walk(struct path_trie *trie, const char *name, size_t length, int create) {
+    long node = 0;
+    for (size_t i = 0; i < length && node >= 0; i++) {
+        node = trie_child(trie, node, name[i], create);
+    }
+    return node;
+}
+
+static void trie_set(struct path_trie *trie, const char *name, int dir, int present) { // O(length): a directory gained or lost name
+    size_t length = strlen(name);
+    long node = trie_walk(trie, name, length, present);
+
+    if (node <= 0) {
+        return;
+    }
+    uint64_t before = trie->nodes[node].dirs;
+    trie->nodes[node].dirs = present ? before | 1ULL << dir : before & ~(1ULL << dir);
+    if ((before == 0) == (trie->nodes[node].dirs == 0)) {
+        return;
+    }
+    int delta = before == 0 ? 1 : -1; // the name appeared or vanished: the counts along its path change
+    node = 0;
+    trie->nodes[0].names += delta;
+    for (size_t i = 0; i < length; i++) {
+        node = trie_child(trie, node, name[i], 0);
+        trie->nodes[node].names += delta;
+    }
+}
+
+static int trie_is_executable(int dir_fd, const char *name, unsigned char type) { // what resolve_in_path() would accept
+    struct stat file_info;
+
+    if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) {
+        return 0;
+    }
+    if (type != DT_REG && (fstatat(dir_fd, name, &file_info, 0) < 0 || !S_ISREG(file_info.st_mode))) { // symlinks are followed
+        return 0;
+    }
+    return faccessat(dir_fd, name, X_OK, 0) == 0;
+}
+
+static void trie_scan(struct path_trie *trie, int dir) {
+    int fd = dup(trie->dir_fds[dir]); // closedir() closes the descriptor it was given
+    DIR *stream = fd >= 0 ? fdopendir(fd) : NULL;
+    struct dirent *entry;
+
+    if (stream == NULL) {
+        close_if_open(fd);
+        return;
+    }
+    while ((entry = readdir(stream)) != NULL) {
+        if (strncmp(entry->d_name, ".", 2) != 0 && strncmp(entry->d_name, "..", 3) != 0
+            && trie_is_executable(trie->dir_fds[dir], entry->d_name, entry->d_type)) {
+            trie_set(trie, entry->d_name, dir, 1);
+        }
+    }
+    closedir(stream);
+}
+
+static void trie_reset(struct path_trie *trie) {
+    close_if_open(trie->inotify_fd);
+    for (int dir = 0; dir < trie->dir_count; dir++) {
+        close_if_open(trie->dir_fds[dir]);
+    }
+    trie->inotify_fd = -1;
+    trie->dir_count = 0;
+    trie->count = 1;
+    trie->built = 0;
+    if (trie->nodes != NULL) {
+        memset(&trie->nodes[0], 0, sizeof(struct trie_node));
+    }
+}
+
+static int trie_build(struct path_trie *trie, const char *path_var) { // reads every PATH directory once, watching it first so nothing created meanwhile is missed
+    if (trie->built && path_var_matches(&trie->path_var, path_var)) {
+        return 0;
+    }
+    trie_reset(trie);
+    if (trie->nodes == NULL) {
+        trie->nodes = calloc(PATH_TRIE_INITIAL_SIZE, sizeof(struct trie_node));
+        if (trie->nodes == NULL) {
+            return -1;
+        }
+        trie->size = PATH_TRIE_INITIAL_SIZE;
+    }
+    path_var_remember(&trie->path_var, path_var);
+    trie->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    while (trie->dir_count < PATH_TRIE_MAX_DIRS) {
+        const char *separator = strchrnul(path_var, ':');
+        char dir_path[HASH_PATH_SIZE];
+        int length = snprintf(dir_path, HASH_PATH_SIZE, "%.*s", (int)(separator - path_var), path_var);
+        int dir = trie->dir_count;
+
+        trie->dir_fds[dir] = open(length > 0 ? dir_path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); // empty element: the current directory
+        if (trie->dir_fds[dir] >= 0) {
+            trie->watches[dir] = trie->inotify_fd >= 0 ? inotify_add_watch(trie->inotify_fd, length > 0 ? dir_path : ".",
+                                 IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) : -1;
+            trie->dir_count++;
+            trie_scan(trie, dir);
+        }
+        if (*separator == '\0') {
+            break;
+        }
+        path_var = separator + 1;
+    }
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        trie_set(trie, builtins[i].name, PATH_TRIE_BUILTINS, 1);
+    }
+    trie->built = 1;
+    return 0;
+}
+
+static void trie_refresh(struct path_trie *trie) { // applies what inotify reported since the last completion, non-blocking
+    char events[INOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while (trie->inotify_fd >= 0 && (length = read(trie->inotify_fd, events, sizeof(events))) > 0) {
+        const struct inotify_event *event;
+        for (char *cursor = events; cursor < events + length; cursor += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)cursor;
+            int dir = 0;
+            while (dir < trie->dir_count && trie->watches[dir] != event->wd) {
+                dir++;
+            }
+            if ((event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) != 0) { // events were lost or a directory went away: read everything again
+                trie->built = 0;
+            } else if (dir < trie->dir_count && event->len > 0) {
+                hash_forget(event->name); // the remembered path may be gone, or shadowed by a new file earlier on PATH
+                trie_set(trie, event->name, dir, (event->mask & (IN_DELETE | IN_MOVED_FROM)) == 0
+                         && trie_is_executable(trie->dir_fds[dir], event->name, DT_UNKNOWN));
+            }
+        }
+    }
+}
+
+static void trie_free(struct path_trie *trie) {
+    trie_reset(trie);
+    free(trie->nodes);
+    trie->nodes = NULL;
+}
+
+static size_t trie_extend(const struct path_trie *trie, long node, char *out, size_t size) { // characters every name below node shares, written to out
+    size_t length = 0;
+
+    while (trie->nodes[node].dirs == 0 && length + 1 < size) {
+        long next = -1;
+        for (uint32_t child = trie->nodes[node].child; child != 0; child = trie->nodes[child].sibling) {
+            if (trie->nodes[child].names == 0) {
+                continue;
+            }
+            if (next >= 0) { // two ways on
+                return length;
+            }
+            next = child;
+        }
+        if (next < 0) {
+            break;
+        }
+        out[length++] = trie->nodes[next].character;
+        node = next;
+    }
+    return length;
+}
+
+static void trie_list(const struct path_trie *trie, long node, char *name, size_t length, struct output_buffer *output, size_t columns, size_t *column, int *left) { // names below node in order, wrapped at columns
+    if (*left <= 0 || length + 1 >= HASH_NAME_SIZE) {
+        return;
+    }
+    if (trie->nodes[node].dirs != 0) {
+        if (*column > 0 && *column + length + 2 > columns) {
+            output_append(output, "\n", 1);
+            *column = 0;
+        }
+        output_append(output, name, length);
+        output_append(output, "  ", 2);
+        *column += length + 2;
+        (*left)--;
+    }
+    for (uint32_t child = trie->nodes[node].child; child != 0; child = trie->nodes[child].sibling) {
+        if (trie->nodes[child].names > 0) {
+            name[length] = trie->nodes[child].character;
+            trie_list(trie, child, name, length + 1, output, columns, column, left);
+        }
+    }
+}
+
+static int is_continuation(char c) { // UTF-8: a code point takes one column, its continuation bytes none
+    return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+static size_t text_columns(const char *text, size_t length) {
+    size_t columns = 0;
+    for (size_t i = 0; i < length; i++) {
+        columns += !is_continuation(text[i]);
+    }
+    return columns;
+}
+
+static size_t column_offset(const char *text, size_t length, size_t column) { // byte offset of a column
+    size_t i = 0;
+    while (i < length && column > 0) {
+        i++;
+        while (i < length && is_continuation(text[i])) {
+            i++;
+        }
+        column--;
+    }
+    return i;
+}
+
+static int editor_reserve(char **buffer, size_t *size, size_t needed) {
+    if (needed <= *size) {
+        return 0;
+    }
+    size_t grown = *size > 0 ? *size : EDITOR_INITIAL_SIZE;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    char *resized = realloc(*buffer, grown);
+    if (resized == NULL) {
+        return -1;
+    }
+    *buffer = resized;
+    *size = grown;
+    return 0;
+}
+
+static void editor_init(struct line_editor *editor, int fd, struct path_trie *trie) {
+    memset(editor, 0, sizeof(*editor));
+    editor->fd = fd;
+    editor->trie = trie;
+    editor->done = 1; // the first read starts an empty line
+    editor->columns = EDITOR_DEFAULT_COLUMNS;
+    tcgetattr(fd, &editor->cooked);
+}
+
+static void editor_free(struct line_editor *editor) {
+    free(editor->line);
+    free(editor->display);
+    free(editor->shown);
+    free(editor->saved);
+}
+
+static void editor_prompt(struct line_editor *editor, const char *text, size_t length) { // the prompt about to be flushed, only its last row matters
+    const char *row = memrchr(text, '\n', length);
+    row = row != NULL ? row + 1 : text;
+    editor->prompt_length = text + length - row < MESSAGE_BUFFER_SIZE ? (size_t)(text + length - row) : MESSAGE_BUFFER_SIZE;
+    memcpy(editor->prompt, row, editor->prompt_length);
+    editor->prompt_columns = text_columns(editor->prompt, editor->prompt_length);
+    editor->shown_length = 0; // the terminal holds nothing after a new prompt
+    editor->shown_cursor = 0;
+}
+
+static void editor_move(struct output_buffer *output, size_t from, size_t to) { // relative moves on the row of the prompt
+    char sequence[32] = "\x1b[";
+    int length;
+
+    if (from == to) {
+        return;
+    }
+    length = 2 + format_long(sequence + 2, from > to ? from - to : to - from);
+    sequence[length++] = from > to ? 'D' : 'C';
+    output_append(output, sequence, length);
+}
+
+static void editor_refresh(struct line_editor *editor, struct output_buffer *output) { // writes only the cells that differ from what the terminal shows
+    const char *text = editor->line;
+    size_t length = editor->length;
+    size_t cursor = editor->cursor;
+
+    if (editor->searching) { // (reverse-i-search)`text': match, the cursor after the text
+        const char *label = editor->search_failed ? EDITOR_FAILED_SEARCH_PROMPT : EDITOR_SEARCH_PROMPT;
+        size_t label_length = strlen(label);
+        if (editor_reserve(&editor->display, &editor->display_size, label_length + editor->search_length + 3 + editor->length + 1) < 0) {
+            return;
+        }
+        memcpy(editor->display, label, label_length);
+        memcpy(editor->display + label_length, editor->search, editor->search_length);
+        memcpy(editor->display + label_length + editor->search_length, "': ", 3);
+        memcpy(editor->display + label_length + editor->search_length + 3, editor->line, editor->length);
+        text = editor->display;
+        length = label_length + editor->search_length + 3 + editor->length;
+        cursor = label_length + editor->search_length;
+    }
+    size_t width = editor->columns > editor->prompt_columns + 1 ? editor->columns - editor->prompt_columns - 1 : 1; // the last column is left free: no wrap
+    size_t cursor_column = text_columns(text, cursor);
+    if (cursor_column < editor->scroll || cursor_column >= editor->scroll + width) { // jumps by half a row: typing at the end then redraws one cell, not the row
+        editor->scroll = cursor_column > width / 2 ? cursor_column - width / 2 : 0;
+    }
+    size_t start = column_offset(text, length, editor->scroll);
+    size_t end = start + column_offset(text + start, length - start, width);
+    const char *visible = text + start;
+    size_t visible_length = end - start;
+    size_t same = 0;
+
+    while (same < visible_length && same < editor->shown_length && visible[same] == editor->shown[same]) {
+        same++;
+    }
+    while (same > 0 && same < visible_length && is_continuation(visible[same])) { // back to the start of the code point
+        same--;
+    }
+    size_t same_column = text_columns(visible, same);
+    size_t shown_columns = text_columns(editor->shown, editor->shown_length);
+    size_t visible_columns = same_column + text_columns(visible + same, visible_length - same);
+    if (same < visible_length || visible_columns < shown_columns) {
+        editor_move(output, editor->shown_cursor, same_column);
+        output_append(output, visible + same, visible_length - same);
+        if (visible_columns < shown_columns) {
+            output_append(output, "\x1b[K", 3);
+        }
+        editor->shown_cursor = visible_columns;
+    }
+    editor_move(output, editor->shown_cursor, cursor_column - editor->scroll);
+    editor->shown_cursor = cursor_column - editor->scroll;
+    if (editor_reserve(&editor->shown, &editor->shown_size, visible_length + 1) == 0) {
+        memcpy(editor->shown, visible, visible_length);
+        editor->shown_length = visible_length;
+    }
+}
+
+static void editor_redraw(struct line_editor *editor, struct output_buffer *output) { // the whole row: prompt and line
+    output_append(output, "\r", 1);
+    output_append(output, editor->prompt, editor->prompt_length);
+    output_append(output, "\x1b[K", 3);
+    editor->shown_length = 0;
+    editor->shown_cursor = 0;
+}
+
+static void editor_set_line(struct line_editor *editor, const char *text, size_t length) {
+    if (editor_reserve(&editor->line, &editor->size, length + 1) < 0) {
+        return;
+    }
+    memmove(editor->line, text, length);
+    editor->line[length] = '\0';
+    editor->length = length;
+    editor->cursor = length;
+}
+
+static void editor_insert(struct line_editor *editor, const char *text, size_t length) {
+    if (editor_reserve(&editor->line, &editor->size, editor->length + length + 1) < 0) {
+        return;
+    }
+    memmove(editor->line + editor->cursor + length, editor->line + editor->cursor, editor->length - editor->cursor + 1);
+    memcpy(editor->line + editor->cursor, text, length);
+    editor->length += length;
+    editor->cursor += length;
+}
+
+static void editor_delete(struct line_editor *editor, size_t from, size_t to) { // bytes [from, to)
+    memmove(editor->line + from, editor->line + to, editor->length - to + 1);
+    editor->length -= to - from;
+    editor->cursor = from;
+}
+
+static size_t editor_previous(const struct line_editor *editor, size_t offset) { // start of the code point before offset
+    while (offset > 0 && is_continuation(editor->line[--offset])) {
+    }
+    return offset;
+}
+
+static size_t editor_next(const struct line_editor *editor, size_t offset) {
+    while (offset < editor->length && is_continuation(editor->line[++offset])) {
+    }
+    return offset;
+}
+
+static void editor_search(struct line_editor *editor, long from) { // newest entry at or before from containing the search text
+    long sequence = from;
+    const struct history_record *record = history_find_substring(&history, editor->search, &sequence);
+
+    editor->search_failed = record == NULL;
+    if (record != NULL) {
+        editor->search_match = sequence;
+        editor_set_line(editor, record->line, record->length);
+        editor->cursor = (const char *)memmem(record->line, record->length, editor->search, editor->search_length) - record->line;
+    }
+}
+
+static void editor_browse(struct line_editor *editor, long step) { // Up and Down: the line being typed is kept aside, then given back
+    const struct history_record *record;
+    long newest;
+
+    if (history.fd < 0) {
+        return;
+    }
+    history_sync(&history);
+    newest = history_newest(&history);
+    long target = editor->browse == 0 ? (step < 0 ? newest : 0) : editor->browse + step;
+    if (editor->browse != 0 && target > newest) {
+        editor->browse = 0;
+        editor_set_line(editor, editor->saved != NULL ? editor->saved : "", editor->saved != NULL ? strlen(editor->saved) : 0);
+        return;
+    }
+    if (target <= 0 || (record = history_entry(&history, target)) == NULL) {
+        return;
+    }
+    if (editor->browse == 0) {
+        free(editor->saved);
+        editor->saved = strndup(editor->line, editor->length);
+    }
+    editor->browse = target;
+    editor_set_line(editor, record->line, record->length);
+}
+
+static size_t complete_files(const char *word, size_t length, char *extension, size_t size, struct output_buffer *output, size_t columns, int list) { // file names in the directory of word; returns the number of matches
+    const char *slash = memrchr(word, '/', length);
+    const char *base = slash != NULL ? slash + 1 : word;
+    size_t base_length = word + length - base;
+    char dir_path[HASH_PATH_SIZE];
+    size_t matches = 0;
+    size_t common = 0;
+    size_t column = 0;
+    int is_dir = 0;
+    struct dirent *entry;
+
+    snprintf(dir_path, HASH_PATH_SIZE, "%.*s", slash == NULL ? 1 : slash == word ? 1 : (int)(slash - word), slash == NULL ? "." : word);
+    DIR *stream = opendir(dir_path);
+    if (stream == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(stream)) != NULL) {
+        const char *name = entry->d_name;
+        if (strncmp(name, base, base_length) != 0 || (name[0] == '.' && base_length == 0) || strncmp(name, ".", 2) == 0 || strncmp(name, "..", 3) == 0) {
+            continue;
+        }
+        if (list && matches < EDITOR_LIST_MAX) {
+            size_t name_length = strlen(name);
+            if (column > 0 && column + name_length + 2 > columns) {
+                output_append(output, "\n", 1);
+                column = 0;
+            }
+            output_append(output, name, name_length);
+            output_append(output, "  ", 2);
+            column += name_length + 2;
+        }
+        if (matches == 0) { // the first match is the common part so far
+            common = snprintf(extension, size, "%s", name + base_length);
+            common = common < size ? common : size - 1;
+            is_dir = entry->d_type == DT_DIR;
+        } else {
+            size_t same = 0;
+            while (same < common && extension[same] == name[base_length + same]) {
+                same++;
+            }
+            common = same;
+        }
+        matches++;
+    }
+    closedir(stream);
+    if (matches == 1 && common + 1 < size) { // unique: the word is finished
+        extension[common++] = is_dir ? '/' : ' ';
+    }
+    extension[common] = '\0';
+    return matches;
+}
+
+static void editor_complete(struct line_editor *editor, struct output_buffer *output) { // first Tab: the part every candidate shares, second Tab: the candidates
+    char extension[HASH_NAME_SIZE];
+    size_t start = editor->cursor;
+    size_t before;
+    size_t matches;
+    int list = editor->tabs >= 2;
+
+    while (start > 0 && !is_blank(editor->line[start - 1]) && !is_operator(editor->line[start - 1])) {
+        start--;
+    }
+    for (before = start; before > 0 && is_blank(editor->line[before - 1]); before--) {
+    }
+    const char *word = editor->line + start;
+    size_t length = editor->cursor - start;
+    int command_word = (before == 0 || strchr("|;&", editor->line[before - 1]) != NULL) && memchr(word, '/', length) == NULL;
+
+    long node = -1;
+    if (command_word) { // executables on PATH and builtins
+        if (trie_build(editor->trie, current_path_var()) < 0) {
+            return;
+        }
+        trie_refresh(editor->trie);
+        if (!editor->trie->built) { // inotify lost track
+            trie_build(editor->trie, current_path_var());
+        }
+        node = trie_walk(editor->trie, word, length, 0);
+        matches = node >= 0 ? editor->trie->nodes[node].names : 0;
+        if (node >= 0) {
+            size_t extended = trie_extend(editor->trie, node, extension, sizeof(extension) - 1);
+            if (matches == 1) {
+                extension[extended++] = ' ';
+            }
+            extension[extended] = '\0';
+        }
+    } else {
+        matches = complete_files(word, length, extension, sizeof(extension), output, editor->columns, 0);
+    }
+    if (matches > 0 && extension[0] != '\0') { // something to add, whatever the number of Tabs
+        editor_insert(editor, extension, strlen(extension));
+        editor->tabs = 0;
+        return;
+    }
+    if (!list) {
+        output_append(output, "\a", 1); // a second Tab lists the candidates
+        return;
+    }
+    output_append(output, "\n", 1);
+    if (node >= 0) {
+        char name[HASH_NAME_SIZE];
+        size_t column = 0;
+        int left = EDITOR_LIST_MAX;
+        length = length < HASH_NAME_SIZE ? length : HASH_NAME_SIZE - 1;
+        memcpy(name, word, length);
+        trie_list(editor->trie, node, name, length, output, editor->columns, &column, &left);
+    } else if (!command_word) {
+        complete_files(word, length, extension, sizeof(extension), output, editor->columns, 1);
+    }
+    char message[MESSAGE_BUFFER_SIZE];
+    int message_length = matches > EDITOR_LIST_MAX ? snprintf(message, MESSAGE_BUFFER_SIZE, "\n... %zu more", matches - EDITOR_LIST_MAX) : 0;
+    output_append(output, message, message_length);
+    output_append(output, "\n", 1);
+    editor_redraw(editor, output);
+}
+
+static void editor_key(struct line_editor *editor, int key, struct output_buffer *output) {
+    editor->tabs = key == '\t' ? editor->tabs + 1 : 0;
+    if (editor->searching) {
+        if (key == 18) { // Ctrl-R again: an older match
+            editor_search(editor, editor->search_match - 1);
+            return;
+        }
+        if ((key >= ' ' && key < 127) || (key >= 128 && key < 256)) {
+            if (editor->search_length + 1 < HASH_NAME_SIZE) {
+                editor->search[editor->search_length++] = key;
+                editor->search[editor->search_length] = '\0';
+                editor_search(editor, editor->search_match);
+            }
+            return;
+        }
+        if (key == 127 || key == 8) {
+            editor->search_length = editor->search_length > 0 ? editor->search_length - 1 : 0;
+            editor->search[editor->search_length] = '\0';
+            editor_search(editor, history_newest(&history));
+            return;
+        }
+        editor->searching = 0; // any other key keeps the match and acts on it
+        if (key == 7 || key == 3) { // Ctrl-G and Ctrl-C: back to the line being typed
+            editor_set_line(editor, editor->saved != NULL ? editor->saved : "", editor->saved != NULL ? strlen(editor->saved) : 0);
+            return;
+        }
+        if (key == KEY_ESCAPE) {
+            return;
+        }
+    }
+    switch (key) {
+    case '\r':
+    case '\n':
+        editor->done = 1;
+        break;
+    case 4: // Ctrl-D: end of input on an empty line
+        if (editor->length == 0) {
+            editor->done = -1;
+        } else if (editor->cursor < editor->length) {
+            editor_delete(editor, editor->cursor, editor_next(editor, editor->cursor));
+        }
+        break;
+    case 3: // Ctrl-C: the line is dropped
+        editor->cursor = editor->length;
+        editor_refresh(editor, output);
+        output_append(output, "^C\n", 3);
+        editor_set_line(editor, "", 0);
+        editor->browse = 0;
+        editor_redraw(editor, output);
+        break;
+    case 127:
+    case 8:
+        if (editor->cursor > 0) {
+            editor_delete(editor, editor_previous(editor, editor->cursor), editor->cursor);
+        }
+        break;
+    case KEY_DELETE:
+        if (editor->cursor < editor->length) {
+            editor_delete(editor, editor->cursor, editor_next(editor, editor->cursor));
+        }
+        break;
+    case KEY_LEFT:
+    case 2:
+        editor->cursor = editor_previous(editor, editor->cursor);
+        break;
+    case KEY_RIGHT:
+    case 6:
+        editor->cursor = editor_next(editor, editor->cursor);
+        break;
+    case KEY_HOME:
+    case 1:
+        editor->cursor = 0;
+        break;
+    case KEY_END:
+    case 5:
+        editor->cursor = editor->length;
+        break;
+    case 11: // Ctrl-K
+        editor->line[editor->cursor] = '\0';
+        editor->length = editor->cursor;
+        break;
+    case 21: // Ctrl-U
+        editor_delete(editor, 0, editor->cursor);
+        break;
+    case 23: { // Ctrl-W: the word before the cursor
+        size_t start = editor->cursor;
+        while (start > 0 && is_blank(editor->line[start - 1])) {
+            start--;
+        }
+        while (start > 0 && !is_blank(editor->line[start - 1])) {
+            start--;
+        }
+        editor_delete(editor, start, editor->cursor);
+        break;
+    }
+    case KEY_UP:
+    case 16:
+        editor_browse(editor, -1);
+        break;
+    case KEY_DOWN:
+    case 14:
+        editor_browse(editor, 1);
+        break;
+    case 18: // Ctrl-R: reverse incremental search
+        if (history.fd >= 0) {
+            history_sync(&history);
+            free(editor->saved);
+            editor->saved = strndup(editor->line, editor->length);
+            editor->searching = 1;
+            editor->search_failed = 0;
+            editor->search_length = 0;
+            editor->search[0] = '\0';
+            editor->search_match = history_newest(&history);
+        }
+        break;
+    case 12: // Ctrl-L
+        output_append(output, "\x1b[H\x1b[2J", 7);
+        editor_redraw(editor, output);
+        break;
+    case '\t':
+        editor_complete(editor, output);
+        break;
+    default:
+        if ((key >= ' ' && key < 127) || (key >= 128 && key < 256)) {
+            char character = key;
+            editor_insert(editor, &character, 1);
+        }
+        break;
+    }
+}
+
+static size_t editor_decode(const char *bytes, size_t length, int *key) { // one key from the terminal, returns the bytes used, 0 when a sequence is cut
+    if (bytes[0] != '\x1b') {
+        *key = (unsigned char)bytes[0];
+        return 1;
+    }
+    if (length == 1 || (bytes[1] != '[' && bytes[1] != 'O')) { // a lone Escape
+        *key = KEY_ESCAPE;
+        return 1;
+    }
+    size_t end = 2;
+    while (end < length && !(bytes[end] >= 0x40 && bytes[end] <= 0x7e)) { // parameters up to the final byte
+        end++;
+    }
+    if (end == length) {
+        return 0;
+    }
+    switch (bytes[end]) {
+    case 'A': *key = KEY_UP; break;
+    case 'B': *key = KEY_DOWN; break;
+    case 'C': *key = KEY_RIGHT; break;
+    case 'D': *key = KEY_LEFT; break;
+    case 'H': *key = KEY_HOME; break;
+    case 'F': *key = KEY_END; break;
+    case '~': { // ESC [ n ~
+        int number = atoi(bytes + 2);
+        *key = number == 3 ? KEY_DELETE : number == 1 || number == 7 ? KEY_HOME : number == 4 || number == 8 ? KEY_END : KEY_NONE;
+        break;
+    }
+    default: *key = KEY_NONE; break;
+    }
+    return end + 1;
+}
+
+static size_t editor_feed(struct line_editor *editor, const char *bytes, size_t length, struct output_buffer *output) { // keys until the line is done; returns the bytes used
+    size_t used = 0;
+    int key;
+
+    while (used < length && editor->done == 0) {
+        size_t size = editor_decode(bytes + used, length - used, &key);
+        if (size == 0) {
+            break;
+        }
+        used += size;
+        editor_key(editor, key, output);
+    }
+    if (editor->done == 1) { // the cursor leaves the end of the line
+        editor->searching = 0;
+        editor->cursor = editor->length;
+    }
+    if (editor->done >= 0) {
+        editor_refresh(editor, output); // once per chunk: a paste is drawn in one go
+    }
+    return used;
+}
+
+static void editor_suspend(struct line_editor *editor, struct output_buffer *output) { // a job report is about to be printed: the row is cleared, the line kept
+    output_append(output, "\r\x1b[K", 4);
+    editor->shown_length = 0;
+    editor->shown_cursor = 0;
+}
+
+static enum line_status editor_read_line(struct line_editor *editor, char **line) { // LINE_INTERRUPTED keeps the line being edited for the next call
+    struct termios raw = editor->cooked;
+    struct winsize size;
+    enum line_status status = LINE_OK;
+
+    if (editor->done != 0) { // a new line
+        editor_set_line(editor, "", 0);
+        editor->browse = 0;
+        editor->searching = 0;
+        editor->scroll = 0;
+        editor->pending_length = 0;
+        editor->done = 0;
+    }
+    if (ioctl(editor->fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+        editor->columns = size.ws_col;
+    }
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // Ctrl-C and Ctrl-Z are keys while editing, the jobs get the terminal back in cooked mode
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(editor->fd, TCSADRAIN, &raw); // typeahead is kept
+    editor_refresh(editor, &shell_output);
+    shell_flush();
+    while (editor->done == 0) {
+        if (!event_wait_input(editor->fd, 1)) {
+            if (events.resized && ioctl(editor->fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) { // redrawn at the new width
+                events.resized = 0;
+                editor->columns = size.ws_col;
+                editor_refresh(editor, &shell_output);
+                shell_flush();
+                continue;
+            }
+            events.resized = 0;
+            if (event_take_interrupt()) { // SIGINT from kill: same as the Ctrl-C key, which raw mode delivers as a byte
+                editor_feed(editor, "\x03", 1, &shell_output);
+                shell_flush();
+                continue;
+            }
+            status = LINE_INTERRUPTED;
+            break;
+        }
+        ssize_t count = read(editor->fd, editor->pending + editor->pending_length, EDITOR_READ_SIZE - editor->pending_length);
+        if (count < 0 && errno == EINTR) {
+            status = LINE_INTERRUPTED;
+            break;
+        }
+        if (count <= 0) {
+            editor->done = -1;
+            break;
+        }
+        editor->pending_length += count;
+        size_t used = editor_feed(editor, editor->pending, editor->pending_length, &shell_output);
+        memmove(editor->pending, editor->pending + used, editor->pending_length - used);
+        editor->pending_length -= used;
+        if (editor->pending_length == EDITOR_READ_SIZE) { // not a sequence the editor knows
+            editor->pending_length = 0;
+        }
+        shell_flush(); // one write per chunk of input
+    }
+    if (editor->done == 1) {
+        shell_write(STDOUT_FILENO, "\n", 1);
+        shell_flush();
+        editor->shown_length = 0;
+        editor->shown_cursor = 0;
+    }
+    tcsetattr(editor->fd, TCSADRAIN, &editor->cooked);
+    *line = editor->line;
+    return editor->done == -1 ? LINE_EOF : status;
+}
+
+static struct prompt_template compile_prompt(const char *format) { // parsed once, literal runs point into format
+    struct prompt_template template;
+    size_t format_length = strlen(format);
+
+    template.parts = malloc(sizeof(struct prompt_part) * (format_length + 1));
+    template.count = 0;
+    if (template.parts == NULL) {
+        write(STDERR_FILENO, OUTOFMEMORY_MSG, OUTOFMEMORY_MSG_LENGTH);
+        exit(1);
+    }
+    for (const char *cursor = format; *cursor != '\0'; cursor++) {
+        enum prompt_op op = PROMPT_TEXT;
+        if (*cursor == '%' && cursor[1] != '\0') {
+            cursor++;
+            switch (*cursor) {
+            case 'e': op = PROMPT_STATUS; break;
+            case 'x': op = PROMPT_EXIT_CODE; break;
+            case 'g': op = PROMPT_SIGNAL; break;
+            case 't': op = PROMPT_TIME_MS; break;
+            case 'T': op = PROMPT_TIME_US; break;
+            case 'u': op = PROMPT_USER_MS; break;
+            case 's': op = PROMPT_SYSTEM_MS; break;
+            case 'm': op = PROMPT_MAXRSS; break;
+            case 'f': op = PROMPT_MAJOR_FAULTS; break;
+            case 'F': op = PROMPT_MINOR_FAULTS; break;
+            case 'c': op = PROMPT_SWITCHES; break;
+            case 'w': op = PROMPT_CWD; break;
+            case 'j': op = PROMPT_JOBS; break;
+            case 'C': op = PROMPT_CGROUP_CPU_MS; break;
+            case 'P': op = PROMPT_CGROUP_PEAK; break;
+            case '%': break; // %% is one %
+            default: cursor--; break; // an unknown escape is copied as written, % included
+            }
+        }
+        struct prompt_part *last = template.count > 0 ? &template.parts[template.count - 1] : NULL;
+        if (op == PROMPT_TEXT && last != NULL && last->op == PROMPT_TEXT && last->text + last->length == cursor) {
+            last->length++;
+            continue;
+        }
+        template.parts[template.count].op = op;
+        template.parts[template.count].text = cursor;
+        template.parts[template.count].length = 1;
+        template.count++;
+    }
+    return template;
+}
+
+static void refresh_prompt_cwd(void) { // getcwd() only after a cd, $HOME shown as ~
+    char *cwd = getcwd(NULL, 0);
+    const char *home = getenv("HOME");
+
+    free(prompt_cwd);
+    prompt_cwd = cwd != NULL ? cwd : strdup("?");
+    prompt_cwd_length = prompt_cwd != NULL ? strlen(prompt_cwd) : 0;
+    size_t home_length = home != NULL ? strlen(home) : 0;
+    if (home_length > 1 && strncmp(prompt_cwd, home, home_length) == 0 && (prompt_cwd[home_length] == '/' || prompt_cwd[home_length] == '\0')) {
+        prompt_cwd[0] = '~';
+        memmove(prompt_cwd + 1, prompt_cwd + home_length, prompt_cwd_length - home_length + 1);
+        prompt_cwd_length -= home_length - 1;
+    }
+    prompt_cwd_changed = 0;
+}
+
+static void render_prompt(const struct prompt_template *template, struct output_buffer *output, int child_status, long time_ns, const struct rusage *usage) {
+    char number[24];
+
+    for (int i = 0; i < template->count; i++) {
+        const struct prompt_part *part = &template->parts[i];
+        long value;
+        switch (part->op) {
+        case PROMPT_TEXT:
+            output_append(output, part->text, part->length);
+            continue;
+        case PROMPT_STATUS: // status block as in the historical prompt, or the limit that stopped the command
+            if (limit_hit != LIMIT_NONE) {
+                output_append(output, limit_names[limit_hit], strlen(limit_names[limit_hit]));
+                output_append(output, ":", 1);
+            } else if (memo_hit) { // replayed from the result cache
+                output_append(output, "memo:", 5);
+            } else {
+                output_append(output, WIFSIGNALED(child_status) ? "sign:" : "exit:", 5);
+            }
+            value = WIFSIGNALED(child_status) ? WTERMSIG(child_status) : WEXITSTATUS(child_status);
+            break;
+        case PROMPT_EXIT_CODE: value = WIFSIGNALED(child_status) ? 128 + WTERMSIG(child_status) : WEXITSTATUS(child_status); break;
+        case PROMPT_SIGNAL:
+            if (!WIFSIGNALED(child_status)) {
+                continue;
+            }
+            value = WTERMSIG(child_status);
+            break;
+        case PROMPT_TIME_MS: value = time_ns / 1000000; break;
+        case PROMPT_TIME_US: value = time_ns / 1000; break;
+        case PROMPT_USER_MS: value = timeval_us(&usage->ru_utime) / 1000; break;
+        case PROMPT_SYSTEM_MS: value = timeval_us(&usage->ru_stime) / 1000; break;
+        case PROMPT_MAXRSS: value = usage->ru_maxrss; break;
+        case PROMPT_MAJOR_FAULTS: value = usage->ru_majflt; break;
+        case PROMPT_MINOR_FAULTS: value = usage->ru_minflt; break;
+        case PROMPT_SWITCHES: value = usage->ru_nvcsw + usage->ru_nivcsw; break;
+        case PROMPT_CWD:
+            if (prompt_cwd_changed) {
+                refresh_prompt_cwd();
+            }
+            output_append(output, prompt_cwd, prompt_cwd_length);
+            continue;
+        case PROMPT_JOBS: value = running_jobs; break;
+        case PROMPT_CGROUP_CPU_MS:
+        case PROMPT_CGROUP_PEAK:
+            value = part->op == PROMPT_CGROUP_CPU_MS ? last_cgroup_usage.cpu_us : last_cgroup_usage.memory_peak;
+            if (value < 0) { // not placed in a cgroup, or no memory controller
+                output_append(output, "-", 1);
+                continue;
+            }
+            value /= part->op == PROMPT_CGROUP_CPU_MS ? 1000 : 1024;
+            break;
+        default:
+            continue;
+        }
+        output_append(output, number, format_long(number, value));
+    }
+}
+
+static int daemon_serve(const char *path) { // accept loop; returns only in a forked child whose stdin, stdout and stderr are the connection
+    struct sockaddr_un address;
+    struct stat file_info;
+    sigset_t child_signal;
+    sigset_t saved_mask;
+    int listener;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        write(STDERR_FILENO, DAEMON_MSG, DAEMON_MSG_LENGTH);
+        exit(1);
+    }
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    if (lstat(path, &file_info) == 0) { // only the socket of a daemon that is gone is replaced, never a file or a running daemon
+        int probe = S_ISSOCK(file_info.st_mode) ? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+        int in_use = probe < 0 || connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        close_if_open(probe);
+        if (in_use) {
+            write(STDERR_FILENO, DAEMON_IN_USE_MSG, DAEMON_IN_USE_MSG_LENGTH);
+            exit(1);
+        }
+        unlink(path);
+    }
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(077); // only the owner may connect
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, DAEMON_BACKLOG) < 0) {
+        write(STDERR_FILENO, DAEMON_MSG, DAEMON_MSG_LENGTH);
+        exit(1);
+    }
+    umask(mask);
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_signal, &saved_mask);
+    int child_fd = signalfd(-1, &child_signal, SFD_NONBLOCK | SFD_CLOEXEC); // ended sessions are reaped as they end, even while no client connects
+
+    while (1) {
+        struct pollfd ready[2] = { { .fd = listener, .events = POLLIN }, { .fd = child_fd, .events = POLLIN } };
+        if (poll(ready, child_fd >= 0 ? 2 : 1, -1) < 0) {
+            continue;
+        }
+        if (ready[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(child_fd, &info, sizeof(info)) > 0) { // one read may stand for several sessions
+            }
+            while (waitpid(-1, NULL, WNOHANG) > 0) {
+            }
+        }
+        if (!(ready[0].revents & POLLIN)) {
+            continue;
+        }
+        int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) { // the listener stays readable: wait before trying again
+                poll(NULL, 0, DAEMON_RETRY_MS);
+            }
+            continue;
+        }
+        pid_t pid = fork(); // the session starts from the daemon as it was before any command, hash and arenas fill per session
+        if (pid == 0) {
+            close(listener);
+            close_if_open(child_fd);
+            sigprocmask(SIG_SETMASK, &saved_mask, NULL); // the session's event loop blocks its own signals
+            dup2(connection, STDIN_FILENO);
+            dup2(connection, STDOUT_FILENO);
+            dup2(connection, STDERR_FILENO);
+            close(connection);
+            return 0;
+        }
+        close(connection);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char *input_buffer;
+    char error_message[MESSAGE_BUFFER_SIZE];
+    struct and_or *list;
+
+    struct line_reader reader;
+    struct line_editor editor;
+    enum line_status line_status;
+    int child_status = 0;
+    int interactive;
+    long command_count = 0;
+
+    int last_status = 0;
+    long last_time_ns = 0;
+    struct rusage last_usage;
+    const char *prompt_format;
+    struct prompt_template prompt_template;
+    int first_prompt = 1;
+
+    struct timespec time_start;
+    struct timespec time_end;
+    struct timespec session_start;
+
+    int quiet = 0;
+    char *command_string = NULL;
+    int first_argument = 1;
+    while (first_argument < argc) { // options before the script or the daemon socket
+        if (strncmp(argv[first_argument], QUIET_FLAG, 3) == 0) {
+            quiet = 1;
+        } else if (strncmp(argv[first_argument], COMMAND_FLAG, 3) == 0 && first_argument + 1 < argc) {
+            command_string = argv[++first_argument];
+            quiet = 1;
+        } else {
+            break;
+        }
+        first_argument++;
+    }
+    argc -= first_argument - 1;
+    argv += first_argument - 1;
+
+    if (command_string != NULL) { // enseash -c "line": batch mode over the argument, written in place like a mapped script
+        line_reader_init(&reader, -1);
+        reader.map = command_string;
+        reader.map_size = strlen(command_string);
+        interactive = 0;
+    } else if (argc > 2 && strncmp(argv[1], DAEMON_FLAG, 3) == 0) { // enseash -d socket: one forked session per connection
+        daemon_serve(argv[2]);
+        line_reader_init(&reader, STDIN_FILENO);
+        reader.waits_in_loop = 1;
+        interactive = 1; // prompts tell the client when a command is done
+    } else if (argc > 1) { // enseash script.sh: batch mode over the mapped file
+        if (line_reader_open_script(&reader, argv[1]) < 0) {
+            write(STDERR_FILENO, SCRIPTFILE_MSG, SCRIPTFILE_MSG_LENGTH);
+            return 1;
+        }
+        interactive = 0;
+    } else {
+        line_reader_init(&reader, STDIN_FILENO);
+        reader.waits_in_loop = 1;
+        interactive = isatty(STDIN_FILENO); // piped or redirected stdin is a batch too
+    }
+    terminal_control = interactive && isatty(STDIN_FILENO); // not for a daemon session
+    const char *terminal = getenv("TERM");
+    int editing = terminal_control && (terminal == NULL || strncmp(terminal, "dumb", 5) != 0); // raw-mode line editor, cooked reads otherwise
+    if (editing) {
+        editor_init(&editor, STDIN_FILENO, &path_trie);
+    }
+    history_setup(interactive);
+    clock_gettime(CLOCK_MONOTONIC, &session_start);
+
+    const char *snapshot_path = getenv(SNAPSHOT_ENV);
+    if (snapshot_path != NULL && snapshot_path[0] != '\0' && snapshot_load(snapshot_path) < 0) { // the shell starts without it
+        write(STDERR_FILENO, SNAPSHOT_MSG, SNAPSHOT_MSG_LENGTH);
+    }
+    enum spawn_engine engine = snapshot.header != NULL ? snapshot.header->engine : SPAWN_ENGINE_POSIX; // the environment overrides the snapshot
+    const char *engine_name = getenv(SPAWN_ENGINE_ENV);
+    if (engine_name != NULL) {
+        int fork_engine = strncmp(engine_name, SPAWN_ENGINE_FORK_NAME, SPAWN_ENGINE_FORK_NAME_LENGTH + 1) == 0;
+        engine = fork_engine ? SPAWN_ENGINE_FORK : SPAWN_ENGINE_POSIX;
+    }
+    shell_engine = engine;
+
+    const char *cgroup_path = getenv(CGROUP_ENV);
+    if (cgroup_path != NULL) {
+        cgroup_open(cgroup_path);
+    }
+    prompt_format = getenv(PROMPT_FORMAT_ENV);
+    if (prompt_format == NULL) {
+        prompt_format = snapshot.prompt_format;
+    }
+    if (prompt_format == NULL) {
+        prompt_format = cgroup_parent_fd >= 0 ? CGROUP_PROMPT_FORMAT_DEFAULT : PROMPT_FORMAT_DEFAULT;
+    }
+    prompt_template = compile_prompt(prompt_format); // the format is parsed once, not at every prompt
+    const char *stats_log_path = getenv(STATS_LOG_ENV);
+    if (stats_log_path != NULL) {
+        stats_log_fd = open(stats_log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    const char *trace_path = getenv(TRACE_ENV);
+    if (trace_path != NULL && trace_path[0] != '\0') {
+        trace_start();
+    }
+    memset(&last_usage, 0, sizeof(last_usage));
+
+    signal(SIGTTOU, SIG_IGN); // lets the shell call tcsetpgrp() while it is not the foreground group
+
+    event_loop_init(); // Ctrl-C at the prompt no longer ends the shell, it reaches the foreground job only
+
+    if (!quiet) {
+        shell_write(STDOUT_FILENO, WELCOME_MESSAGE, strlen(WELCOME_MESSAGE)); // Welcome message, sent with the first prompt
+    }
+
+    while (1) {
+        arena_reset(&line_arena); // O(1): everything built for the previous line is dropped at once
+        reap_jobs();
+        report_finished_jobs();
+
+        if (!interactive) { // batch mode: no prompt to render
+        } else if (first_prompt) { // First condition made to display the prefix of the first prompt
+            shell_write(STDOUT_FILENO, PROMPT_DEFAULT, strlen(PROMPT_DEFAULT));
+        } else { // Second condition made to display the status, timing and resource usage of the last command
+            render_prompt(&prompt_template, &shell_output, last_status, last_time_ns, &last_usage);
+        }
+        if (editing) { // flushed by the editor once the terminal is in raw mode: a Ctrl-D typed ahead is not taken as a cooked end of file
+            editor_prompt(&editor, shell_output.data, shell_output.length);
+        } else {
+            shell_flush(); // job reports and the prompt leave in one writev()
+        }
+
+        int job_finished = 0;
+        int interrupted = 0;
+        int64_t read_start = trace_begin();
+        do { // read one line of user input, the event loop wakes up the read when a job finishes or Ctrl-C reaches the shell
+            line_status = editing ? editor_read_line(&editor, &input_buffer) : read_line(&reader, &input_buffer);
+        } while (line_status == LINE_INTERRUPTED && !(interrupted = event_take_interrupt()) && !(job_finished = reap_jobs() > 0 && interactive));
+        if (line_status == LINE_OK) {
+            trace_end(TRACE_READ, read_start, 0, 0, input_buffer);
+        }
+
+        if (job_finished && editing) { // the line being edited is kept and redrawn under the report
+            editor_suspend(&editor, &shell_output);
+            continue;
+        }
+        if (job_finished || (interrupted && interactive)) { // a background job finished, or Ctrl-C dropped the line: redraw the prompt
+            shell_write(STDOUT_FILENO, "\n", 1);
+            continue;
+        }
+        if (line_status == LINE_EOF || interrupted) { // a batch ends on SIGINT, as sh does // handle end-of-file or read error
+            if (!quiet) {
+                shell_write(STDOUT_FILENO, GOODBYE_MESSAGE, strlen(GOODBYE_MESSAGE));
+            }
+            break;
+        }
+        if (input_buffer[0] == '!' && input_buffer[1] != '\0' && input_buffer[1] != ' ' && history.fd >= 0) { // history expansion, shown before it runs
+            char *expanded = history_expand(input_buffer);
+            if (expanded == NULL) {
+                shell_write(STDERR_FILENO, HISTORY_EVENT_MSG, HISTORY_EVENT_MSG_LENGTH);
+                continue;
+            }
+            shell_write(STDOUT_FILENO, expanded, strlen(expanded));
+            shell_write(STDOUT_FILENO, "\n", 1);
+            input_buffer = expanded;
+        }
+        int64_t parse_start = trace_begin();
+        if (parse_line(&line_arena, input_buffer, &list, error_message) < 0) { // syntax error: status 2, as in sh, for $? and the prompt
+            shell_write(STDERR_FILENO, error_message, strnlen(error_message, MESSAGE_BUFFER_SIZE));
+            last_status = W_EXITCODE(2, 0);
+            last_wait_status = last_status;
+            last_time_ns = 0;
+            memset(&last_usage, 0, sizeof(last_usage));
+            limit_hit = LIMIT_NONE;
+            memo_hit = 0;
+            first_prompt = 0;
+            if (command_string != NULL) { // sh -c stops there
+                break;
+            }
+            continue;
+        }
+        trace_end(TRACE_PARSE, parse_start, 0, 0, NULL);
+        if (list == NULL) { // empty line or comment
+            continue;
+        }
+
+        command_count++;
+        clock_gettime(CLOCK_MONOTONIC, &time_start); // start timing the command execution
+        int64_t line_start = trace_begin();
+        int ran_foreground = run_list(list, engine, &child_status, &last_usage);
+        trace_end(TRACE_LINE, line_start, 0, child_status, input_buffer);
+        if (exit_requested) { // the exit builtin ran: its status becomes the shell's
+            last_status = child_status;
+            history_append(&history, input_buffer, child_status, 0);
+            if (!quiet) {
+                shell_write(STDOUT_FILENO, GOODBYE_MESSAGE, strlen(GOODBYE_MESSAGE));
+            }
+            break;
+        }
+        if (!ran_foreground) { // background jobs only: keep the previous status in the prompt
+            history_append(&history, input_buffer, 0, 0);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &time_end); // end timing the command execution
+
+        last_time_ns = elapsed_ns(&time_start, &time_end); // %t shows milliseconds, %T microseconds
+        last_status = child_status; // WIFEXITED / WIFSIGNALED are decoded by render_prompt()
+        first_prompt = 0;
+        log_command_stats(input_buffer, child_status, elapsed_ns(&time_start, &time_end), &last_usage, 0, limit_hit, &last_cgroup_usage);
+        history_append(&history, input_buffer, child_status, last_time_ns / 1000000);
+    }
+
+    if (!interactive && !quiet) { // aggregate throughput of the batch, on stderr to keep stdout for the commands
+        char message[MESSAGE_BUFFER_SIZE];
+        clock_gettime(CLOCK_MONOTONIC, &time_end);
+        long session_ns = elapsed_ns(&session_start, &time_end);
+        int length = snprintf(message, MESSAGE_BUFFER_SIZE, "enseash: %ld commands in %ldms (%ld commands/s), arena peak %zu bytes\n",
+                              command_count, session_ns / 1000000, session_ns > 0 ? command_count * 1000000000L / session_ns : 0, line_arena.peak);
+        shell_write(STDERR_FILENO, message, length);
+    }
+    shell_flush();
+    free(prompt_template.parts);
+    if (editing) {
+        editor_free(&editor);
+    }
+    trie_free(&path_trie);
+    expand_free();
+    free(memo.key.text);
+    if (trace_path != NULL && trace_path[0] != '\0') {
+        size_t length = strlen(trace_path);
+        int binary = length >= strlen(TRACE_BINARY_SUFFIX) && strncmp(trace_path + length - strlen(TRACE_BINARY_SUFFIX), TRACE_BINARY_SUFFIX, strlen(TRACE_BINARY_SUFFIX)) == 0;
+        trace.enabled = 0;
+        if (trace_dump(trace_path, binary) < 0) {
+            builtin_error("trace", strerror(errno));
+            shell_flush();
+        }
+    }
+    if (trace.events != NULL) {
+        trace.enabled = 0;
+        munmap(trace.events, sizeof(struct trace_event) * TRACE_RING_SIZE);
+    }
+    history_close(&history);
+    free(reader.buffer);
+    if (snapshot.header != NULL) {
+        munmap((void *)snapshot.header, snapshot.size);
+    }
+    if (command_string != NULL || exit_requested) { // the status of the last command as sh -c returns it, or that of exit
+        return WIFSIGNALED(last_status) ? 128 + WTERMSIG(last_status) : WEXITSTATUS(last_status);
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,1473 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <regex.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <glob.h>
+
+#define main enseash_main // the shell itself, for the drivers that time its parser, prompt, history, completion and globbing from inside
+#include "../Question7.c"
+#undef main
+
+#define TRANSCRIPT_SIZE (1024 * 1024)
+#define HARNESS_MESSAGE_SIZE 1024 // MESSAGE_BUFFER_SIZE is the shell's
+#define LINE_SIZE 512
+#define MAX_LINES 8
+#define MAX_EXPECTED 4
+#define PROMPT_TIMEOUT_MS 5000 // longest wait for the next prompt
+#define EXIT_TIMEOUT_MS 5000   // longest wait for the shell to exit once its input is done
+#define PROMPT_PATTERN "% $"   // every stage ends its prompt this way
+#define TEMP_MARKER "@T@"      // replaced by the scratch directory in test lines
+#define SHELL_MARKER "@S@"     // replaced by the shell under test
+#define HARNESS_MARKER "@H@"   // replaced by this program, e.g. as the client of a daemon
+
+#define BENCH_DEFAULT_COMMANDS 500
+#define BENCH_BATCH_COMMANDS 5000
+#define BENCH_DEFAULT_TOLERANCE 0.25
+#define BENCH_COMMAND "/bin/true"
+#define BENCH_DEFAULT_ROUNDS 3 // every shell is measured once per round, the median round is kept
+#define BENCH_COLD_STARTS 200 // enseash -c runs, interleaved with as many direct runs of the command
+
+#define SPAWNBENCH_DEFAULT_ITERATIONS 1000
+
+#define BENCH_DEFAULT_RUNS 100
+#define BENCH_DEFAULT_WARMUPS 5
+#define BENCH_USAGE_MSG "usage: bench [-n runs] [-w warmups] [-c] command [args...]\n"
+#define BENCH_USAGE_MSG_LENGTH 59
+
+#define PARSEBENCH_DEFAULT_RUNS 100000
+#define PARSEBENCH_USAGE_MSG "usage: parsebench [-n runs] command line\n"
+#define PARSEBENCH_USAGE_MSG_LENGTH 41
+
+#define PROMPTBENCH_DEFAULT_RUNS 1000000
+
+#define HISTORYBENCH_DEFAULT_ENTRIES 2000000
+#define HISTORYBENCH_SIZE (256L * 1024 * 1024)
+#define HISTORYBENCH_SEARCHES 1000
+
+#define COMPLETEBENCH_DEFAULT_NAMES 50000
+#define COMPLETEBENCH_KEYS 100000
+
+#define GLOBBENCH_DEFAULT_FILES 100000
+#define GLOBBENCH_RUNS 200
+#define GLOBBENCH_WORDS 1000000
+
+#define PARSEFUZZ_DEFAULT_LINES 1000000
+#define PARSEFUZZ_LINE_SIZE 128
+
+#define USAGE_MSG "usage: harness shell... | harness --bench [-n commands] [-r rounds] [--json file] [--baseline file] [--tolerance fraction] shell... | harness --connect socket | harness --driver name [arguments...]\n"
+
+#define STAGE(n) (1u << (n))
+#define STAGES(first, last) ((STAGE((last) + 1) - 1) & ~(STAGE(first) - 1))
+
+enum session_mode {
+    MODE_PTY = 1,  // stdin, stdout and stderr on a terminal, as typed by a user
+    MODE_PIPE = 2  // stdin and stdout on pipes, as in a script
+};
+
+enum session_end {
+    END_NONE, // the lines end the session themselves (exit)
+    END_EOF   // Ctrl-D on the terminal, or the pipe closed
+};
+
+struct test_case {
+    const char *name;
+    unsigned int stages;        // bit n: Questionn.c
+    unsigned int modes;
+    int prompts;                // checks prompts: skipped for Question7 over pipes, which prints none in batch mode
+    const char *terminal;       // TERM for the session, dumb when NULL
+    enum session_end end;
+    const char *lines[MAX_LINES];
+    const char *expected[MAX_EXPECTED]; // extended regular expressions the transcript must match
+};
+
+struct session {
+    pid_t pid;
+    int input_fd;
+    int output_fd;
+    char *transcript;
+    size_t length;
+    int status;
+};
+
+static const struct test_case test_cases[] = {
+    { "welcome", STAGES(1, 7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "exit" }, { "^Welcome to ENSEA Tiny Shell\\.\r?\nType 'exit' to quit\\.\r?\n" } },
+    { "first-prompt", STAGES(1, 7), MODE_PTY | MODE_PIPE, 1, NULL, END_NONE,
+      { "exit" }, { "quit\\.\r?\nenseash % " } },
+    { "exit-message", STAGES(3, 7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "exit" }, { "Bye bye\\.\\.\\.\r?\n$" } },
+    { "eof", STAGES(1, 7), MODE_PTY | MODE_PIPE, 0, NULL, END_EOF,
+      { NULL }, { "^Welcome to ENSEA Tiny Shell\\." } },
+    { "eof-message", STAGES(3, 7), MODE_PTY | MODE_PIPE, 0, NULL, END_EOF,
+      { NULL }, { "Bye bye\\.\\.\\.\r?\n$" } },
+    { "run-command", STAGES(2, 7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "@T@/hello", "exit" }, { "hello from script\r?\n" } },
+    { "exit-status", STAGES(4, 7), MODE_PTY | MODE_PIPE, 1, NULL, END_NONE,
+      { "@T@/fail", "exit" }, { "enseash \\[exit:3(\\|[0-9]+ms)?\\] % " } },
+    { "signal", STAGES(4, 7), MODE_PTY | MODE_PIPE, 1, NULL, END_NONE,
+      { "@T@/killself", "exit" }, { "enseash \\[sign:9(\\|[0-9]+ms)?\\] % " } },
+    { "timing", STAGES(5, 7), MODE_PTY | MODE_PIPE, 1, NULL, END_NONE,
+      { "@T@/sleeper", "@T@/hello", "exit" }, { "\\[exit:0\\|(1[5-9][0-9]|[2-9][0-9]{2}|[0-9]{4,})ms\\] % ", "\\[exit:0\\|[0-9]{1,2}ms\\] % " } },
+    { "arguments", STAGE(4) | STAGES(6, 7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "echo one two", "exit" }, { "one two\r?\n" } },
+    { "not-found", STAGES(4, 7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "nosuchcommand_enseash", "exit" }, { "Command not found\\.?\r?\n" } },
+    { "redirect-output", STAGE(7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "echo hello > @T@/out", "cat < @T@/out", "echo again >> @T@/out", "cat @T@/out", "exit" }, { "(^|\n)hello\r?\n", "(^|\n)hello\r?\nagain\r?\n" } },
+    { "exit-builtin", STAGE(7), MODE_PIPE, 0, NULL, END_NONE,
+      { "exitfoo", "echo still here", "@S@ -c 'echo a; exit 5; echo b'", "echo status $?", "@S@ -c 'false || exit'", "echo status $?", " exit" },
+      { "Command not found\\.?\n[^\n]*still here\n", "(^|\n)a\nstatus 5\nstatus 0\n" } },
+    { "echo-printf", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "echo -e 'a\\tb'", "echo -n x; echo -x y", "printf '%5.2f|%-3s|%s\\n' 3 x y", "printf '%s=%d\\n' a 1 b 2" },
+      { "(^|\n)a\tb\n", "(^|\n)x-x y\n", "(^|\n) 3\\.00\\|x  \\|y\n", "(^|\n)a=1\nb=2\n" } },
+    { "cgroup-switch", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "mkdir @T@/cg1 @T@/cg2", "cgroup @T@/cg1", "sleep 0.3 &", "cgroup @T@/cg2", "sleep 0.6", "cgroup off", "ls -A @T@/cg1 @T@/cg2 | wc -l; rmdir @T@/cg1 @T@/cg2" },
+      { "(^|\n)3\n" } },
+    { "daemon-socket", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "echo data > @T@/notsock", "@S@ -d @T@/notsock", "cat @T@/notsock", "limit -t 1s @S@ -d @T@/sock > /dev/null &", "sleep 0.2",
+        "@S@ -d @T@/sock", "echo status $?" },
+      { "(^|\n)Daemon socket path in use\ndata\n", "Daemon socket path in use\nstatus 1\n" } },
+    { "jobs", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "sleep 0.2 &", "jobs", "sleep 0.4" },
+      { "(^|\n)\\[1\\] [0-9]+\n\\[1\\] running \\[[0-9]+ms\\] sleep 0\\.2\n", "\\[1\\] done \\[exit:0\\|[0-9]+ms\\] sleep 0\\.2\n" } },
+    { "hash", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "ls / > /dev/null", "ls / > /dev/null", "hash", "hash -r", "hash" },
+      { "(^|\n) +2  /[^\n]*/ls\nhash: 1 hits, 1 misses\nhash: 1 hits, 1 misses\n" } },
+    { "arena-trim", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "printf 'true ' > @T@/long.sh", "head -c 2000000 /dev/zero | tr '\\000' a >> @T@/long.sh", "printf '\\narena\\n' >> @T@/long.sh",
+        "@S@ -q @T@/long.sh" },
+      { "(^|\n)arena: [0-9]+ bytes in use, peak [0-9]+ bytes, 65536 bytes in 1 blocks, 2 resets\n" } },
+    { "hash-long-path", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "printf 'ls / > /dev/null\\nls / > /dev/null\\nhash\\n' > @T@/hash.sh",
+        "sh -c 'PATH=$(printf /nonexistent%.0s: $(seq 400))$PATH exec @S@ -q @T@/hash.sh'" },
+      { "(^|\n) +2  /[^\n]*/ls\nhash: 1 hits, 1 misses\n" } },
+    { "cd", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "cd @T@", "pwd", "cd /", "cd -", "echo $PWD $OLDPWD", "cd /nonexistent", "pwd" },
+      { "(^|\n)/[^\n ]*enseash-harness-[^\n ]*\n/[^\n ]*enseash-harness-[^\n ]* /\n", "/nonexistent: No such file or directory\n/[^\n ]*enseash-harness-[^\n ]*\n" } },
+    { "test-builtin", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "test -d / && echo dir", "[ 3 -lt 2 ] || echo notless", "test -f /nonexistent; echo $?", "[ abc = abc ] && [ -n x ] && echo equal",
+        "[ abc -eq xyz ]; echo int $?", "test -foo /; echo unary $?" },
+      { "(^|\n)dir\nnotless\n1\nequal\n", "abc: integer expression expected\nint 2\n", "test: unsupported expression\nunary 2\n" } },
+    { "and-or-quoting", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "false && echo no || echo yes", "true || echo no; echo after", "echo 'a  b' \"c  d\" \\\"e\\\" x\\ y 'it''s'" },
+      { "(^|\n)yes\nafter\na  b c  d \"e\" x y its\n" } },
+    { "here-string", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "tr a-z A-Z <<< 'here string'", "export WORD=expanded", "cat <<< \"$WORD word\"", "wc -c <<< abc" },
+      { "(^|\n)HERE STRING\nexpanded word\n4\n" } },
+    { "parallel", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "parallel -k echo item {} ::: 1 2 3", "parallel -j 2 test {} = 0 ::: 0 1 0", "echo status $?" },
+      { "(^|\n)item 1\nitem 2\nitem 3\n", "parallel: 3 jobs on [0-9]+ slots, 1 failed", "(^|\n)status 1\n" } },
+    { "coproc", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "coproc start up sh -c 'while read l; do echo \"got $l\"; done'", "coproc up hello", "coproc up world > @T@/reply", "cat @T@/reply",
+        "coproc stop up", "echo status $?", "coproc up again" },
+      { "(^|\n)got hello\ngot world\nstatus 0\n", "usage: coproc \\[start name command\\.\\.\\. \\| stop name \\| name request\\.\\.\\.\\]\n" } },
+    { "daemon-session", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "limit -t 1s @S@ -d @T@/dsock > /dev/null &", "sleep 0.2", "echo 'echo from daemon' | @H@ --connect @T@/dsock" },
+      { "Welcome to ENSEA Tiny Shell\\.\nType 'exit' to quit\\.\nenseash % from daemon\nenseash \\[exit:0\\|[0-9]+ms\\] % Bye bye" } },
+    { "daemon-reap", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "limit -t 1s @S@ -d @T@/zsock > /dev/null &", "sleep 0.2", "echo exit | @H@ --connect @T@/zsock > /dev/null", "sleep 0.2",
+        "sh -c 'ps -o stat= --ppid $(pgrep -f \"[-]d @T@/zsock\") | grep -c Z'" },
+      { "(^|\n)0\n" } },
+    { "history", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "printf 'echo one\\nfalse\\nhistory\\nhistory -p ech\\n' > @T@/history.sh", "export ENSEASH_HISTORY=@T@/history", "@S@ -q @T@/history.sh" },
+      { "(^|\n)one\n +1  \\[exit:0\\|[0-9]+ms\\]  echo one\n +2  \\[exit:1\\|[0-9]+ms\\]  false\n +1  \\[exit:0\\|[0-9]+ms\\]  echo one\n" } },
+    { "limit", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "limit -t 200ms sleep 2 &", "sleep 0.5", "limit -c 1 sh -c 'while :; do :; done'", "echo cpu $?", "limit -x true",
+        "limit -t 100ms sleep 2", "echo foreground $?" },
+      { "\\[1\\] done \\[timeout:124\\|[0-9]+ms\\] limit -t 200ms sleep 2\n", "(^|\n)cpu 152\n", "usage: limit \\[-t time\\]",
+        "(^|\n)foreground 124\n" } },
+    { "parallel-coproc", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "coproc start w sh -c 'sleep 0.2; exit 3'", "parallel sleep ::: 0.5", "coproc stop w", "echo status $?" },
+      { "(^|\n)status 3\n" } },
+    { "parallel-keep-order", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "printf '#!/bin/sh\\ntest $1 = 1 && sleep 0.3\\necho $1\\n' > @T@/slow.sh", "chmod +x @T@/slow.sh", "seq 600 > @T@/items",
+        "sh -c 'ulimit -n 300; exec @S@ -q -c \"parallel -k -j 8 @T@/slow.sh :::: @T@/items\"' > @T@/ordered", "sort -n -c @T@/ordered && wc -l < @T@/ordered" },
+      { "(^|\n)600\n" } },
+    { "limit-before-exec", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "limit -m 1M /bin/true", "echo mem $?", "/bin/true", "echo none $?" },
+      { "(^|\n)mem [1-9][0-9]*\n", "(^|\n)none 0\n" } },
+    { "prefix-words", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "  limit -t 2s echo fast && limit -c 5 echo chained", "true; memo echo memoized | tr a-z A-Z", "parallel -k echo {} ::: b a | sort",
+        "parallelx", "@H@ --driver parsefuzz 2000 7", "@H@ --driver parsebench -n 100 'echo a | cat'" },
+      { "(^|\n)fast\nchained\nMEMOIZED\n", "(^|\n)a\nb\n", "Command not found", "2000 lines: [0-9]+ accepted, [0-9]+ rejected, 0 invalid trees" } },
+    { "prompt-escapes", STAGE(7), MODE_PTY, 0, NULL, END_EOF,
+      { "export ENSEASH_PROMPT='50%q %e %% '", "@S@", "true", "exit" },
+      { "(^|\n)50%q exit:0 % " } },
+    { "syntax-error", STAGE(7), MODE_PTY | MODE_PIPE, 0, NULL, END_EOF,
+      { "echo a |", "echo status $?", "true", "echo ok $?" },
+      { "Syntax error near 'newline'\\.\r?\n", "(^|\n)status 2\r?\n", "(^|\n)ok 0\r?\n" } },
+    { "cat-files", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "cat @T@/hello @T@/hello > @T@/twice", "cat @T@/twice", "export GREETING=hi", "printf '%s-%d\\n' $GREETING 42", "env | grep GREETING" },
+      { "(^|\n)#!/bin/sh\necho hello from script\n#!/bin/sh\necho hello from script\nhi-42\nGREETING=hi\n" } },
+    { "cat-device", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "limit -t 300ms cat /dev/zero > /dev/null", "echo status $?", "cat /dev/null - < @T@/hello > @T@/copy", "cat @T@/copy" },
+      { "(^|\n)status 124\n", "(^|\n)echo hello from script\n" } },
+    { "redirect-errors", STAGE(7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "cat < /nonexistent", "echo x > /nonexistent/file", "exit" }, { "Input file error\r?\n", "Output file error\r?\n" } },
+    { "redirect-stderr", STAGE(7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "ls /nonexistent 2> @T@/err", "cat @T@/err", "exit" }, { "No such file" } },
+    { "pipeline", STAGE(7), MODE_PTY | MODE_PIPE, 0, NULL, END_NONE,
+      { "echo abc | tr b x | cat", "exit" }, { "axc\r?\n" } },
+    { "pipeline-status", STAGE(7), MODE_PTY, 1, NULL, END_NONE,
+      { "true | false", "false | true", "exit" }, { "\\[exit:1\\|[0-9]+ms\\] % ", "\\[exit:0\\|[0-9]+ms\\] % " } },
+    { "batch-summary", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "true", "true" }, { "enseash: 2 commands in [0-9]+ms" } },
+    { "line-editor", STAGE(7), MODE_PTY, 0, "xterm", END_EOF,
+      { "ech\thello" }, { "\nhello\r\n" } },
+    { "glob", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "touch @T@/g2.c @T@/g1.c", "echo @T@/g*.c '@T@/g*.c' @T@/*.none", "cat < @T@/g*.c" },
+      { "/g1\\.c [^ ]+/g2\\.c [^ ]+/g\\*\\.c [^ ]+/\\*\\.none\n", "Ambiguous redirect\n" } },
+    { "variables", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "export GREETING=hi", "echo $GREETING ${GREETING}s \"$GREETING\" '$GREETING' $UNSET_VARIABLE.", "false; echo $?", "echo ~/x", "echo ~root/x ~no-such-user" },
+      { "(^|\n)hi his hi \\$GREETING \\.\n", "(^|\n)1\n", "(^|\n)/[^\n]*/x\n/[^\n ]*/x ~no-such-user\n" } },
+    { "trace", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "trace on", "/bin/true", "trace json @T@/trace.json", "cat @T@/trace.json" },
+      { "\"traceEvents\"", "\"name\":\"spawn\"[^\n]*\"text\":\"/bin/true\"", "\"name\":\"run\",\"cat\":\"child\"", "\"name\":\"reap\"" } },
+    { "memo", STAGE(7), MODE_PTY, 1, NULL, END_EOF,
+      { "seq 3 > @T@/memo.txt", "touch -d @0 @T@/memo.txt", "memo wc -l < @T@/memo.txt", "memo wc -l < @T@/memo.txt",
+        "memo grep x @T@/memo.txt", "memo grep x @T@/memo.txt", "memo" },
+      { "\n3\r?\n[^\n]*\\[memo:0\\|[0-9]+ms\\] % ", "\\[exit:1\\|[0-9]+ms\\] % [^\n]*\r?\n[^\n]*\\[memo:1\\|",
+        "memo: 2 hits, 2 misses \\(50% hit rate\\), 2 stored" } },
+    { "command-flag", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "@S@ -c 'echo one; sh -c \"exit 5\"'", "echo status $?", "@S@ -c 'echo a |'", "echo status $?", "echo echo quiet | @S@ -q" },
+      { "(^|\n)one\r?\nstatus 5\r?\n", "status 2\r?\nquiet\r?\nenseash: [0-9]+ commands" } },
+    { "snapshot", STAGE(7), MODE_PIPE, 0, NULL, END_EOF,
+      { "limits -t 5s", "snapshot @T@/startup.snap seq", "limits -t 0", "export ENSEASH_SNAPSHOT=@T@/startup.snap",
+        "@S@ -c 'limits; hash'", "export ENSEASH_SNAPSHOT=@T@/missing.snap", "@S@ -c 'echo started'" },
+      { "timeout 5000ms", " 0  /[^\n]*/seq\r?\n", "snapshot: unreadable or not a snapshot file\r?\nstarted" } },
+    { "interrupt", STAGE(7), MODE_PTY | MODE_PIPE, 0, NULL, END_EOF,
+      { "sh -c 'trap \"exit 7\" INT; kill -INT $PPID; sleep 5 > /dev/null 2>&1 & wait'", "echo alive $?" }, { "(^|\n)alive 7\r?\n" } },
+    { "interrupt-prompt", STAGE(7), MODE_PTY, 0, NULL, END_EOF,
+      { "\x03", "echo alive" }, { "\\^C\r?\n", "(\n|% )alive\r?\n" } },
+};
+
+static char temp_dir[] = "/tmp/enseash-harness-XXXXXX";
+static const char *harness_path;
+
+static void write_text(int fd, const char *text) {
+    size_t length = strlen(text);
+    while (length > 0) {
+        ssize_t written = write(fd, text, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        text += written;
+        length -= written;
+    }
+}
+
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int stage_of(const char *shell) { // the last digit of the file name: enseash_q7 is Question7.c
+    const char *name = strrchr(shell, '/');
+    int stage = 0;
+    for (name = name != NULL ? name + 1 : shell; *name != '\0'; name++) {
+        if (*name >= '0' && *name <= '9') {
+            stage = *name - '0';
+        }
+    }
+    return stage;
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+static int create_script(const char *name, const char *body) {
+    char path[HARNESS_MESSAGE_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", temp_dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+    if (fd < 0) {
+        return -1;
+    }
+    write_text(fd, body);
+    close(fd);
+    return 0;
+}
+
+static void remove_temp_dir(void) { // scripts and the files the tests redirected to, no subdirectory
+    DIR *stream = opendir(temp_dir);
+    struct dirent *entry;
+
+    while (stream != NULL && (entry = readdir(stream)) != NULL) {
+        unlinkat(dirfd(stream), entry->d_name, 0); // fails harmlessly on . and ..
+    }
+    if (stream != NULL) {
+        closedir(stream);
+    }
+    rmdir(temp_dir);
+}
+
+static int session_start(struct session *session, const char *shell, enum session_mode mode, const char *terminal) {
+    int input[2] = { -1, -1 };
+    int output[2] = { -1, -1 };
+    int master = -1;
+    const char *slave_name = NULL;
+
+    memset(session, 0, sizeof(*session));
+    session->transcript = malloc(TRANSCRIPT_SIZE);
+    if (session->transcript == NULL) {
+        return -1;
+    }
+    if (mode == MODE_PTY) {
+        master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 || (slave_name = ptsname(master)) == NULL) {
+            return -1;
+        }
+    } else if (pipe2(input, O_CLOEXEC) < 0 || pipe2(output, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    session->pid = fork();
+    if (session->pid < 0) {
+        return -1;
+    }
+    if (session->pid == 0) {
+        if (mode == MODE_PTY) { // a session of its own with the terminal as controlling tty, job control works as for a user
+            setsid();
+            int slave = open(slave_name, O_RDWR);
+            if (slave < 0) {
+                _exit(127);
+            }
+            ioctl(slave, TIOCSCTTY, 0);
+            dup2(slave, STDIN_FILENO);
+            dup2(slave, STDOUT_FILENO);
+            dup2(slave, STDERR_FILENO);
+        } else {
+            dup2(input[0], STDIN_FILENO);
+            dup2(output[1], STDOUT_FILENO);
+            dup2(output[1], STDERR_FILENO);
+        }
+        setenv("TERM", terminal != NULL ? terminal : "dumb", 1);
+        setenv("ENSEASH_HISTORY", "", 1); // never the user's ~/.enseash_history
+        unsetenv("ENSEASH_PROMPT");
+        unsetenv("ENSEASH_CGROUP");
+        unsetenv("ENSEASH_STATS_LOG");
+        unsetenv("ENSEASH_SNAPSHOT");
+        setenv("ENSEASH_MEMO_DIR", temp_dir, 1); // entries are plain files, removed with the scripts
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    if (mode == MODE_PTY) {
+        session->input_fd = master;
+        session->output_fd = master;
+    } else {
+        close(input[0]);
+        close(output[1]);
+        session->input_fd = input[1];
+        session->output_fd = output[0];
+    }
+    return 0;
+}
+
+static int session_read(struct session *session, int timeout_ms) { // appends what the shell wrote, 0 at end of output, -1 on timeout
+    struct pollfd poller = { session->output_fd, POLLIN, 0 };
+    int ready = poll(&poller, 1, timeout_ms);
+
+    if (ready <= 0) {
+        return -1;
+    }
+    ssize_t count = read(session->output_fd, session->transcript + session->length, TRANSCRIPT_SIZE - 1 - session->length);
+    if (count <= 0) { // EIO on the master once the shell closed the terminal
+        return 0;
+    }
+    session->length += count;
+    session->transcript[session->length] = '\0';
+    return 1;
+}
+
+static int session_wait_prompt(struct session *session, const regex_t *prompt, size_t since) { // output after since ending with a prompt
+    long deadline = now_ms() + PROMPT_TIMEOUT_MS;
+
+    while (1) {
+        session->transcript[session->length] = '\0';
+        if (session->length > since && regexec(prompt, session->transcript + since, 0, NULL, 0) == 0) {
+            return 0;
+        }
+        long left = deadline - now_ms();
+        if (left <= 0 || session_read(session, left) <= 0) {
+            return -1;
+        }
+    }
+}
+
+static void session_finish(struct session *session, enum session_mode mode, enum session_end end) { // sends the end of input, collects the rest of the output and the exit status
+    long deadline = now_ms() + EXIT_TIMEOUT_MS;
+
+    if (end == END_EOF && mode == MODE_PTY) {
+        write_text(session->input_fd, "\x04"); // VEOF at the start of a line
+    } else if (end == END_EOF) {
+        close(session->input_fd);
+        session->input_fd = -1;
+    }
+    while (session_read(session, deadline - now_ms() > 0 ? deadline - now_ms() : 0) > 0) {
+    }
+    if (waitpid(session->pid, &session->status, WNOHANG) == 0) {
+        usleep(100000);
+        if (waitpid(session->pid, &session->status, WNOHANG) == 0) { // still running: the test fails
+            kill(session->pid, SIGKILL);
+            waitpid(session->pid, &session->status, 0);
+            session->status = -1;
+        }
+    }
+    if (session->input_fd >= 0) {
+        close(session->input_fd);
+    }
+    if (session->output_fd != session->input_fd) {
+        close(session->output_fd);
+    }
+}
+
+static void expand_line(const char *line, const char *shell, char *expanded, size_t size) { // @T@ becomes the scratch directory, @S@ the shell, @H@ the harness, a newline ends the line
+    size_t length = 0;
+
+    while (*line != '\0' && length + 2 < size) {
+        if (strncmp(line, TEMP_MARKER, strlen(TEMP_MARKER)) == 0) {
+            length += snprintf(expanded + length, size - 1 - length, "%s", temp_dir);
+            length = length < size - 2 ? length : size - 2;
+            line += strlen(TEMP_MARKER);
+        } else if (strncmp(line, SHELL_MARKER, strlen(SHELL_MARKER)) == 0) {
+            length += snprintf(expanded + length, size - 1 - length, "%s", shell);
+            length = length < size - 2 ? length : size - 2;
+            line += strlen(SHELL_MARKER);
+        } else if (strncmp(line, HARNESS_MARKER, strlen(HARNESS_MARKER)) == 0) {
+            length += snprintf(expanded + length, size - 1 - length, "%s", harness_path);
+            length = length < size - 2 ? length : size - 2;
+            line += strlen(HARNESS_MARKER);
+        } else {
+            expanded[length++] = *line++;
+        }
+    }
+    expanded[length++] = '\n';
+    expanded[length] = '\0';
+}
+
+static int run_test(const struct test_case *test, const char *shell, enum session_mode mode, const regex_t *prompt) { // 0 when every expectation holds
+    struct session session;
+    char message[HARNESS_MESSAGE_SIZE];
+    const char *failure = NULL;
+    int stage = stage_of(shell);
+    int lock_step = mode == MODE_PTY || stage < 7; // stages 1 to 6 read() whatever is there: one line per prompt
+    int length;
+
+    if (session_start(&session, shell, mode, test->terminal) < 0) {
+        failure = "cannot start the shell";
+    }
+    if (failure == NULL && lock_step && session_wait_prompt(&session, prompt, 0) < 0) {
+        failure = "no first prompt";
+    }
+    for (int i = 0; failure == NULL && i < MAX_LINES && test->lines[i] != NULL; i++) {
+        char line[LINE_SIZE];
+        size_t since = session.length;
+        expand_line(test->lines[i], shell, line, sizeof(line));
+        write_text(session.input_fd, line);
+        int last = i + 1 == MAX_LINES || test->lines[i + 1] == NULL;
+        if (lock_step && !(last && test->end == END_NONE) && session_wait_prompt(&session, prompt, since) < 0) {
+            failure = "no prompt after a line";
+        }
+    }
+    if (session.pid > 0) {
+        session_finish(&session, mode, test->end);
+    }
+    if (failure == NULL && (session.status < 0 || !WIFEXITED(session.status) || WEXITSTATUS(session.status) != 0)) {
+        failure = "the shell did not exit with status 0";
+    }
+    if (failure == NULL && memchr(session.transcript, '\0', session.length) != NULL) {
+        failure = "NUL byte in the output";
+    }
+    for (int i = 0; failure == NULL && i < MAX_EXPECTED && test->expected[i] != NULL; i++) {
+        regex_t expected;
+        if (regcomp(&expected, test->expected[i], REG_EXTENDED) != 0) {
+            failure = "bad expectation";
+            break;
+        }
+        if (regexec(&expected, session.transcript, 0, NULL, 0) != 0) {
+            snprintf(message, sizeof(message), "missing /%s/", test->expected[i]);
+            failure = message;
+        }
+        regfree(&expected);
+    }
+    char report[HARNESS_MESSAGE_SIZE];
+    length = snprintf(report, sizeof(report), "%s %s/%s %s%s%s\n", failure == NULL ? "ok  " : "FAIL", base_name(shell),
+                      mode == MODE_PTY ? "pty" : "pipe", test->name, failure != NULL ? ": " : "", failure != NULL ? failure : "");
+    write(STDOUT_FILENO, report, length);
+    if (failure != NULL) { // the transcript, so the failure can be read without running again
+        write_text(STDOUT_FILENO, "---- transcript\n");
+        write(STDOUT_FILENO, session.transcript, session.length);
+        write_text(STDOUT_FILENO, "\n----\n");
+    }
+    free(session.transcript);
+    return failure == NULL ? 0 : -1;
+}
+
+static int run_tests(int count, char *shells[]) {
+    regex_t prompt;
+    int failures = 0;
+    int runs = 0;
+    char message[HARNESS_MESSAGE_SIZE];
+
+    regcomp(&prompt, PROMPT_PATTERN, REG_EXTENDED);
+    for (int s = 0; s < count; s++) {
+        int stage = stage_of(shells[s]);
+        for (size_t t = 0; t < sizeof(test_cases) / sizeof(test_cases[0]); t++) {
+            const struct test_case *test = &test_cases[t];
+            for (int mode = MODE_PTY; mode <= MODE_PIPE; mode <<= 1) {
+                if ((test->stages & STAGE(stage)) == 0 || (test->modes & mode) == 0 || (test->prompts && stage == 7 && mode == MODE_PIPE)) {
+                    continue;
+                }
+                failures += run_test(test, shells[s], mode, &prompt) < 0;
+                runs++;
+            }
+        }
+    }
+    regfree(&prompt);
+    int length = snprintf(message, sizeof(message), "%d tests, %d failed\n", runs, failures);
+    write(STDOUT_FILENO, message, length);
+    return failures == 0 ? 0 : 1;
+}
+
+struct bench_result {
+    double commands_per_second;       // one command per prompt, over a terminal
+    double batch_commands_per_second; // a script over a pipe, Question7 only, 0 otherwise
+    long latency_p50_us;              // from the end of the line to the next prompt
+    long latency_p99_us;
+    long rss_kb;                      // VmHWM of the shell
+    long cold_start_us;               // what enseash -c adds to a direct exec of the command, Question7 only
+    double cold_start_ratio;          // enseash -c command over the command alone: what the regression check compares
+};
+
+static int compare_long(const void *left, const void *right) {
+    long a = *(const long *)left;
+    long b = *(const long *)right;
+    return (a > b) - (a < b);
+}
+
+static long peak_rss_kb(pid_t pid) {
+    char path[64];
+    char status[4096];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t length = read(fd, status, sizeof(status) - 1);
+    close(fd);
+    status[length > 0 ? length : 0] = '\0';
+    const char *peak = strstr(status, "VmHWM:");
+    return peak != NULL ? atol(peak + 6) : -1;
+}
+
+static long spawn_wait_us(char *const argv[]) { // fork, exec and reap a command on /dev/null, -1 unless it exits with 0
+    long start = now_us();
+    pid_t pid = fork();
+    int status;
+
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        unsetenv("ENSEASH_SNAPSHOT");
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return now_us() - start;
+}
+
+static int cold_start(const char *shell, struct bench_result *result) { // medians of enseash -c command and of the command alone, run in turn so that both see the same machine load
+    long shell_runs[BENCH_COLD_STARTS];
+    long direct_runs[BENCH_COLD_STARTS];
+    char *shell_argv[] = { (char *)shell, "-c", BENCH_COMMAND, NULL };
+    char *direct_argv[] = { BENCH_COMMAND, NULL };
+
+    for (int i = 0; i < BENCH_COLD_STARTS; i++) {
+        direct_runs[i] = spawn_wait_us(direct_argv);
+        shell_runs[i] = spawn_wait_us(shell_argv);
+        if (direct_runs[i] < 0 || shell_runs[i] < 0) {
+            return -1;
+        }
+    }
+    qsort(shell_runs, BENCH_COLD_STARTS, sizeof(long), compare_long);
+    qsort(direct_runs, BENCH_COLD_STARTS, sizeof(long), compare_long);
+    long shell_median = shell_runs[BENCH_COLD_STARTS / 2];
+    long direct_median = direct_runs[BENCH_COLD_STARTS / 2];
+    result->cold_start_us = shell_median > direct_median ? shell_median - direct_median : 0;
+    result->cold_start_ratio = direct_median > 0 ? (double)shell_median / direct_median : 0;
+    return 0;
+}
+
+static int bench_shell(const char *shell, int commands, struct bench_result *result) {
+    struct session session;
+    regex_t prompt;
+    long *latencies = calloc(commands, sizeof(long));
+    char line[LINE_SIZE];
+
+    memset(result, 0, sizeof(*result));
+    regcomp(&prompt, PROMPT_PATTERN, REG_EXTENDED);
+    if (latencies == NULL || session_start(&session, shell, MODE_PTY, NULL) < 0 || session_wait_prompt(&session, &prompt, 0) < 0) {
+        regfree(&prompt);
+        free(latencies);
+        return -1;
+    }
+    snprintf(line, sizeof(line), "%s\n", BENCH_COMMAND);
+    long start = now_us();
+    for (int i = 0; i < commands; i++) {
+        long sent = now_us();
+        session.length = 0; // only the last prompt matters
+        write_text(session.input_fd, line);
+        if (session_wait_prompt(&session, &prompt, 0) < 0) {
+            break;
+        }
+        latencies[i] = now_us() - sent;
+    }
+    long total = now_us() - start;
+    result->rss_kb = peak_rss_kb(session.pid);
+    write_text(session.input_fd, "exit\n");
+    session_finish(&session, MODE_PTY, END_NONE);
+    free(session.transcript);
+    regfree(&prompt);
+    qsort(latencies, commands, sizeof(long), compare_long);
+    result->commands_per_second = total > 0 ? commands * 1e6 / total : 0;
+    result->latency_p50_us = latencies[commands / 2];
+    result->latency_p99_us = latencies[commands * 99 / 100];
+    free(latencies);
+
+    if (stage_of(shell) == 7) { // a script: no prompt to wait for, lines are read as fast as they run
+        if (session_start(&session, shell, MODE_PIPE, NULL) < 0) {
+            return -1;
+        }
+        start = now_us();
+        for (int i = 0; i < BENCH_BATCH_COMMANDS; i++) {
+            write_text(session.input_fd, line);
+        }
+        session_finish(&session, MODE_PIPE, END_EOF);
+        total = now_us() - start;
+        free(session.transcript);
+        result->batch_commands_per_second = total > 0 ? BENCH_BATCH_COMMANDS * 1e6 / total : 0;
+        if (cold_start(shell, result) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static double median_of(const struct bench_result rounds[], int count, size_t offset, int is_long) { // one field across the rounds
+    double values[count];
+    for (int i = 0; i < count; i++) {
+        const char *field = (const char *)&rounds[i] + offset;
+        values[i] = is_long ? *(const long *)field : *(const double *)field;
+    }
+    for (int i = 1; i < count; i++) { // a handful of rounds: insertion sort
+        for (int j = i; j > 0 && values[j - 1] > values[j]; j--) {
+            double swap = values[j];
+            values[j] = values[j - 1];
+            values[j - 1] = swap;
+        }
+    }
+    return values[count / 2];
+}
+
+static void median_result(const struct bench_result rounds[], int count, struct bench_result *result) { // field by field: a noisy round only moves the figures it disturbed
+    result->commands_per_second = median_of(rounds, count, offsetof(struct bench_result, commands_per_second), 0);
+    result->batch_commands_per_second = median_of(rounds, count, offsetof(struct bench_result, batch_commands_per_second), 0);
+    result->latency_p50_us = median_of(rounds, count, offsetof(struct bench_result, latency_p50_us), 1);
+    result->latency_p99_us = median_of(rounds, count, offsetof(struct bench_result, latency_p99_us), 1);
+    result->rss_kb = median_of(rounds, count, offsetof(struct bench_result, rss_kb), 1);
+    result->cold_start_us = median_of(rounds, count, offsetof(struct bench_result, cold_start_us), 1);
+    result->cold_start_ratio = median_of(rounds, count, offsetof(struct bench_result, cold_start_ratio), 0);
+}
+
+static int format_result(char *out, size_t size, const char *name, const struct bench_result *result, int last) {
+    return snprintf(out, size, "  \"%s\": {\"commands_per_second\": %.1f, \"batch_commands_per_second\": %.1f, "
+                    "\"spawn_latency_p50_us\": %ld, \"spawn_latency_p99_us\": %ld, \"rss_kb\": %ld, \"cold_start_us\": %ld, \"cold_start_ratio\": %.2f}%s\n",
+                    name, result->commands_per_second, result->batch_commands_per_second, result->latency_p50_us,
+                    result->latency_p99_us, result->rss_kb, result->cold_start_us, result->cold_start_ratio, last ? "" : ",");
+}
+
+static char *read_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat file_info;
+    if (fd < 0 || fstat(fd, &file_info) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char *text = malloc(file_info.st_size + 1);
+    ssize_t length = text != NULL ? read(fd, text, file_info.st_size) : -1;
+    close(fd);
+    if (length < 0) {
+        free(text);
+        return NULL;
+    }
+    text[length] = '\0';
+    return text;
+}
+
+static int baseline_value(const char *baseline, const char *name, const char *key, double *value) { // "name": {... "key": value ...}, the file written by --json
+    char pattern[HARNESS_MESSAGE_SIZE];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", name);
+    const char *section = strstr(baseline, pattern);
+    if (section == NULL) {
+        return -1;
+    }
+    const char *section_end = strchr(section, '}');
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *field = strstr(section, pattern);
+    if (field == NULL || (section_end != NULL && field > section_end)) {
+        return -1;
+    }
+    *value = strtod(field + strlen(pattern), NULL);
+    return 0;
+}
+
+static int check_regression(const char *baseline, const char *name, const char *key, double value, int higher_is_better, int checked, double tolerance) { // checked: 0 for absolute timings, which depend on the machine and its load, reported only
+    char message[HARNESS_MESSAGE_SIZE];
+    double expected;
+
+    if (baseline_value(baseline, name, key, &expected) < 0 || expected <= 0) {
+        return 0;
+    }
+    int regressed = checked && (higher_is_better ? value < expected * (1 - tolerance) : value > expected * (1 + tolerance));
+    int length = snprintf(message, sizeof(message), "%s %s %s: %.2f, baseline %.2f (%+.0f%%)\n", regressed ? "REGRESSION" : checked ? "ok        " : "report    ",
+                          name, key, value, expected, (value - expected) * 100 / expected);
+    write(STDOUT_FILENO, message, length);
+    return regressed;
+}
+
+static int run_bench(int argc, char *argv[]) {
+    const char *json_path = NULL;
+    const char *baseline_path = NULL;
+    double tolerance = BENCH_DEFAULT_TOLERANCE;
+    int commands = BENCH_DEFAULT_COMMANDS;
+    int rounds = BENCH_DEFAULT_ROUNDS;
+    int first = 0;
+    int regressions = 0;
+
+    while (first < argc && argv[first][0] == '-') {
+        if (first + 1 >= argc) {
+            write_text(STDERR_FILENO, USAGE_MSG);
+            return 2;
+        }
+        if (strncmp(argv[first], "-n", 3) == 0) {
+            commands = atoi(argv[first + 1]);
+        } else if (strncmp(argv[first], "-r", 3) == 0) {
+            rounds = atoi(argv[first + 1]);
+        } else if (strncmp(argv[first], "--json", 7) == 0) {
+            json_path = argv[first + 1];
+        } else if (strncmp(argv[first], "--baseline", 11) == 0) {
+            baseline_path = argv[first + 1];
+        } else if (strncmp(argv[first], "--tolerance", 12) == 0) {
+            tolerance = strtod(argv[first + 1], NULL);
+        } else {
+            write_text(STDERR_FILENO, USAGE_MSG);
+            return 2;
+        }
+        first += 2;
+    }
+    if (first == argc || commands <= 0 || rounds <= 0) {
+        write_text(STDERR_FILENO, USAGE_MSG);
+        return 2;
+    }
+    char *baseline = baseline_path != NULL ? read_file(baseline_path) : NULL;
+    if (baseline_path != NULL && baseline == NULL) {
+        write_text(STDERR_FILENO, "harness: cannot read the baseline\n");
+        return 2;
+    }
+    struct bench_result *results = calloc((size_t)(argc - first) * rounds, sizeof(struct bench_result)); // rounds of shell i at results + i * rounds
+    int *failed = calloc(argc - first, sizeof(int));
+    if (results == NULL || failed == NULL) {
+        free(results);
+        free(failed);
+        free(baseline);
+        return 2;
+    }
+    for (int round = 0; round < rounds; round++) { // the shells take turns: a slow spell of the machine hits one round of each, not every round of one
+        for (int i = first; i < argc; i++) {
+            if (!failed[i - first] && bench_shell(argv[i], commands, &results[(i - first) * rounds + round]) < 0) {
+                failed[i - first] = 1;
+            }
+        }
+    }
+    int json_fd = json_path != NULL ? open(json_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : STDOUT_FILENO;
+    write_text(json_fd, "{\n");
+    for (int i = first; i < argc; i++) {
+        struct bench_result result;
+        char line[HARNESS_MESSAGE_SIZE];
+        const char *name = base_name(argv[i]);
+
+        if (failed[i - first]) {
+            write_text(STDERR_FILENO, "harness: cannot run the shell\n");
+            regressions++;
+            continue;
+        }
+        median_result(&results[(i - first) * rounds], rounds, &result);
+        format_result(line, sizeof(line), name, &result, i + 1 == argc);
+        write_text(json_fd, line);
+        if (baseline != NULL) {
+            regressions += check_regression(baseline, name, "commands_per_second", result.commands_per_second, 1, 0, tolerance);
+            regressions += check_regression(baseline, name, "batch_commands_per_second", result.batch_commands_per_second, 1, 0, tolerance);
+            regressions += check_regression(baseline, name, "spawn_latency_p50_us", result.latency_p50_us, 0, 0, tolerance);
+            regressions += check_regression(baseline, name, "cold_start_us", result.cold_start_us, 0, 0, tolerance);
+            regressions += check_regression(baseline, name, "cold_start_ratio", result.cold_start_ratio, 0, 1, tolerance);
+            regressions += check_regression(baseline, name, "rss_kb", result.rss_kb, 0, 1, tolerance);
+        }
+    }
+    write_text(json_fd, "}\n");
+    if (json_fd != STDOUT_FILENO) {
+        close(json_fd);
+    }
+    free(results);
+    free(failed);
+    free(baseline);
+    return regressions == 0 ? 0 : 1;
+}
+
+static void benchmark_spawn(int iterations) { // back-to-back "true" runs with both engines
+    static const enum spawn_engine engines[] = { SPAWN_ENGINE_FORK, SPAWN_ENGINE_POSIX };
+    static const char *engine_names[] = { "fork+execvp", "posix_spawn" };
+    char message[MESSAGE_BUFFER_SIZE];
+    char true_cmd[] = "true";
+    char *true_argv[] = { true_cmd, NULL };
+    struct command cmd = { .argv = true_argv, .argc = 1, .redirections = NULL, .next = NULL };
+    struct pipeline pipeline = { .stages = &cmd, .count = 1, .connector = CONNECT_ALWAYS, .next = NULL };
+    struct timespec time_start;
+    struct timespec time_end;
+    struct rusage usage;
+
+    for (int e = 0; e < 2; e++) {
+        clock_gettime(CLOCK_MONOTONIC, &time_start);
+        for (int i = 0; i < iterations; i++) {
+            run_external_pipeline(&pipeline, engines[e], &usage); // the builtin true would not spawn anything
+        }
+        clock_gettime(CLOCK_MONOTONIC, &time_end);
+
+        long total_ns = elapsed_ns(&time_start, &time_end);
+        int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%-12s %d runs  %ldms total  %ldus/cmd\n",
+                              engine_names[e], iterations, total_ns / 1000000, total_ns / 1000 / iterations);
+        write(STDOUT_FILENO, message, length);
+    }
+}
+
+static long percentile(const long *sorted, int count, int percent) { // nearest-rank method
+    int rank = (count * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static char *next_word(char **cursor) { // splits bench options off the command line without touching the rest
+    char *word = *cursor;
+    while (*word == ' ') {
+        word++;
+    }
+    if (*word == '\0') {
+        return NULL;
+    }
+    char *end = strchrnul(word, ' ');
+    *cursor = *end != '\0' ? end + 1 : end;
+    *end = '\0';
+    return word;
+}
+
+static void benchmark_command(char *arguments, enum spawn_engine engine) { // bench -n runs -w warmups [-c] command...
+    char message[MESSAGE_BUFFER_SIZE];
+    struct and_or *list;
+    struct rusage usage;
+    struct rusage total_usage;
+    struct timespec time_start;
+    struct timespec time_end;
+    int runs = BENCH_DEFAULT_RUNS;
+    int warmups = BENCH_DEFAULT_WARMUPS;
+    int csv = 0;
+    int child_status;
+    int failures = 0;
+    char *cursor = arguments;
+    char *command = arguments;
+    char *word;
+
+    message[0] = '\0';
+    while ((word = next_word(&cursor)) != NULL && word[0] == '-') {
+        char *value = NULL;
+        if (strncmp(word, "-c", 3) == 0) {
+            csv = 1;
+        } else if ((strncmp(word, "-n", 3) == 0 || strncmp(word, "-w", 3) == 0) && (value = next_word(&cursor)) != NULL) {
+            *(word[1] == 'n' ? &runs : &warmups) = atoi(value);
+        } else {
+            word = NULL;
+            break;
+        }
+        command = cursor;
+    }
+    if (word != NULL && word + strlen(word) != cursor) { // give back the separator next_word() cut after the first command word
+        word[strlen(word)] = ' ';
+    }
+    if (word == NULL || runs <= 0 || warmups < 0 || parse_line(&line_arena, command, &list, message) < 0 || list == NULL) {
+        write(STDERR_FILENO, BENCH_USAGE_MSG, BENCH_USAGE_MSG_LENGTH);
+        write(STDERR_FILENO, message, strnlen(message, MESSAGE_BUFFER_SIZE));
+        return;
+    }
+    for (struct and_or *and_or = list; and_or != NULL; and_or = and_or->next) {
+        if (and_or->background) {
+            write(STDERR_FILENO, BENCH_USAGE_MSG, BENCH_USAGE_MSG_LENGTH);
+            return;
+        }
+    }
+
+    long *samples = malloc(sizeof(long) * runs);
+    if (samples == NULL) {
+        write(STDERR_FILENO, OUTOFMEMORY_MSG, OUTOFMEMORY_MSG_LENGTH);
+        return;
+    }
+    memset(&total_usage, 0, sizeof(total_usage));
+
+    struct arena_mark mark = arena_mark(&line_arena); // the parsed command stays, each run's fd plans and pids are dropped
+    for (int i = 0; i < warmups + runs; i++) { // same spawn/wait path as a command typed at the prompt
+        clock_gettime(CLOCK_MONOTONIC, &time_start);
+        run_list(list, engine, &child_status, &usage);
+        clock_gettime(CLOCK_MONOTONIC, &time_end);
+        arena_release(&line_arena, &mark);
+        if (i >= warmups) {
+            samples[i - warmups] = elapsed_ns(&time_start, &time_end);
+            add_usage(&total_usage, &usage);
+            failures += !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0;
+        }
+    }
+    qsort(samples, runs, sizeof(long), compare_long);
+
+    long user_us = timeval_us(&total_usage.ru_utime) / runs;
+    long sys_us = timeval_us(&total_usage.ru_stime) / runs;
+    int length;
+    if (csv) {
+        length = snprintf(message, MESSAGE_BUFFER_SIZE,
+                          "runs,warmups,failures,min_us,median_us,p95_us,p99_us,max_us,user_us,sys_us\n%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%ld\n",
+                          runs, warmups, failures, samples[0] / 1000.0, percentile(samples, runs, 50) / 1000.0,
+                          percentile(samples, runs, 95) / 1000.0, percentile(samples, runs, 99) / 1000.0,
+                          samples[runs - 1] / 1000.0, user_us, sys_us);
+    } else {
+        length = snprintf(message, MESSAGE_BUFFER_SIZE,
+                          "%d runs (%d warmups, %d failed)\nmin %.1fus  median %.1fus  p95 %.1fus  p99 %.1fus  max %.1fus\ncpu per run: user %ldus  sys %ldus\n",
+                          runs, warmups, failures, samples[0] / 1000.0, percentile(samples, runs, 50) / 1000.0,
+                          percentile(samples, runs, 95) / 1000.0, percentile(samples, runs, 99) / 1000.0,
+                          samples[runs - 1] / 1000.0, user_us, sys_us);
+    }
+    write(STDOUT_FILENO, message, length);
+    free(samples);
+}
+
+static int check_ast(const struct and_or *list) { // structural invariants the executor relies on, returns 0 when they hold
+    for (const struct and_or *and_or = list; and_or != NULL; and_or = and_or->next) {
+        if (and_or->pipelines == NULL || and_or->text == NULL || and_or->pipelines->connector != CONNECT_ALWAYS) {
+            return -1;
+        }
+        for (const struct pipeline *pipeline = and_or->pipelines; pipeline != NULL; pipeline = pipeline->next) {
+            int count = 0;
+            for (const struct command *cmd = pipeline->stages; cmd != NULL; cmd = cmd->next, count++) {
+                if (cmd->argc < 0 || cmd->argv[cmd->argc] != NULL || (cmd->argc == 0 && cmd->redirections == NULL)) {
+                    return -1;
+                }
+                for (int i = 0; i < cmd->argc; i++) {
+                    if (cmd->argv[i] == NULL) {
+                        return -1;
+                    }
+                }
+                for (const struct redirection *redirection = cmd->redirections; redirection != NULL; redirection = redirection->next) {
+                    if (redirection->fd < 0 || redirection->target == NULL) {
+                        return -1;
+                    }
+                }
+            }
+            if (count != pipeline->count || count == 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void benchmark_parser(char *arguments) { // parsebench [-n runs] command line...
+    char message[MESSAGE_BUFFER_SIZE];
+    struct arena arena = { NULL };
+    struct and_or *list;
+    struct timespec time_start;
+    struct timespec time_end;
+    int runs = PARSEBENCH_DEFAULT_RUNS;
+    char *cursor = arguments;
+
+    while (*cursor == ' ') {
+        cursor++;
+    }
+    if (strncmp(cursor, "-n ", 3) == 0) {
+        cursor += 3;
+        char *word = next_word(&cursor);
+        runs = word != NULL ? atoi(word) : 0;
+    }
+    if (runs <= 0 || *cursor == '\0' || parse_line(&arena, cursor, &list, message) < 0) {
+        write(STDERR_FILENO, PARSEBENCH_USAGE_MSG, PARSEBENCH_USAGE_MSG_LENGTH);
+        write(STDERR_FILENO, message, strnlen(message, MESSAGE_BUFFER_SIZE));
+        arena_free(&arena);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (int i = 0; i < runs; i++) {
+        arena_reset(&arena);
+        parse_line(&arena, cursor, &list, message);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    arena_free(&arena);
+
+    long total_ns = elapsed_ns(&time_start, &time_end);
+    size_t line_length = strlen(cursor);
+    int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%d parses of %zu bytes: %.1fns/line  %.0f lines/s  %.1fMB/s\n",
+                          runs, line_length, (double)total_ns / runs, runs * 1e9 / total_ns,
+                          (double)line_length * runs * 1e3 / total_ns);
+    write(STDOUT_FILENO, message, length);
+}
+
+static void fuzz_parser(char *arguments) { // parsefuzz [lines [seed]]: random lines over the shell's special characters
+    static const char alphabet[] = "ab cd\t|&;<>'\"\\#012=-*$ xyz";
+    char message[MESSAGE_BUFFER_SIZE];
+    char line[PARSEFUZZ_LINE_SIZE];
+    struct arena arena = { NULL };
+    struct and_or *list;
+    struct timespec time_start;
+    struct timespec time_end;
+    char *cursor = arguments;
+    char *word = next_word(&cursor);
+    long lines = word != NULL ? atol(word) : PARSEFUZZ_DEFAULT_LINES;
+    unsigned long state = (word = next_word(&cursor)) != NULL ? strtoul(word, NULL, 10) : (unsigned long)time(NULL);
+    long accepted = 0;
+    long failures = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (long n = 0; n < lines; n++) {
+        state ^= state << 13; // xorshift, reproducible from the seed
+        state ^= state >> 7;
+        state ^= state << 17;
+        int length = state % PARSEFUZZ_LINE_SIZE;
+        for (int i = 0; i < length; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            line[i] = alphabet[state % (sizeof(alphabet) - 1)];
+        }
+        line[length] = '\0';
+
+        arena_reset(&arena);
+        if (parse_line(&arena, line, &list, message) == 0) {
+            accepted++;
+            if (check_ast(list) < 0) {
+                failures++;
+                write(STDERR_FILENO, line, length);
+                write(STDERR_FILENO, "\n", 1);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    arena_free(&arena);
+
+    long total_ns = elapsed_ns(&time_start, &time_end);
+    int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%ld lines: %ld accepted, %ld rejected, %ld invalid trees, %.0f lines/s\n",
+                          lines, accepted, lines - accepted, failures, total_ns > 0 ? lines * 1e9 / total_ns : 0.0);
+    write(STDOUT_FILENO, message, length);
+}
+
+static void benchmark_history(char *arguments) { // historybench [entries]: appends to a ring in a memfd, then indexes and searches it
+    static const char *const formats[] = { "git commit -m 'change %ld'", "make -j8 target%ld", "ls -l /tmp/dir%ld", "grep -rn pattern%ld src", "cd /home/user/project%ld" };
+    struct history ring;
+    struct timespec time_start;
+    struct timespec time_end;
+    char line[MESSAGE_BUFFER_SIZE];
+    char message[MESSAGE_BUFFER_SIZE];
+    long entries = atol(arguments) > 0 ? atol(arguments) : HISTORYBENCH_DEFAULT_ENTRIES;
+    long found = 0;
+    int fd = memfd_create("enseash-historybench", MFD_CLOEXEC);
+
+    if (fd < 0 || history_open(&ring, fd, HISTORYBENCH_SIZE) < 0) {
+        builtin_error("historybench", strerror(errno));
+        close_if_open(fd);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (long i = 0; i < entries; i++) {
+        snprintf(line, MESSAGE_BUFFER_SIZE, formats[i % 5], i);
+        history_append(&ring, line, 0, i % 1000);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long append_ns = elapsed_ns(&time_start, &time_end);
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    history_sync(&ring);
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long index_ns = elapsed_ns(&time_start, &time_end);
+    long newest = history_newest(&ring);
+    long kept = (long)ring.index.count;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    history_sort(&ring); // done by the first prefix search
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long sort_ns = elapsed_ns(&time_start, &time_end);
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (long i = 0; i < HISTORYBENCH_SEARCHES; i++) { // !prefix of a random entry still in the ring
+        long target = newest - (long)(((unsigned long)i * 2654435761u) % kept);
+        snprintf(line, MESSAGE_BUFFER_SIZE, formats[(target - 1) % 5], target - 1);
+        found += history_find_prefix(&ring, line) >= 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long prefix_ns = elapsed_ns(&time_start, &time_end) / HISTORYBENCH_SEARCHES;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (long i = 0; i < HISTORYBENCH_SEARCHES / 100; i++) { // !?text of an old entry: most of the ring is scanned
+        long sequence = newest;
+        long oldest = newest - kept; // value printed into the oldest entry kept
+        snprintf(line, MESSAGE_BUFFER_SIZE, "pattern%ld ", oldest + (8 - oldest % 5) % 5 + i * 5); // a grep line: values 3 mod 5
+        found += history_find_substring(&ring, line, &sequence) != NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long substring_ns = elapsed_ns(&time_start, &time_end) / (HISTORYBENCH_SEARCHES / 100);
+
+    int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%ld appends: %ldns/append, %ld entries kept in %ldMB\n"
+                          "index: %ldms, sort: %ldms, prefix search: %.1fus, substring search: %.1fms, %ld/%d found\n",
+                          entries, append_ns / entries, kept, HISTORYBENCH_SIZE >> 20, index_ns / 1000000, sort_ns / 1000000, prefix_ns / 1e3, substring_ns / 1e6,
+                          found, HISTORYBENCH_SEARCHES + HISTORYBENCH_SEARCHES / 100);
+    write(STDOUT_FILENO, message, length);
+    history_close(&ring);
+}
+
+static void benchmark_completion(char *arguments) { // completebench [names]: a PATH directory of executables, then keystrokes against it
+    static const char *const formats[] = { "git-%ld", "x86_64-linux-gnu-tool%ld", "py%ld", "kube%ldctl", "lib%ld-config" };
+    static const char keys[] = "git-12\t\t\x15x86\t\x15py99\t\x15kube\t\t\x15";
+    char dir_path[] = "/tmp/enseash-completebench-XXXXXX";
+    char name[HASH_NAME_SIZE];
+    char path_var[HASH_PATH_VAR_SIZE];
+    char message[MESSAGE_BUFFER_SIZE];
+    struct path_trie trie = { .inotify_fd = -1 };
+    struct line_editor editor;
+    struct output_buffer output;
+    struct timespec time_start;
+    struct timespec time_end;
+    long names = atol(arguments) > 0 ? atol(arguments) : COMPLETEBENCH_DEFAULT_NAMES;
+    long worst_ns = 0;
+    long bytes = 0;
+
+    if (mkdtemp(dir_path) == NULL) {
+        builtin_error("completebench", strerror(errno));
+        return;
+    }
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (long i = 0; i < names; i++) {
+        snprintf(name, HASH_NAME_SIZE, formats[i % 5], i / 5);
+        close_if_open(openat(dir_fd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0755));
+    }
+    char *saved_path = strdup(current_path_var());
+    snprintf(path_var, HASH_PATH_VAR_SIZE, "%s:%s", dir_path, saved_path);
+    setenv("PATH", path_var, 1); // completion checks the trie against PATH
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    trie_build(&trie, path_var);
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long build_ns = elapsed_ns(&time_start, &time_end);
+
+    editor_init(&editor, -1, &trie);
+    editor.done = 0;
+    editor_set_line(&editor, "", 0);
+    editor_prompt(&editor, PROMPT_DEFAULT, strlen(PROMPT_DEFAULT));
+    output.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    output.length = 0;
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (long i = 0; i < COMPLETEBENCH_KEYS; i++) { // one key, its redraw and the write, as editor_read_line() does
+        struct timespec key_start;
+        struct timespec key_end;
+        clock_gettime(CLOCK_MONOTONIC, &key_start);
+        editor_feed(&editor, &keys[i % (sizeof(keys) - 1)], 1, &output);
+        bytes += output.length;
+        output_flush(&output);
+        clock_gettime(CLOCK_MONOTONIC, &key_end);
+        long key_ns = elapsed_ns(&key_start, &key_end);
+        worst_ns = key_ns > worst_ns ? key_ns : worst_ns;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long key_ns = elapsed_ns(&time_start, &time_end) / COMPLETEBENCH_KEYS;
+
+    close_if_open(openat(dir_fd, "zz-new-tool", O_WRONLY | O_CREAT | O_CLOEXEC, 0755)); // seen through inotify, without a rescan
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    trie_refresh(&trie);
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long refresh_ns = elapsed_ns(&time_start, &time_end);
+    long added = trie_walk(&trie, "zz-new-tool", 11, 0);
+    int seen = added > 0 && trie.nodes[added].dirs != 0;
+
+    for (long i = 0; i < names; i++) {
+        snprintf(name, HASH_NAME_SIZE, formats[i % 5], i / 5);
+        unlinkat(dir_fd, name, 0);
+    }
+    unlinkat(dir_fd, "zz-new-tool", 0);
+    close(dir_fd);
+    rmdir(dir_path);
+    close_if_open(output.fd);
+    setenv("PATH", saved_path, 1);
+    free(saved_path);
+    int length = snprintf(message, MESSAGE_BUFFER_SIZE, "%u names on PATH, trie of %u nodes built in %ldms\n"
+                          "keystroke: %ldns mean, %ldus worst, %ld bytes written per key; new file %s in %ldus\n",
+                          trie.nodes[0].names, trie.count, build_ns / 1000000, key_ns, worst_ns / 1000, bytes / COMPLETEBENCH_KEYS,
+                          seen ? "completable" : "missed", refresh_ns / 1000);
+    write(STDOUT_FILENO, message, length);
+    editor_free(&editor);
+    trie_free(&trie);
+}
+
+static long benchmark_glob(const char *pattern, int runs, long *fields) { // mean ns per expansion of pattern, through the directory cache
+    struct expansion expansion;
+    struct timespec time_start;
+    struct timespec time_end;
+    struct arena_mark mark = arena_mark(&line_arena);
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (int i = 0; i < runs; i++) {
+        memset(&expansion, 0, sizeof(expansion));
+        expand_word(&expansion, pattern, 1);
+        *fields = expansion.count;
+        arena_release(&line_arena, &mark);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    return elapsed_ns(&time_start, &time_end) / runs;
+}
+
+static void benchmark_expansion(char *arguments) { // globbench [files]: a directory of generated files, globbed cold, warm, and with glob(3)
+    static const char *const formats[] = { "data-%ld.log", "data-%ld.txt", "img%ld.png" };
+    char dir_path[] = "/tmp/enseash-globbench-XXXXXX";
+    char name[HASH_NAME_SIZE];
+    char all[HASH_PATH_SIZE];
+    char prefix[HASH_PATH_SIZE];
+    char middle[HASH_PATH_SIZE];
+    char added[HASH_PATH_SIZE];
+    char message[MESSAGE_BUFFER_SIZE * 2];
+    struct timespec time_start;
+    struct timespec time_end;
+    long files = atol(arguments) > 0 ? atol(arguments) : GLOBBENCH_DEFAULT_FILES;
+    long all_fields = 0;
+    long prefix_fields = 0;
+    long middle_fields = 0;
+    long libc_fields = 0;
+    long added_fields = 0;
+    long variable_fields = 0;
+
+    if (mkdtemp(dir_path) == NULL) {
+        builtin_error("globbench", strerror(errno));
+        return;
+    }
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (long i = 0; i < files; i++) {
+        snprintf(name, HASH_NAME_SIZE, formats[i % 3], i / 3);
+        close_if_open(openat(dir_fd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    }
+    snprintf(all, HASH_PATH_SIZE, "%s/*", dir_path);
+    snprintf(prefix, HASH_PATH_SIZE, "%s/data-123*.log", dir_path);
+    snprintf(middle, HASH_PATH_SIZE, "%s/*7?.txt", dir_path);
+    snprintf(added, HASH_PATH_SIZE, "%s/zz-new*", dir_path);
+    long reads = dir_cache.reads;
+    long hits = dir_cache.hits;
+
+    long cold_ns = benchmark_glob(all, 1, &all_fields); // getdents64 and the sort
+    long all_ns = benchmark_glob(all, GLOBBENCH_RUNS, &all_fields);
+    long prefix_ns = benchmark_glob(prefix, GLOBBENCH_RUNS * 100, &prefix_fields);
+    long middle_ns = benchmark_glob(middle, GLOBBENCH_RUNS, &middle_fields);
+
+    glob_t libc_glob;
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (int i = 0; i < GLOBBENCH_RUNS / 10; i++) { // reads the directory every time
+        if (glob(middle, 0, NULL, &libc_glob) == 0) {
+            libc_fields = libc_glob.gl_pathc;
+            globfree(&libc_glob);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long libc_ns = elapsed_ns(&time_start, &time_end) / (GLOBBENCH_RUNS / 10);
+
+    close_if_open(openat(dir_fd, "zz-new-file", O_WRONLY | O_CREAT | O_CLOEXEC, 0644)); // the mtime changed: read again
+    benchmark_glob(added, 1, &added_fields);
+    long variable_ns = benchmark_glob("\"$HOME/${USER}\"-$?.d/~", GLOBBENCH_WORDS, &variable_fields);
+
+    for (long i = 0; i < files; i++) {
+        snprintf(name, HASH_NAME_SIZE, formats[i % 3], i / 3);
+        unlinkat(dir_fd, name, 0);
+    }
+    unlinkat(dir_fd, "zz-new-file", 0);
+    close(dir_fd);
+    rmdir(dir_path);
+    int length = snprintf(message, sizeof(message), "%ld files: first read %ldms, * %ldms (%.0f names/s)\n"
+                          "data-123*.log: %ldns for %ld names; *7?.txt: %ldus for %ld names, glob(3) %ldus for %ld\n"
+                          "new file %s; $HOME/${USER} word: %ldns; %ld directory reads, %ld cache hits\n",
+                          files, cold_ns / 1000000, all_ns / 1000000, all_ns > 0 ? all_fields * 1e9 / all_ns : 0.0,
+                          prefix_ns, prefix_fields, middle_ns / 1000, middle_fields, libc_ns / 1000, libc_fields,
+                          added_fields == 1 ? "seen" : "missed", variable_ns, dir_cache.reads - reads, dir_cache.hits - hits);
+    write(STDOUT_FILENO, message, length);
+}
+
+static void benchmark_prompt(char *arguments, const struct prompt_template *template, int child_status, long time_ns, const struct rusage *usage) { // promptbench [runs]
+    struct output_buffer scratch = { .fd = -1, .length = 0 }; // rendered and dropped, nothing is written
+    struct timespec time_start;
+    struct timespec time_end;
+    char message[MESSAGE_BUFFER_SIZE];
+    long runs = atol(arguments);
+    size_t length = 0;
+
+    if (runs <= 0) {
+        runs = PROMPTBENCH_DEFAULT_RUNS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    for (long i = 0; i < runs; i++) {
+        scratch.length = 0;
+        render_prompt(template, &scratch, child_status, time_ns, usage);
+        length += scratch.length;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    long total_ns = elapsed_ns(&time_start, &time_end);
+    int message_length = snprintf(message, MESSAGE_BUFFER_SIZE, "%ld prompts of %zu bytes: %.1fns/prompt\n",
+                                  runs, length / runs, (double)total_ns / runs);
+    write(STDOUT_FILENO, message, message_length);
+}
+
+static int run_driver(int argc, char *argv[]) { // harness --driver name [arguments...]: parts of the shell timed or fuzzed in this process
+    const char *engine_name = getenv(SPAWN_ENGINE_ENV);
+    size_t size = 1;
+    int status = 0;
+
+    if (argc < 1) {
+        write_text(STDERR_FILENO, USAGE_MSG);
+        return 2;
+    }
+    for (int i = 1; i < argc; i++) {
+        size += strlen(argv[i]) + 1;
+    }
+    char *arguments = calloc(1, size); // the words after the name, as the shell's line held them
+    if (arguments == NULL) {
+        return 2;
+    }
+    for (int i = 1; i < argc; i++) {
+        strcat(arguments, argv[i]);
+        strcat(arguments, i + 1 < argc ? " " : "");
+    }
+    signal(SIGTTOU, SIG_IGN);
+    event_loop_init(); // bench waits for its commands like the shell does
+    shell_engine = engine_name != NULL && strncmp(engine_name, SPAWN_ENGINE_FORK_NAME, SPAWN_ENGINE_FORK_NAME_LENGTH + 1) == 0 ? SPAWN_ENGINE_FORK : SPAWN_ENGINE_POSIX;
+
+    if (strncmp(argv[0], "bench", 6) == 0) { // repeat a command line and report latency percentiles
+        benchmark_command(arguments, shell_engine);
+    } else if (strncmp(argv[0], "spawnbench", 11) == 0) { // both spawn engines on "true"
+        benchmark_spawn(atoi(arguments) > 0 ? atoi(arguments) : SPAWNBENCH_DEFAULT_ITERATIONS);
+    } else if (strncmp(argv[0], "parsebench", 11) == 0) { // parse one line in a loop
+        benchmark_parser(arguments);
+    } else if (strncmp(argv[0], "parsefuzz", 10) == 0) { // random lines through the parser
+        fuzz_parser(arguments);
+    } else if (strncmp(argv[0], "promptbench", 12) == 0) { // ENSEASH_PROMPT or the default, after a command that succeeded at once
+        const char *format = getenv(PROMPT_FORMAT_ENV);
+        struct prompt_template template = compile_prompt(format != NULL ? format : PROMPT_FORMAT_DEFAULT);
+        struct rusage usage;
+        memset(&usage, 0, sizeof(usage));
+        benchmark_prompt(arguments, &template, 0, 0, &usage);
+        free(template.parts);
+    } else if (strncmp(argv[0], "historybench", 13) == 0) { // append millions of entries to a scratch ring and search them
+        benchmark_history(arguments);
+    } else if (strncmp(argv[0], "completebench", 14) == 0) { // keystrokes and Tab against a PATH of generated executables
+        benchmark_completion(arguments);
+    } else if (strncmp(argv[0], "globbench", 10) == 0) { // globs over a directory of generated files, and variable expansion
+        benchmark_expansion(arguments);
+    } else {
+        write_text(STDERR_FILENO, "harness: drivers are bench, spawnbench, parsebench, parsefuzz, promptbench, historybench, completebench and globbench\n");
+        status = 2;
+    }
+    shell_flush();
+    arena_free(&line_arena);
+    free(arguments);
+    return status;
+}
+
+static int run_connect(const char *path) { // stdin to a Unix socket until EOF, then what comes back to stdout: the client of the daemon tests
+    struct sockaddr_un address;
+    char buffer[LINE_SIZE];
+    ssize_t length;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if (fd < 0 || strlen(path) >= sizeof(address.sun_path) || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        write_text(STDERR_FILENO, "harness: cannot connect\n");
+        return 1;
+    }
+    while ((length = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+        write(fd, buffer, length);
+    }
+    shutdown(fd, SHUT_WR); // the session sees the end of its input and says goodbye
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        write(STDOUT_FILENO, buffer, length);
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int result;
+
+    signal(SIGPIPE, SIG_IGN); // a shell that exited early must fail the test, not kill the harness
+    if (argc < 2) {
+        write_text(STDERR_FILENO, USAGE_MSG);
+        return 2;
+    }
+    if (argc == 3 && strncmp(argv[1], "--connect", 10) == 0) {
+        return run_connect(argv[2]);
+    }
+    if (strncmp(argv[1], "--driver", 9) == 0) {
+        return run_driver(argc - 2, argv + 2);
+    }
+    harness_path = argv[0];
+    if (mkdtemp(temp_dir) == NULL || create_script("hello", "#!/bin/sh\necho hello from script\n") < 0
+        || create_script("fail", "#!/bin/sh\nexit 3\n") < 0 || create_script("killself", "#!/bin/sh\nkill -9 $$\n") < 0
+        || create_script("sleeper", "#!/bin/sh\nsleep 0.2\n") < 0) {
+        write_text(STDERR_FILENO, "harness: cannot create the scratch directory\n");
+        return 2;
+    }
+    if (strncmp(argv[1], "--bench", 8) == 0) {
+        result = run_bench(argc - 2, argv + 2);
+    } else {
+        result = run_tests(argc - 1, argv + 1);
+    }
+    remove_temp_dir();
+    return result;
+}